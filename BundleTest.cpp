@@ -0,0 +1,194 @@
+#include "ProtectedBundle.h"
+#include "ProtectedPtr.h"
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// Three objects (a schema, an index list and a permission table) that
+// must change together. The writer publishes new versions of all three
+// in a loop, readers look at all three and check that they belong to
+// the same version. We compare a ProtectedBundle with three separate
+// ProtectedPtrs, which can be seen torn, and report the cost of a
+// single ProtectedPtr read as a baseline.
+
+using namespace std;
+
+typedef chrono::steady_clock Clock;
+
+struct Versioned {
+  explicit Versioned (uint64_t v) : version(v), isValid(true) {
+  }
+  ~Versioned () {
+    isValid = false;
+  }
+  uint64_t version;
+  bool isValid;
+};
+
+struct Schema : Versioned {
+  using Versioned::Versioned;
+};
+
+struct IndexList : Versioned {
+  using Versioned::Versioned;
+};
+
+struct Permissions : Versioned {
+  using Versioned::Versioned;
+};
+
+// Settings, see usage() below:
+int seconds = 2;
+int pauseMicros = 100;
+
+atomic<bool> stop;
+atomic<uint64_t> alarmsSeen;
+mutex mut;
+uint64_t totalReads = 0;
+uint64_t totalTorn = 0;
+
+void check (Versioned const* v) {
+  if (! v->isValid) {
+    alarmsSeen++;
+  }
+}
+
+template<typename Read, typename Publish>
+void run (char const* scheme, int N, Read const& read,
+          Publish const& publish) {
+  stop = false;
+  totalReads = 0;
+  totalTorn = 0;
+  vector<thread> threads;
+  for (int i = 0; i < N; i++) {
+    threads.emplace_back([&read] () -> void {
+      uint64_t count = 0;
+      uint64_t torn = 0;
+      while (! stop) {
+        for (int j = 0; j < 1000; j++) {
+          if (! read()) {
+            torn++;
+          }
+          count++;
+        }
+      }
+      lock_guard<mutex> locker(mut);
+      totalReads += count;
+      totalTorn += torn;
+    });
+  }
+  uint64_t publications = 0;
+  Clock::time_point start = Clock::now();
+  Clock::time_point end = start + chrono::seconds(seconds);
+  while (Clock::now() < end) {
+    publish(++publications);
+    usleep(pauseMicros);
+  }
+  stop = true;
+  for (thread& t : threads) {
+    t.join();
+  }
+  double elapsed = chrono::duration_cast<chrono::nanoseconds>(
+                     Clock::now() - start).count() / 1e9;
+  cout << scheme << "\t" << N << "\t" << totalReads / 1e6 / elapsed << "\t"
+       << totalReads / 1e6 / elapsed / N << "\t" << publications << "\t"
+       << totalTorn << endl;
+}
+
+void runBundle (int N) {
+  ProtectedBundle<Schema, IndexList, Permissions> bundle(
+    make_shared<Schema>(0), make_shared<IndexList>(0),
+    make_shared<Permissions>(0));
+  run("bundle", N, [&bundle] () -> bool {
+    auto snapshot(bundle.read());
+    Schema const* s = snapshot.get<0>();
+    IndexList const* i = snapshot.get<1>();
+    Permissions const* p = snapshot.get<2>();
+    check(s);
+    check(i);
+    check(p);
+    return s->version == i->version && i->version == p->version;
+  }, [&bundle] (uint64_t v) -> void {
+    bundle.publish(make_shared<Schema>(v), make_shared<IndexList>(v),
+                   make_shared<Permissions>(v));
+  });
+}
+
+void runSeparate (int N) {
+  ProtectedPtr<Schema> schema(new Schema(0));
+  ProtectedPtr<IndexList> indexes(new IndexList(0));
+  ProtectedPtr<Permissions> permissions(new Permissions(0));
+  run("separate", N, [&] () -> bool {
+    auto s(schema.read());
+    auto i(indexes.read());
+    auto p(permissions.read());
+    check(s.get());
+    check(i.get());
+    check(p.get());
+    return s->version == i->version && i->version == p->version;
+  }, [&] (uint64_t v) -> void {
+    schema.publish(new Schema(v));
+    indexes.publish(new IndexList(v));
+    permissions.publish(new Permissions(v));
+  });
+}
+
+void runSingle (int N) {
+  ProtectedPtr<Schema> schema(new Schema(0));
+  run("single", N, [&] () -> bool {
+    auto s(schema.read());
+    check(s.get());
+    return true;
+  }, [&] (uint64_t v) -> void {
+    schema.publish(new Schema(v));
+  });
+}
+
+void usage () {
+  cout << "Usage: BundleTest [-t SECONDS] [-p PAUSEMICROS] THREADS...\n"
+       << "  defaults: -t " << seconds << " -p " << pauseMicros << endl;
+}
+
+int main (int argc, char* argv[]) {
+  vector<int> threadCounts;
+  for (int i = 1; i < argc; i++) {
+    if (argv[i][0] == '-' && i + 1 < argc) {
+      switch (argv[i][1]) {
+        case 't': seconds = atoi(argv[++i]); continue;
+        case 'p': pauseMicros = atoi(argv[++i]); continue;
+      }
+      usage();
+      return 1;
+    }
+    int n = atoi(argv[i]);
+    if (n <= 0) {
+      usage();
+      return 1;
+    }
+    threadCounts.push_back(n);
+  }
+  if (threadCounts.empty() || seconds <= 0) {
+    usage();
+    return 1;
+  }
+
+  alarmsSeen = 0;
+  cout << "Reads in M/s, torn reads seen:" << endl;
+  cout << "scheme\tthreads\tM/s\tM/s/T\tpubl.\ttorn" << endl;
+  for (int N : threadCounts) {
+    runSingle(N);
+    runBundle(N);
+    runSeparate(N);
+  }
+  cout << "alarms seen: " << alarmsSeen << endl;
+  return 0;
+}
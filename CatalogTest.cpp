@@ -0,0 +1,436 @@
+#include "DataGuardian.h"
+#include "DataProtector.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <shared_mutex>
+#include <string.h>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <stdlib.h>
+#include <unistd.h>
+
+// Catalog benchmark: the protected object is not a two-field struct but
+// a hash map of databases, like in the motivating example in
+// DataProtector.md. Readers do lookups with Zipf-distributed keys, a
+// writer periodically copies the current map, modifies some entries and
+// publishes the copy. We compare the protection schemes in this more
+// realistic setting, in which the read itself takes some time and cache
+// misses on the map dominate for large catalogs.
+
+#define maxN 64
+
+using namespace std;
+
+typedef chrono::steady_clock Clock;
+
+struct DatabaseInfo {
+  uint64_t id;
+  uint64_t version;
+  char name[48];
+};
+
+struct Catalog {
+  Catalog() : version(0), isValid(true) {
+  }
+  ~Catalog() {
+    isValid = false;
+  }
+  unordered_map<uint64_t, DatabaseInfo> databases;
+  uint64_t version;
+  bool isValid;
+};
+
+// Settings, see usage() below:
+size_t nrEntries = 100000;
+int seconds = 10;
+double theta = 0.99;       // Zipf exponent
+int publishMillis = 100;   // interval between two publications
+int changePercent = 1;     // percentage of entries changed per version
+
+// The five contenders:
+Catalog const* unprotected = nullptr;
+DataGuardian<Catalog, maxN> guardian;
+atomic<Catalog const*> pointerToData(nullptr);
+DataProtector<64> protector;
+shared_mutex sharedMutex;
+Catalog const* underSharedMutex = nullptr;
+atomic<shared_ptr<Catalog const>> atomicSharedPtr;
+
+// Each reader thread works through its own precomputed sequence of keys,
+// such that the random number generation is not part of the measurement:
+size_t const keysPerThread = 1 << 16;
+vector<vector<uint64_t>> keys;
+
+mutex mut;
+uint64_t total = 0;
+uint64_t hits = 0;
+atomic<uint64_t> nullptrsSeen;
+atomic<uint64_t> alarmsSeen;
+atomic<bool> stopWriter;
+atomic<uint64_t> versionsPublished;
+
+// Set by the writer once version 0 is published, the readers are only
+// started then:
+mutex initialMutex;
+condition_variable initialCond;
+bool initialPublished = false;
+
+void announceInitial () {
+  {
+    lock_guard<mutex> locker(initialMutex);
+    initialPublished = true;
+  }
+  initialCond.notify_all();
+}
+
+void waitForInitial () {
+  unique_lock<mutex> locker(initialMutex);
+  initialCond.wait(locker, [] () -> bool { return initialPublished; });
+}
+
+// Draws keys from {0, ..., n-1} with probability proportional to
+// 1/(k+1)^theta, using the inverse of the cumulative distribution:
+class ZipfGenerator {
+    vector<double> _cdf;
+
+  public:
+    ZipfGenerator (size_t n, double theta) : _cdf(n) {
+      double sum = 0;
+      for (size_t k = 0; k < n; k++) {
+        sum += 1.0 / pow(static_cast<double>(k + 1), theta);
+        _cdf[k] = sum;
+      }
+      for (size_t k = 0; k < n; k++) {
+        _cdf[k] /= sum;
+      }
+    }
+
+    template<typename Rng>
+    uint64_t operator() (Rng& rng) {
+      double u = uniform_real_distribution<double>(0.0, 1.0)(rng);
+      return lower_bound(_cdf.begin(), _cdf.end(), u) - _cdf.begin();
+    }
+};
+
+// The popular keys should not be the small ones, otherwise the hot
+// entries would cluster in a few buckets. We scramble with an odd
+// multiplier, which is a bijection on 64-bit integers:
+uint64_t scramble (uint64_t k) {
+  return k * 0x9E3779B97F4A7C15ULL;
+}
+
+Catalog* makeInitialCatalog () {
+  Catalog* c = new Catalog();
+  c->databases.reserve(nrEntries);
+  for (size_t k = 0; k < nrEntries; k++) {
+    DatabaseInfo info;
+    info.id = scramble(k);
+    info.version = 0;
+    snprintf(info.name, sizeof(info.name), "database-%zu", k);
+    c->databases.emplace(info.id, info);
+  }
+  return c;
+}
+
+// The writer copies the current version and changes some entries:
+Catalog* makeNextVersion (Catalog const* old, mt19937_64& rng) {
+  Catalog* c = new Catalog(*old);
+  c->isValid = true;
+  c->version = old->version + 1;
+  size_t changes = max<size_t>(1, nrEntries * changePercent / 100);
+  uniform_int_distribution<uint64_t> pick(0, nrEntries - 1);
+  for (size_t i = 0; i < changes; i++) {
+    auto it = c->databases.find(scramble(pick(rng)));
+    if (it != c->databases.end()) {
+      it->second.version = c->version;
+    }
+  }
+  return c;
+}
+
+// Returns true if the key was found:
+inline bool lookup (Catalog const* c, uint64_t key) {
+  if (c == nullptr) {
+    nullptrsSeen++;
+    return false;
+  }
+  bool found = c->databases.find(key) != c->databases.end();
+  if (! c->isValid) {
+    alarmsSeen++;
+  }
+  return found;
+}
+
+// All readers have the same structure, only the protection differs.
+// The hits are counted per thread, a shared counter would make all
+// readers write to the same cache line:
+template<typename F>
+void readLoop (int id, F const& oneLookup) {
+  uint64_t count = 0;
+  uint64_t found = 0;
+  vector<uint64_t> const& myKeys = keys[id];
+  size_t pos = 0;
+  Clock::time_point end = Clock::now() + chrono::seconds(seconds);
+  while (Clock::now() < end) {
+    for (int i = 0; i < 1000; i++) {
+      count++;
+      found += oneLookup(myKeys[pos]);
+      pos = (pos + 1) & (keysPerThread - 1);
+    }
+  }
+  lock_guard<mutex> locker(mut);
+  total += count;
+  hits += found;
+}
+
+void reader_unprotected (int id) {
+  readLoop(id, [] (uint64_t key) {
+    return lookup(unprotected, key);
+  });
+}
+
+void reader_guardian (int id) {
+  readLoop(id, [id] (uint64_t key) {
+    bool found = lookup(guardian.lease(id), key);
+    guardian.unlease(id);
+    return found;
+  });
+}
+
+void reader_protector (int id) {
+  readLoop(id, [] (uint64_t key) {
+    auto unuser(protector.use());
+    return lookup(pointerToData, key);
+  });
+}
+
+void reader_shared_mutex (int id) {
+  readLoop(id, [] (uint64_t key) {
+    shared_lock<shared_mutex> locker(sharedMutex);
+    return lookup(underSharedMutex, key);
+  });
+}
+
+void reader_atomic_shared_ptr (int id) {
+  readLoop(id, [] (uint64_t key) {
+    shared_ptr<Catalog const> p = atomicSharedPtr.load();
+    return lookup(p.get(), key);
+  });
+}
+
+// The writers publish a new version every publishMillis until told to
+// stop. The unprotected writer has no way to know when the readers are
+// done, so it just keeps the last few versions alive for a second,
+// which is of course no guarantee at all.
+void writer_unprotected () {
+  mt19937_64 rng(1);
+  deque<pair<Clock::time_point, Catalog const*>> old;
+  unprotected = makeInitialCatalog();
+  announceInitial();
+  while (! stopWriter) {
+    Catalog const* q = unprotected;
+    unprotected = makeNextVersion(q, rng);
+    versionsPublished++;
+    old.emplace_back(Clock::now(), q);
+    while (! old.empty() &&
+           old.front().first + chrono::seconds(1) < Clock::now()) {
+      delete old.front().second;
+      old.pop_front();
+    }
+    usleep(publishMillis * 1000);
+  }
+  for (auto& p : old) {
+    delete p.second;
+  }
+  delete unprotected;
+  unprotected = nullptr;
+}
+
+void writer_guardian () {
+  mt19937_64 rng(1);
+  Catalog const* current = makeInitialCatalog();
+  guardian.exchange(current);
+  announceInitial();
+  while (! stopWriter) {
+    // Only the writer exchanges, so current is still valid here:
+    Catalog const* next = makeNextVersion(current, rng);
+    guardian.exchange(next);
+    current = next;
+    versionsPublished++;
+    usleep(publishMillis * 1000);
+  }
+  guardian.exchange(nullptr);
+}
+
+void writer_protector () {
+  mt19937_64 rng(1);
+  pointerToData = makeInitialCatalog();
+  announceInitial();
+  while (! stopWriter) {
+    Catalog const* q = pointerToData;
+    pointerToData = makeNextVersion(q, rng);
+    protector.scan();
+    delete q;
+    versionsPublished++;
+    usleep(publishMillis * 1000);
+  }
+  Catalog const* q = pointerToData;
+  pointerToData = nullptr;
+  protector.scan();
+  delete q;
+}
+
+void writer_shared_mutex () {
+  mt19937_64 rng(1);
+  {
+    lock_guard<shared_mutex> locker(sharedMutex);
+    underSharedMutex = makeInitialCatalog();
+  }
+  announceInitial();
+  while (! stopWriter) {
+    // Only the writer changes the pointer, so it may copy without lock:
+    Catalog const* q = underSharedMutex;
+    Catalog const* p = makeNextVersion(q, rng);
+    {
+      lock_guard<shared_mutex> locker(sharedMutex);
+      underSharedMutex = p;
+    }
+    delete q;
+    versionsPublished++;
+    usleep(publishMillis * 1000);
+  }
+  lock_guard<shared_mutex> locker(sharedMutex);
+  delete underSharedMutex;
+  underSharedMutex = nullptr;
+}
+
+void writer_atomic_shared_ptr () {
+  mt19937_64 rng(1);
+  atomicSharedPtr.store(shared_ptr<Catalog const>(makeInitialCatalog()));
+  announceInitial();
+  while (! stopWriter) {
+    shared_ptr<Catalog const> q = atomicSharedPtr.load();
+    atomicSharedPtr.store(shared_ptr<Catalog const>(makeNextVersion(q.get(),
+                                                                    rng)));
+    versionsPublished++;
+    usleep(publishMillis * 1000);
+  }
+  atomicSharedPtr.store(nullptr);
+}
+
+struct Mode {
+  char const* name;
+  void (*writer)();
+  void (*reader)(int);
+};
+
+Mode modes[] = {
+  {"protector", writer_protector, reader_protector},
+  {"guardian", writer_guardian, reader_guardian},
+  {"std::shared_mutex", writer_shared_mutex, reader_shared_mutex},
+  {"atomic<shared_ptr>", writer_atomic_shared_ptr, reader_atomic_shared_ptr},
+  {"unprotected", writer_unprotected, reader_unprotected}
+};
+
+void usage () {
+  cout << "Usage: CatalogTest [-n ENTRIES] [-t SECONDS] [-z THETA]\n"
+       << "                   [-p PUBLISHMS] [-c CHANGEPERCENT] THREADS...\n"
+       << "  defaults: -n " << nrEntries << " -t " << seconds << " -z "
+       << theta << " -p " << publishMillis << " -c " << changePercent
+       << endl;
+}
+
+int main (int argc, char* argv[]) {
+  vector<int> threadCounts;
+  for (int i = 1; i < argc; i++) {
+    if (argv[i][0] == '-' && i + 1 < argc) {
+      switch (argv[i][1]) {
+        case 'n': nrEntries = strtoull(argv[++i], nullptr, 10); continue;
+        case 't': seconds = atoi(argv[++i]); continue;
+        case 'z': theta = atof(argv[++i]); continue;
+        case 'p': publishMillis = atoi(argv[++i]); continue;
+        case 'c': changePercent = atoi(argv[++i]); continue;
+      }
+      usage();
+      return 1;
+    }
+    int n = atoi(argv[i]);
+    if (n <= 0 || n > maxN) {
+      usage();
+      return 1;
+    }
+    threadCounts.push_back(n);
+  }
+  if (threadCounts.empty() || nrEntries == 0 || seconds <= 0) {
+    usage();
+    return 1;
+  }
+
+  cout << "Precomputing Zipf(" << theta << ") keys for " << nrEntries
+       << " entries..." << endl;
+  ZipfGenerator zipf(nrEntries, theta);
+  keys.resize(maxN);
+  for (int t = 0; t < maxN; t++) {
+    mt19937_64 rng(t + 42);
+    keys[t].resize(keysPerThread);
+    for (size_t i = 0; i < keysPerThread; i++) {
+      keys[t][i] = scramble(zipf(rng));
+    }
+  }
+
+  vector<double> totals;
+  vector<double> perthread;
+  vector<int> nrThreads;
+  vector<char const*> names;
+  for (Mode const& mode : modes) {
+    for (int N : threadCounts) {
+      total = 0;
+      hits = 0;
+      nullptrsSeen = 0;
+      alarmsSeen = 0;
+      versionsPublished = 0;
+      stopWriter = false;
+      initialPublished = false;
+      cout << "Mode: " << mode.name << endl;
+      cout << "Nr of threads: " << N << endl;
+
+      thread writerThread(mode.writer);
+      waitForInitial();   // the writer builds version 0 first
+      vector<thread> readerThreads;
+      readerThreads.reserve(N);
+      for (int i = 0; i < N; i++) {
+        readerThreads.emplace_back(mode.reader, i);
+      }
+      for (int i = 0; i < N; i++) {
+        readerThreads[i].join();
+      }
+      stopWriter = true;
+      writerThread.join();
+
+      cout << "Total: " << total/1000000.0/seconds << "M/s, per thread: "
+           << total/1000000.0/N/seconds << "M/(thread*s)" << endl;
+      cout << "Versions published: " << versionsPublished << ", hit rate: "
+           << (total > 0 ? 100.0 * hits / total : 0.0) << "%" << endl;
+      cout << "nullptr values seen: " << nullptrsSeen
+           << ", alarms seen: " << alarmsSeen << endl << endl;
+      totals.push_back(total/1000000.0/seconds);
+      perthread.push_back(total/1000000.0/N/seconds);
+      nrThreads.push_back(N);
+      names.push_back(mode.name);
+    }
+  }
+  for (size_t i = 0; i < totals.size(); i++) {
+    cout << names[i] << "\t" << nrThreads[i] << "\t" << totals[i] << "\t"
+         << perthread[i] << endl;
+  }
+  return 0;
+}
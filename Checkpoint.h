@@ -0,0 +1,198 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H 1
+
+#include <atomic>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ProtectedPtr.h"
+
+// Writes the current version of a ProtectedPtr to a file in a background
+// thread. The version is pinned (see ProtectedPtr.h) for the duration
+// of the write, so the writer can publish new versions and the old ones
+// are reclaimed as usual, only the pinned one is kept until the
+// checkpoint is done:
+//
+//   Checkpointer<Catalog> checkpointer(catalog,
+//     [] (Catalog const& c, CheckpointWriter& out) -> bool {
+//       return out.write(c.data(), c.size());
+//     });
+//   checkpointer.start("catalog.checkpoint");
+//   ...
+//   bool ok = checkpointer.wait();
+//
+// The serializer appends to a CheckpointWriter, which collects the data
+// into large buffers and writes them sequentially with pwrite(). The
+// file is written under a temporary name, synced and then renamed.
+
+class CheckpointWriter {
+
+    int _fd;
+    std::vector<char> _buf;
+    size_t _used;
+    uint64_t _offset;
+    bool _ok;
+
+  public:
+
+    static size_t const BufferSize = 4 << 20;
+
+    CheckpointWriter () : _fd(-1), _buf(BufferSize), _used(0), _offset(0),
+                          _ok(false) {
+    }
+
+    ~CheckpointWriter () {
+      if (_fd >= 0) {
+        ::close(_fd);
+      }
+    }
+
+    bool open (std::string const& path) {
+      _fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      _used = 0;
+      _offset = 0;
+      _ok = _fd >= 0;
+#ifdef POSIX_FADV_SEQUENTIAL
+      if (_ok) {
+        posix_fadvise(_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+      }
+#endif
+      return _ok;
+    }
+
+    bool write (void const* data, size_t n) {
+      char const* p = static_cast<char const*>(data);
+      while (n > 0 && _ok) {
+        size_t k = BufferSize - _used < n ? BufferSize - _used : n;
+        memcpy(_buf.data() + _used, p, k);
+        _used += k;
+        p += k;
+        n -= k;
+        if (_used == BufferSize) {
+          flush();
+        }
+      }
+      return _ok;
+    }
+
+    // Writes the rest, syncs and closes the file:
+    bool finish () {
+      flush();
+      if (_fd >= 0) {
+        _ok = fdatasync(_fd) == 0 && _ok;
+        _ok = ::close(_fd) == 0 && _ok;
+        _fd = -1;
+      }
+      return _ok;
+    }
+
+    uint64_t bytes () const {
+      return _offset + _used;
+    }
+
+  private:
+
+    void flush () {
+      size_t done = 0;
+      while (done < _used && _ok) {
+        ssize_t w = pwrite(_fd, _buf.data() + done, _used - done,
+                           _offset + done);
+        if (w < 0 && errno == EINTR) {
+          continue;
+        }
+        if (w <= 0) {
+          _ok = false;
+        }
+        else {
+          done += w;
+        }
+      }
+      _offset += done;
+      _used = 0;
+    }
+};
+
+template<typename T, typename Protector = DataProtector<64>>
+class Checkpointer {
+
+  public:
+
+    typedef std::function<bool (T const&, CheckpointWriter&)> Serializer;
+
+  private:
+
+    ProtectedPtr<T, Protector>& _ptr;
+    Serializer _serialize;
+    std::thread _thread;
+    std::atomic<bool> _running;
+    bool _ok;
+    std::atomic<uint64_t> _bytes;   // written by the checkpoint thread
+
+  public:
+
+    Checkpointer (ProtectedPtr<T, Protector>& ptr, Serializer s)
+      : _ptr(ptr), _serialize(s), _running(false), _ok(false), _bytes(0) {
+    }
+
+    ~Checkpointer () {
+      wait();
+    }
+
+    // Pins the current version and starts writing it to path, returns
+    // false if a checkpoint is still running or nothing is published. A
+    // finished checkpoint need not be waited for, its result is then
+    // lost:
+    bool start (std::string const& path) {
+      if (_running) {
+        return false;
+      }
+      if (_thread.joinable()) {
+        _thread.join();
+      }
+      auto pin(_ptr.pin());
+      if (pin.get() == nullptr) {
+        return false;
+      }
+      _running = true;
+      _thread = std::thread(
+        [this, path] (typename ProtectedPtr<T, Protector>::Pin p) -> void {
+          CheckpointWriter out;
+          std::string tmp = path + ".tmp";
+          bool ok = out.open(tmp) && _serialize(*p, out);
+          ok = out.finish() && ok;
+          ok = ok && rename(tmp.c_str(), path.c_str()) == 0;
+          _bytes = out.bytes();
+          _ok = ok;
+          _running = false;
+        }, std::move(pin));
+      return true;
+    }
+
+    bool running () const {
+      return _running;
+    }
+
+    // Waits for the running checkpoint, returns whether the last one
+    // was written completely:
+    bool wait () {
+      if (_thread.joinable()) {
+        _thread.join();
+      }
+      return _ok;
+    }
+
+    // The size of the last checkpoint:
+    uint64_t bytes () const {
+      return _bytes;
+    }
+};
+
+#endif
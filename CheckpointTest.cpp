@@ -0,0 +1,235 @@
+#include "Checkpoint.h"
+#include "ProtectedPtr.h"
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// Writes checkpoints of a large protected catalog back to back while a
+// writer publishes new versions and readers read. We compare a
+// checkpoint that holds a read section for the whole write, which
+// blocks every scan() of the writer for its duration, with the
+// Checkpointer from Checkpoint.h, which pins the version instead. We
+// report the writer's publish latency, the checkpoint throughput and
+// check that every checkpoint file contains exactly one version.
+
+using namespace std;
+
+typedef chrono::steady_clock Clock;
+
+struct Catalog {
+  explicit Catalog (uint64_t v) : version(v), values(nrValues, v) {
+  }
+  uint64_t version;
+  vector<uint64_t> values;   // all equal to version
+  static size_t nrValues;
+};
+
+size_t Catalog::nrValues = 0;
+
+// Settings, see usage() below:
+int seconds = 3;
+size_t megabytes = 64;
+int pauseMicros = 10000;
+string dir = "/tmp";
+
+atomic<bool> stop;
+atomic<uint64_t> alarmsSeen;
+mutex mut;
+uint64_t totalReads = 0;
+
+bool serialize (Catalog const& c, CheckpointWriter& out) {
+  return out.write(c.values.data(), c.values.size() * sizeof(uint64_t));
+}
+
+// Every value in the file must be the same:
+bool verify (string const& path) {
+  FILE* f = fopen(path.c_str(), "rb");
+  if (f == nullptr) {
+    return false;
+  }
+  vector<uint64_t> buf(1 << 16);
+  uint64_t first = 0;
+  size_t total = 0;
+  bool ok = true;
+  size_t n;
+  while ((n = fread(buf.data(), sizeof(uint64_t), buf.size(), f)) > 0) {
+    if (total == 0) {
+      first = buf[0];
+    }
+    for (size_t i = 0; i < n; i++) {
+      ok = ok && buf[i] == first;
+    }
+    total += n;
+  }
+  fclose(f);
+  return ok && total == Catalog::nrValues;
+}
+
+// A pinned version must not be handed back by exchange(), a recycling
+// writer would overwrite it while it is written out:
+bool pinnedVersionStays () {
+  ProtectedPtr<Catalog> catalog(new Catalog(1));
+  bool ok;
+  {
+    auto pin(catalog.pin());
+    ok = catalog.exchange(new Catalog(2)) == nullptr;
+    ok = ok && pin->version == 1;
+  }
+  Catalog const* old = catalog.exchange(new Catalog(3));
+  ok = ok && old != nullptr && old->version == 2;
+  delete old;
+  return ok;
+}
+
+// A finished checkpoint that nobody waited for must not keep start()
+// from running the next one:
+bool restartsWithoutWait (string const& path) {
+  ProtectedPtr<Catalog> catalog(new Catalog(1));
+  Checkpointer<Catalog> checkpointer(catalog, serialize);
+  if (! checkpointer.start(path)) {
+    return false;
+  }
+  while (checkpointer.running()) {
+    usleep(1000);
+  }
+  return checkpointer.start(path) && checkpointer.wait() && verify(path);
+}
+
+void run (bool pinned, string const& path) {
+  ProtectedPtr<Catalog> catalog(new Catalog(0));
+  stop = false;
+  totalReads = 0;
+
+  vector<thread> readers;
+  for (int i = 0; i < 2; i++) {
+    readers.emplace_back([&catalog] () -> void {
+      uint64_t count = 0;
+      while (! stop) {
+        for (int j = 0; j < 1000; j++) {
+          auto guard(catalog.read());
+          if (guard->values[count % Catalog::nrValues] != guard->version) {
+            alarmsSeen++;
+          }
+          count++;
+        }
+      }
+      lock_guard<mutex> locker(mut);
+      totalReads += count;
+    });
+  }
+
+  // The checkpoints:
+  uint64_t checkpoints = 0;
+  uint64_t bytes = 0;
+  uint64_t bad = 0;
+  thread checkpointThread([&] () -> void {
+    Checkpointer<Catalog> checkpointer(catalog, serialize);
+    while (! stop) {
+      if (pinned) {
+        if (! checkpointer.start(path)) {
+          break;
+        }
+        if (! checkpointer.wait()) {
+          bad++;
+        }
+        bytes += checkpointer.bytes();
+      }
+      else {
+        auto guard(catalog.read());
+        CheckpointWriter out;
+        if (! out.open(path) || ! serialize(*guard, out) || ! out.finish()) {
+          bad++;
+        }
+        bytes += out.bytes();
+      }
+      if (! verify(path)) {
+        bad++;
+      }
+      checkpoints++;
+    }
+  });
+
+  // The writer:
+  vector<uint64_t> latencies;
+  Clock::time_point start = Clock::now();
+  Clock::time_point end = start + chrono::seconds(seconds);
+  for (uint64_t v = 1; Clock::now() < end; v++) {
+    Catalog* c = new Catalog(v);
+    Clock::time_point t = Clock::now();
+    catalog.publish(c);
+    latencies.push_back(chrono::duration_cast<chrono::microseconds>(
+                          Clock::now() - t).count());
+    usleep(pauseMicros);
+  }
+  stop = true;
+  checkpointThread.join();
+  for (thread& r : readers) {
+    r.join();
+  }
+  double elapsed = chrono::duration_cast<chrono::nanoseconds>(
+                     Clock::now() - start).count() / 1e9;
+
+  sort(latencies.begin(), latencies.end());
+  size_t n = latencies.size();
+  cout << (pinned ? "pinned" : "read-section") << "\t" << n << "\t"
+       << latencies[n / 2] / 1000.0 << "\t"
+       << latencies[(n * 99) / 100] / 1000.0 << "\t"
+       << latencies[n - 1] / 1000.0 << "\t" << checkpoints << "\t"
+       << bytes / 1e6 / elapsed << "\t" << totalReads / 1e6 / elapsed
+       << "\t" << bad << endl;
+}
+
+void usage () {
+  cout << "Usage: CheckpointTest [-t SECONDS] [-s MEGABYTES] "
+       << "[-p PAUSEMICROS] [-d DIR]\n"
+       << "  defaults: -t " << seconds << " -s " << megabytes << " -p "
+       << pauseMicros << " -d " << dir << endl;
+}
+
+int main (int argc, char* argv[]) {
+  for (int i = 1; i < argc; i++) {
+    if (argv[i][0] == '-' && i + 1 < argc) {
+      switch (argv[i][1]) {
+        case 't': seconds = atoi(argv[++i]); continue;
+        case 's': megabytes = atoi(argv[++i]); continue;
+        case 'p': pauseMicros = atoi(argv[++i]); continue;
+        case 'd': dir = argv[++i]; continue;
+      }
+    }
+    usage();
+    return 1;
+  }
+  if (seconds <= 0 || megabytes == 0) {
+    usage();
+    return 1;
+  }
+  Catalog::nrValues = (megabytes << 20) / sizeof(uint64_t);
+  string path = dir + "/CheckpointTest-" + to_string(getpid());
+
+  alarmsSeen = 0;
+  if (! pinnedVersionStays()) {
+    cout << "ALARM: exchange() handed back a pinned version" << endl;
+    alarmsSeen++;
+  }
+  if (! restartsWithoutWait(path)) {
+    cout << "ALARM: a finished checkpoint blocked the next one" << endl;
+    alarmsSeen++;
+  }
+  cout << "Publish latency in ms, checkpoint and read rates in MB/s "
+       << "and M/s:" << endl;
+  cout << "mode\tpubl.\tmedian\tp99\tmax\tckpts\tMB/s\treads\tbad"
+       << endl;
+  run(false, path);
+  run(true, path);
+  cout << "alarms seen: " << alarmsSeen << endl;
+  unlink(path.c_str());
+  return 0;
+}
@@ -0,0 +1,277 @@
+#include "ProtectedPtr.h"
+#include "WriteCombiner.h"
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// Mutator threads (-m) apply small changes to a configuration with K
+// counters, each change increments one counter, while reader threads
+// look up counters. We compare publishing a new copy for every change
+// with the WriteCombiner, which applies all changes queued within a
+// window and publishes them once. With -v the mutators wait until their change is
+// visible and we report the average time this took. At the end the
+// counters must add up to the number of changes.
+
+using namespace std;
+
+typedef chrono::steady_clock Clock;
+
+struct Config {
+  explicit Config (size_t k) : counters(k, 0), isValid(true) {
+  }
+  Config (Config const& other)
+    : counters(other.counters), isValid(true) {
+  }
+  ~Config () {
+    isValid = false;
+  }
+  vector<uint64_t> counters;
+  bool isValid;
+};
+
+// Settings, see usage() below:
+int seconds = 2;
+size_t nrCounters = 1000;
+int nrMutators = 2;
+int maxDelayMicros = 500;
+size_t maxBatch = 1000;
+bool waitVisible = false;
+
+atomic<bool> stop;
+atomic<uint64_t> alarmsSeen;
+mutex mut;
+uint64_t totalReads = 0;
+uint64_t totalChanges = 0;
+chrono::nanoseconds totalWait(0);
+
+uint64_t nextRandom (uint64_t& x) {
+  x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+  return x >> 33;
+}
+
+void check (Config const* c) {
+  if (! c->isValid) {
+    alarmsSeen++;
+  }
+}
+
+// change(k) increments counter k and returns after it is visible if
+// waitVisible is set, sum() adds up the counters at the end:
+template<typename Read, typename Change, typename Sum>
+void run (char const* scheme, int N, Read const& read, Change const& change,
+          Sum const& sum, uint64_t const& publications) {
+  stop = false;
+  totalReads = 0;
+  totalChanges = 0;
+  totalWait = chrono::nanoseconds(0);
+  vector<thread> threads;
+  for (int i = 0; i < N; i++) {
+    threads.emplace_back([&read, i] () -> void {
+      uint64_t x = i + 1;
+      uint64_t count = 0;
+      while (! stop) {
+        for (int j = 0; j < 1000; j++) {
+          read(nextRandom(x) % nrCounters);
+          count++;
+        }
+      }
+      lock_guard<mutex> locker(mut);
+      totalReads += count;
+    });
+  }
+  for (int i = 0; i < nrMutators; i++) {
+    threads.emplace_back([&change, i] () -> void {
+      uint64_t x = 1000 + i;
+      uint64_t count = 0;
+      chrono::nanoseconds waited(0);
+      while (! stop) {
+        Clock::time_point t = Clock::now();
+        change(nextRandom(x) % nrCounters);
+        if (waitVisible) {
+          waited += Clock::now() - t;
+        }
+        count++;
+      }
+      lock_guard<mutex> locker(mut);
+      totalChanges += count;
+      totalWait += waited;
+    });
+  }
+  Clock::time_point start = Clock::now();
+  sleep(seconds);
+  stop = true;
+  for (thread& t : threads) {
+    t.join();
+  }
+  double elapsed = chrono::duration_cast<chrono::nanoseconds>(
+                     Clock::now() - start).count() / 1e9;
+  uint64_t s = sum();
+  if (s != totalChanges) {
+    cout << "Counters add up to " << s << " instead of " << totalChanges
+         << endl;
+    alarmsSeen++;
+  }
+  cout << scheme << "\t" << N << "\t" << totalReads / 1e6 / elapsed << "\t"
+       << totalChanges / elapsed << "\t" << publications / elapsed << "\t"
+       << (waitVisible ? totalWait.count() / 1e3 / totalChanges : 0.0)
+       << endl;
+}
+
+void runDirect (int N) {
+  ProtectedPtr<Config> config(new Config(nrCounters));
+  mutex writer;
+  uint64_t publications = 0;
+  run("direct", N, [&config] (size_t k) -> void {
+    auto guard(config.read());
+    check(guard.get());
+    if (guard->counters[k] == static_cast<uint64_t>(-1)) {
+      alarmsSeen++;
+    }
+  }, [&] (size_t k) -> void {
+    lock_guard<mutex> locker(writer);
+    Config* next;
+    {
+      auto guard(config.read());
+      next = new Config(*guard);
+    }
+    next->counters[k]++;
+    config.publish(next);
+    publications++;
+  }, [&config] () -> uint64_t {
+    auto guard(config.read());
+    uint64_t s = 0;
+    for (uint64_t c : guard->counters) {
+      s += c;
+    }
+    return s;
+  }, publications);
+}
+
+void runCombiner (int N) {
+  WriteCombiner<Config> config(new Config(nrCounters),
+                               chrono::microseconds(maxDelayMicros),
+                               maxBatch);
+  uint64_t publications = 0;
+  run("combiner", N, [&config] (size_t k) -> void {
+    auto guard(config.read());
+    check(guard.get());
+    if (guard->counters[k] == static_cast<uint64_t>(-1)) {
+      alarmsSeen++;
+    }
+  }, [&config] (size_t k) -> void {
+    uint64_t ticket = config.submit([k] (Config& c) -> void {
+      c.counters[k]++;
+    });
+    if (waitVisible) {
+      config.waitVisible(ticket);
+    }
+  }, [&config, &publications] () -> uint64_t {
+    config.flush();
+    publications = config.batches();
+    auto guard(config.read());
+    uint64_t s = 0;
+    for (uint64_t c : guard->counters) {
+      s += c;
+    }
+    return s;
+  }, publications);
+}
+
+// A mutation that throws must have no effect, its exception must reach
+// waitVisible(), and the mutations around it must be applied once:
+bool failedMutationIsDropped () {
+  WriteCombiner<Config> config(new Config(2), chrono::microseconds(1000),
+                               3);
+  int runs = 0;   // only touched by the combiner thread
+  config.submit([&runs] (Config& c) -> void {
+    c.counters[0]++;
+    runs++;
+  });
+  uint64_t t = config.submit([] (Config& c) -> void {
+    c.counters[0] += 100;
+    throw runtime_error("failed");
+  });
+  config.submit([] (Config& c) -> void { c.counters[1]++; });
+  uint64_t u = config.submit([] (Config&) -> void {
+    throw runtime_error("failed again");
+  });
+  bool thrown = false;
+  try {
+    config.waitVisible(t);
+  }
+  catch (runtime_error const&) {
+    thrown = true;
+  }
+  try {
+    config.waitVisible(u);
+    thrown = false;
+  }
+  catch (runtime_error const&) {
+  }
+  config.flush();
+  auto guard(config.read());
+  return thrown && runs == 1 && guard->counters[0] == 1 &&
+         guard->counters[1] == 1;
+}
+
+void usage () {
+  cout << "Usage: CombineTest [-t SECONDS] [-k COUNTERS] [-m MUTATORS] "
+       << "[-d MAXDELAYMICROS]\n"
+       << "                   [-b MAXBATCH] [-v WAITVISIBLE] THREADS...\n"
+       << "  defaults: -t " << seconds << " -k " << nrCounters << " -m "
+       << nrMutators << " -d " << maxDelayMicros << " -b " << maxBatch
+       << " -v " << waitVisible << endl;
+}
+
+int main (int argc, char* argv[]) {
+  vector<int> threadCounts;
+  for (int i = 1; i < argc; i++) {
+    if (argv[i][0] == '-' && i + 1 < argc) {
+      switch (argv[i][1]) {
+        case 't': seconds = atoi(argv[++i]); continue;
+        case 'k': nrCounters = strtoull(argv[++i], nullptr, 10); continue;
+        case 'm': nrMutators = atoi(argv[++i]); continue;
+        case 'd': maxDelayMicros = atoi(argv[++i]); continue;
+        case 'b': maxBatch = strtoull(argv[++i], nullptr, 10); continue;
+        case 'v': waitVisible = atoi(argv[++i]) != 0; continue;
+      }
+      usage();
+      return 1;
+    }
+    int n = atoi(argv[i]);
+    if (n <= 0) {
+      usage();
+      return 1;
+    }
+    threadCounts.push_back(n);
+  }
+  if (threadCounts.empty() || seconds <= 0 || nrCounters == 0 ||
+      nrMutators <= 0) {
+    usage();
+    return 1;
+  }
+
+  alarmsSeen = 0;
+  if (! failedMutationIsDropped()) {
+    cout << "ALARM: a failed mutation was not handled" << endl;
+    alarmsSeen++;
+  }
+  cout << "Reads in M/s, changes and publications per second, average "
+       << "wait until visible in us:" << endl;
+  cout << "scheme\tthreads\tM/s\tchg/s\tpubl/s\twait" << endl;
+  for (int N : threadCounts) {
+    runDirect(N);
+    runCombiner(N);
+  }
+  cout << "alarms seen: " << alarmsSeen << endl;
+  return 0;
+}
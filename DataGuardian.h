@@ -1,15 +1,32 @@
+#ifndef DATA_GUARDIAN_H
+#define DATA_GUARDIAN_H 1
+
 #include <mutex>
 #include <atomic>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
 #include <unistd.h>
 
 #include <iostream>
 
-template<typename T, int maxNrThreads>
+#include "EventTrace.h"
+#include "ThreadExit.h"
+#include "WaitStrategy.h"
+
+// The Wait parameter selects how exchange() and the destructor wait for
+// readers, see WaitStrategy.h.
+
+template<typename T, int maxNrThreads, typename Wait = SleepWait>
 class DataGuardian {
 
+    // token is only used in _H, for the thread exit cleanup of the
+    // lease, see ThreadExit.h:
     struct TPtr {
       std::atomic<T const*> ptr;
-      char padding[64-sizeof(std::atomic<T const*>)];
+      ThreadExit::Token token;
+      char padding[64-sizeof(std::atomic<T const*>)
+                   -sizeof(ThreadExit::Token)];
     };
 
   public:
@@ -20,16 +37,18 @@ class DataGuardian {
         _H[i].ptr = nullptr;
       }
       _V = 0;
+      _grace.started = 0;
+      _grace.completed = 0;
     }
 
     ~DataGuardian () {
       std::lock_guard<std::mutex> lock(_mutex);
-      while (isHazard(_P[_V].ptr)) {
-        usleep(250);
-      }
-      T const* temp = _P[_V].ptr.load();
+      T const* temp = _P[_V & 1].ptr.load();
+      _wait.waitUntil([this, temp] () -> bool { return ! isHazard(temp); },
+                      0);
+      DP_TRACE(Reclaim, reinterpret_cast<uintptr_t>(temp));
       delete temp;  // OK, if nullptr
-      _P[_V].ptr = nullptr;
+      _P[_V & 1].ptr = nullptr;
     }
 
     bool isHazard (T const* p) {
@@ -42,8 +61,26 @@ class DataGuardian {
       return false;
     }
 
+    // Introspection, for example by the ProtectorRegistry. A slot is
+    // busy while a reader holds a lease with its id:
+    static int slots () {
+      return maxNrThreads;
+    }
+
+    template<typename V>
+    void slotCounts (std::vector<V>& counts) const {
+      counts.resize(maxNrThreads);
+      for (int i = 0; i < maxNrThreads; i++) {
+        counts[i] = _H[i].ptr.load(std::memory_order_relaxed) != nullptr;
+      }
+    }
+
+    size_t memory () const {
+      return sizeof(_P) + sizeof(_H);
+    }
+
     T const* lease (int myId) {
-      int v;
+      uint64_t v;
       T const* p;
 
       while (true) {
@@ -53,7 +90,7 @@ class DataGuardian {
         // implies release semantics. This is important to ensure that
         // we see the changes to _P just before the version _V
         // is flipped.
-        p = _P[v].ptr.load(std::memory_order_relaxed);
+        p = _P[v & 1].ptr.load(std::memory_order_relaxed);
         _H[myId].ptr = p;                  // implicit memory_order_seq_cst
         if (_V.load(std::memory_order_relaxed) != v) {    // (YYY)
           _H[myId].ptr = nullptr;   // implicit memory_order_seq_cst
@@ -61,19 +98,28 @@ class DataGuardian {
         }
         break;
       };
+      _H[myId].token = ThreadExit::enter(this, &repair, myId);
+      DP_TRACE(Use, myId);
       return p;
     }
 
     void unlease (int myId) {
-      _H[myId].ptr = nullptr;   // implicit memory_order_seq_cst
+      DP_TRACE(Unuse, myId);
+      if (ThreadExit::leave(this, myId, _H[myId].token)) {
+        _H[myId].ptr = nullptr;   // implicit memory_order_seq_cst
+        _wait.notify();
+      }
     }
 
-    void exchange (T const* replacement) {
+    // Publishes replacement and returns the previous object once no
+    // reader can see it any more, such that the caller can overwrite it
+    // as the next version instead of deleting it:
+    T const* replace (T const* replacement) {
       std::lock_guard<std::mutex> lock(_mutex);
 
-      int v = _V.load(std::memory_order_relaxed);
-      _P[1-v].ptr.store(replacement, std::memory_order_relaxed);
-      _V = 1-v;      // implicit memory_order_seq_cst, whoever sees this
+      uint64_t v = _V.load(std::memory_order_relaxed);
+      _P[(v + 1) & 1].ptr.store(replacement, std::memory_order_relaxed);
+      _V = v + 1;    // implicit memory_order_seq_cst, whoever sees this
                      // also sees the two above modifications!
       // Our job is essentially done, we only need to destroy
       // the old value. However, this might be unsafe, because there might
@@ -82,21 +128,74 @@ class DataGuardian {
       // indication, they have rechecked the value of _V and have thus
       // confirmed that it was not yet changed. Therefore, we can simply
       // observe _H[*] and wait until none is equal to _P[v]:
-      T const* p = _P[v].ptr.load(std::memory_order_relaxed);
-      while (isHazard(p)) {
-        usleep(250);
-      }
-      // Now it is safe to destroy _P[v]
+      DP_TRACE(ScanStart, 0);
+      _grace.started++;
+      T const* p = _P[v & 1].ptr.load(std::memory_order_relaxed);
+      _wait.waitUntil([this, p] () -> bool { return ! isHazard(p); }, 0);
+      DP_TRACE(ScanEnd, 0);
+      _grace.completed++;
+      // Now it is safe to destroy or reuse _P[v]
+      _P[v & 1].ptr = nullptr;
+      return p;
+    }
+
+    // Publishes replacement without waiting and returns the previous
+    // object, which may only be deleted once isHazard() has returned
+    // false for it, for example by the ReclamationService. This starts
+    // a grace period, whoever waits for it reports its end with
+    // completeGracePeriods():
+    T const* publish (T const* replacement) {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _grace.started++;
+      uint64_t v = _V.load(std::memory_order_relaxed);
+      _P[(v + 1) & 1].ptr.store(replacement, std::memory_order_relaxed);
+      _V = v + 1;    // implicit memory_order_seq_cst
+      return _P[v & 1].ptr.load(std::memory_order_relaxed);
+    }
+
+    void exchange (T const* replacement) {
+      T const* p = replace(replacement);
+      DP_TRACE(Reclaim, reinterpret_cast<uintptr_t>(p));
       delete p;
-      _P[v].ptr = nullptr;
+    }
+
+    void completeGracePeriods (uint64_t n) {
+      _grace.completed += n;
+    }
+
+    // Grace periods started by replace(), exchange() and publish() and
+    // not yet complete, and completed ones, as for the DataProtector:
+    uint64_t gracePeriodsInFlight () const {
+      uint64_t completed = _grace.completed;
+      return _grace.started - completed;
+    }
+
+    uint64_t gracePeriods () const {
+      return _grace.completed;
     }
 
   private:
+
+    // Called at thread exit for a lease the thread never gave back:
+    static void repair (void* guardian, int myId, int) {
+      DataGuardian* g = static_cast<DataGuardian*>(guardian);
+      g->_H[myId].ptr = nullptr;
+      g->_wait.notify();
+    }
+
     TPtr _P[2];
     TPtr _H[maxNrThreads];
-    std::atomic<int> _V;
-    char padding3[64-sizeof(std::atomic<int>)];
+    std::atomic<uint64_t> _V;   // the current version is _P[_V & 1]
+    char padding3[64-sizeof(std::atomic<uint64_t>)];
     std::mutex _mutex;
+    Wait _wait;
+
+    // Only changed by writers, in their own cache line, for statistics:
+    struct alignas(64) GraceCounts {
+      std::atomic<uint64_t> started;
+      std::atomic<uint64_t> completed;
+    };
+    GraceCounts _grace;
 
   // Here is a proof that this is all OK: The mutex only ensures that there is
   // always only at most one mutating thread. All is standard, except that
@@ -113,5 +212,11 @@ class DataGuardian {
   // to _H[myId], after all, it sees its own change to _V. Therefore it is
   // ensured that the delete to _P[v] only happens when all reading threads
   // have terminated their lease through unlease().
+  // This needs that _V never takes a value again, which is why it counts
+  // the versions instead of flipping between 0 and 1: with a single bit,
+  // two changes between (XXX) and (YYY), which publish() makes possible
+  // without waiting, would bring _V back to v, and the reader would
+  // keep the object of the first change, which may be deleted already.
 };
 
+#endif
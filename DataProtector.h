@@ -1,36 +1,77 @@
+#ifndef DATA_PROTECTOR_H
+#define DATA_PROTECTOR_H 1
+
 #include <atomic>
+#include <chrono>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
 #include <unistd.h>
 
-template<int Nr>
+#include "EventTrace.h"
+#include "MemoryOrderPolicy.h"
+#include "ThreadExit.h"
+#include "WaitStrategy.h"
+
+// The template parameters besides the number of slots are policies,
+// all defaults give the original behaviour:
+//
+//   Wait     how scan() waits for readers, see WaitStrategy.h
+//   Order    how the counters are changed and which barriers are
+//            used, see MemoryOrderPolicy.h
+//   Align    alignment of the slots in bytes, 128 avoids false sharing
+//            through the adjacent cache line prefetcher on Intel CPUs
+//   Counter  the integer type of the counters
+
+template<int Nr, typename Wait = SleepWait, typename Order = SeqCstOrder,
+         int Align = 64, typename Counter = int>
 class DataProtector {
-    struct alignas(64) Entry {
-      std::atomic<int> _count;
+    struct alignas(Align) Entry {
+      std::atomic<Counter> _count;
     };
 
     Entry* _list;
+    Wait _wait;
 
-    static std::atomic<int> _last;
+    // Only changed by writers, in their own cache line, for statistics:
+    struct alignas(64) GraceCounts {
+      std::atomic<uint64_t> started;
+      std::atomic<uint64_t> completed;
+    };
+    GraceCounts _grace;
+
+    static std::atomic<unsigned> _last;
+    static std::atomic<int> _occupants[Nr];   // live threads per slot
     static thread_local int _mySlot;
 
   public:
 
-    // A class to automatically unuse the DataProtector:
+    // A class to automatically unuse the DataProtector. It may be moved
+    // to and destroyed by another thread, see ThreadExit.h:
     class UnUser {
         DataProtector* _prot;
         int _id;
+        ThreadExit::Token _token;
 
       public:
-        UnUser (DataProtector* p, int i) : _prot(p), _id(i) {
+        UnUser (DataProtector* p, int i, ThreadExit::Token t)
+          : _prot(p), _id(i), _token(t) {
+        }
+
+        // The slot this thread uses, only for statistics:
+        int id () const {
+          return _id;
         }
 
         ~UnUser () {
           if (_prot != nullptr) {
-            _prot->unUse(_id);
+            _prot->unUse(_id, _token);
           }
         }
 
         // A move constructor
-        UnUser (UnUser&& that) : _prot(that._prot), _id(that._id) {
+        UnUser (UnUser&& that)
+          : _prot(that._prot), _id(that._id), _token(that._token) {
           // Note that return value optimization will usually avoid
           // this move constructor completely. However, it has to be
           // present for the program to compile.
@@ -44,7 +85,61 @@ class DataProtector {
         UnUser () = delete;
     };
 
+    // An incremental grace period, for writers which cannot block in
+    // scan() for an unbounded time. Every call to step() returns after
+    // at most maxSlots slots have been seen at zero and waits for a busy
+    // slot for at most budget, so the writer can spread the grace period
+    // over the iterations of its own loop. As in scan(), it is enough to
+    // have seen a zero in every slot once.
+    class GracePeriod {
+        DataProtector* _prot;
+        int _next;   // all slots before this one have been seen at zero
+
+      public:
+        explicit GracePeriod (DataProtector* p) : _prot(p), _next(0) {
+        }
+
+        // Returns true when the grace period is complete:
+        bool step (int maxSlots, std::chrono::nanoseconds budget) {
+          if (_next >= Nr) {
+            return true;
+          }
+          std::chrono::steady_clock::time_point deadline
+            = std::chrono::steady_clock::now() + budget;
+          int limit = _next + maxSlots < Nr ? _next + maxSlots : Nr;
+          while (_next < limit) {
+            if (_prot->_list[_next]._count <= 0) {
+              _next++;
+            }
+            else if (std::chrono::steady_clock::now() >= deadline) {
+              return false;
+            }
+            else {
+              cpuRelax();
+            }
+          }
+          if (_next >= Nr) {
+            DP_TRACE(ScanEnd, 0);
+            _prot->_grace.completed++;
+            return true;
+          }
+          return false;
+        }
+
+        bool done () const {
+          return _next >= Nr;
+        }
+
+        // The number of slots done so far, out of Nr:
+        int progress () const {
+          return _next;
+        }
+    };
+
     DataProtector () : _list(nullptr) {
+      Order::init();
+      _grace.started = 0;
+      _grace.completed = 0;
       _list = new Entry[Nr];
       // Just to be sure:
       for (size_t i = 0; i < Nr; i++) {
@@ -58,22 +153,80 @@ class DataProtector {
 
     UnUser use () {
       int id = getMyId();
-      _list[id]._count++;   // this is implicitly using memory_order_seq_cst
-      return UnUser(this, id);  // return value optimization!
+      Order::enter(_list[id]._count);   // seq_cst for the default policy
+      ThreadExit::Token token = ThreadExit::enter(this, &repair, id);
+      DP_TRACE(Use, id);
+      return UnUser(this, id, token);  // return value optimization!
     }
 
     void scan () {
+      DP_TRACE(ScanStart, 0);
+      _grace.started++;
+      Order::beforeScan();
       for (size_t i = 0; i < Nr; i++) {
-        while (_list[i]._count > 0) {
-          usleep(250);
-        }
+        std::atomic<Counter>& count = _list[i]._count;
+        _wait.waitUntil([&count] () -> bool { return count <= 0; }, i);
       }
+      DP_TRACE(ScanEnd, 0);
+      _grace.completed++;
+    }
+
+    // Starts an incremental grace period, call this after publishing
+    // the new version, like scan():
+    GracePeriod startGracePeriod () {
+      DP_TRACE(ScanStart, 0);
+      _grace.started++;
+      Order::beforeScan();
+      return GracePeriod(this);
+    }
+
+    // Introspection, for example by the ProtectorRegistry. The values
+    // are read without synchronization and can be outdated at once:
+    static int slots () {
+      return Nr;
+    }
+
+    // The number of readers in each slot:
+    template<typename V>
+    void slotCounts (std::vector<V>& counts) const {
+      counts.resize(Nr);
+      for (int i = 0; i < Nr; i++) {
+        counts[i] = _list[i]._count.load(std::memory_order_relaxed);
+      }
+    }
+
+    size_t memory () const {
+      return sizeof(Entry) * Nr;
+    }
+
+    // Grace periods started and not yet complete, and completed ones. A
+    // GracePeriod that is abandoned stays in flight:
+    uint64_t gracePeriodsInFlight () const {
+      uint64_t completed = _grace.completed;
+      return _grace.started - completed;
+    }
+
+    uint64_t gracePeriods () const {
+      return _grace.completed;
     }
 
   private:
 
-    void unUse (int id) {
-      _list[id]._count--;   // this is implicitly using memory_order_seq_cst
+    void unUse (int id, ThreadExit::Token token) {
+      DP_TRACE(Unuse, id);
+      if (ThreadExit::leave(this, id, token)) {
+        Order::leave(_list[id]._count);   // seq_cst for the default policy
+        _wait.notify();
+      }
+    }
+
+    // Called at thread exit for read sections the thread never left:
+    static void repair (void* prot, int id, int count) {
+      DataProtector* p = static_cast<DataProtector*>(prot);
+      for (int i = 0; i < count; i++) {
+        Order::leave(p->_list[id]._count);
+      }
+      p->_wait.notify();
     }
 
     int getMyId () {
@@ -81,17 +234,49 @@ class DataProtector {
       if (id >= 0) {
         return id;
       }
-      while (true) {
-        int newId = _last + 1;
-        if (newId >= Nr) {
-          newId = 0;
-        }
-        if (_last.compare_exchange_strong(id, newId)) {
-          _mySlot = newId;
-          return newId;
+      return registerThread();
+    }
+
+    // Chooses a slot for this thread: a slot that no live thread uses,
+    // starting the search at the next slot in round robin order, or the
+    // least used one if there is none. The slot is given back when the
+    // thread terminates, so threads that come and go do not pile up on
+    // some slots.
+    int registerThread () {
+      int start = static_cast<int>(_last++ % Nr);
+      int best = start;
+      int bestCount = _occupants[start];
+      for (int k = 1; k < Nr && bestCount > 0; k++) {
+        int i = (start + k) % Nr;
+        int c = _occupants[i];
+        if (c < bestCount) {
+          best = i;
+          bestCount = c;
         }
       }
+      _occupants[best]++;
+      _mySlot = best;
+      ThreadExit::onExit(&releaseSlot, nullptr, best);
+      return best;
+    }
+
+    static void releaseSlot (void*, int id) {
+      _occupants[id]--;
     }
 
 };
 
+// The definitions of the static members have to be visible in every
+// translation unit that uses a DataProtector, otherwise some compilers
+// generate a call to a non-existing TLS init function for _mySlot:
+template<int Nr, typename Wait, typename Order, int Align, typename Counter>
+thread_local int DataProtector<Nr, Wait, Order, Align, Counter>::_mySlot
+  = -1;
+template<int Nr, typename Wait, typename Order, int Align, typename Counter>
+std::atomic<unsigned>
+DataProtector<Nr, Wait, Order, Align, Counter>::_last(0);
+template<int Nr, typename Wait, typename Order, int Align, typename Counter>
+std::atomic<int>
+DataProtector<Nr, Wait, Order, Align, Counter>::_occupants[Nr] = {};
+
+#endif
@@ -1,7 +1,16 @@
 #include "DataGuardian.h"
 #include "DataProtector.h"
+#include "DynamicDataGuardian.h"
+#include "RecyclePool.h"
+#include "SeqLock.h"
+#include "SpinLock.h"
 
+#include <algorithm>
+#include <chrono>
 #include <iostream>
+#include <memory>
+#include <shared_mutex>
+#include <string>
 #include <thread>
 #include <vector>
 #include <time.h>
@@ -23,6 +32,7 @@ struct DataToBeProtected {
 
 DataToBeProtected const* unprotected = nullptr;
 DataGuardian<DataToBeProtected, maxN> guardian;
+DynamicDataGuardian<DataToBeProtected> dynamicGuardian;
 
 atomic<DataToBeProtected*> pointerToData(nullptr);
 
@@ -35,8 +45,19 @@ uint64_t total = 0;
 atomic<uint64_t> nullptrsSeen;
 atomic<uint64_t> alarmsSeen;
 
-shared_ptr<DataToBeProtected> global_shared_ptr;
-thread_local shared_ptr<DataToBeProtected> thread_local_shared_ptr;
+SpinLock spinLock;
+shared_mutex sharedMutex;
+
+atomic<shared_ptr<DataToBeProtected const>> global_shared_ptr;
+
+// The seqlock protects a copy of the data and not a pointer to it, an
+// invalid value plays the role of the nullptr:
+struct SeqLockData {
+  int nr;
+  bool isValid;
+};
+
+SeqLock<SeqLockData> seqLock(SeqLockData{0, false});
 
 void reader_guardian (int id) {
   uint64_t count = 0;
@@ -60,6 +81,28 @@ void reader_guardian (int id) {
   total += count;
 }
 
+void reader_dynamic_guardian (int) {
+  uint64_t count = 0;
+  time_t start = time(nullptr);
+  while (time(nullptr) < start + T) {
+    for (int i = 0; i < 1000; i++) {
+      count++;
+      DataToBeProtected const* p = dynamicGuardian.lease();
+      if (p == nullptr) {
+        nullptrsSeen++;
+      }
+      else {
+        if (! p->isValid) {
+          alarmsSeen++;
+        }
+      }
+      dynamicGuardian.unlease();
+    }
+  }
+  lock_guard<mutex> locker(mut);
+  total += count;
+}
+
 void reader_protector (int id) {
   uint64_t count = 0;
   time_t start = time(nullptr);
@@ -125,21 +168,62 @@ void reader_mutex (int) {
   total += count;
 }
 
-void reader_shared_ptr(int) {
+void reader_spinlock (int) {
   uint64_t count = 0;
   time_t start = time(nullptr);
   while (time(nullptr) < start + T) {
     for (int i = 0; i < 1000; i++) {
       count++;
-      atomic_thread_fence(memory_order_consume);
-      if (thread_local_shared_ptr != global_shared_ptr) {
-        thread_local_shared_ptr = atomic_load(&global_shared_ptr);
+      lock_guard<SpinLock> locker(spinLock);
+      DataToBeProtected const* p = unprotected;
+      if (p == nullptr) {
+        nullptrsSeen++;
+      }
+      else {
+        if (! p->isValid) {
+          alarmsSeen++;
+        }
+      }
+    }
+  }
+  lock_guard<mutex> locker(mut);
+  total += count;
+}
+
+void reader_shared_mutex (int) {
+  uint64_t count = 0;
+  time_t start = time(nullptr);
+  while (time(nullptr) < start + T) {
+    for (int i = 0; i < 1000; i++) {
+      count++;
+      shared_lock<shared_mutex> locker(sharedMutex);
+      DataToBeProtected const* p = unprotected;
+      if (p == nullptr) {
+        nullptrsSeen++;
+      }
+      else {
+        if (! p->isValid) {
+          alarmsSeen++;
+        }
       }
-      if (thread_local_shared_ptr == nullptr) {
+    }
+  }
+  lock_guard<mutex> locker(mut);
+  total += count;
+}
+
+void reader_shared_ptr (int) {
+  uint64_t count = 0;
+  time_t start = time(nullptr);
+  while (time(nullptr) < start + T) {
+    for (int i = 0; i < 1000; i++) {
+      count++;
+      shared_ptr<DataToBeProtected const> p = global_shared_ptr.load();
+      if (p == nullptr) {
         nullptrsSeen++;
       }
       else {
-        if (! thread_local_shared_ptr->isValid) {
+        if (! p->isValid) {
           alarmsSeen++;
         }
       }
@@ -149,6 +233,21 @@ void reader_shared_ptr(int) {
   total += count;
 }
 
+void reader_seqlock (int) {
+  uint64_t count = 0;
+  time_t start = time(nullptr);
+  while (time(nullptr) < start + T) {
+    for (int i = 0; i < 1000; i++) {
+      count++;
+      SeqLockData d = seqLock.read();
+      if (! d.isValid) {
+        nullptrsSeen++;
+      }
+    }
+  }
+  lock_guard<mutex> locker(mut);
+  total += count;
+}
 
 void writer_guardian () {
   DataToBeProtected* p;
@@ -160,6 +259,16 @@ void writer_guardian () {
   guardian.exchange(nullptr);
 }
 
+void writer_dynamic_guardian () {
+  DataToBeProtected* p;
+  for (int i = 0; i < T+2; i++) {
+    p = new DataToBeProtected(i);
+    dynamicGuardian.exchange(p);
+    usleep(1000000);
+  }
+  dynamicGuardian.exchange(nullptr);
+}
+
 void writer_protector () {
   DataToBeProtected* p;
   DataToBeProtected* q;
@@ -168,6 +277,7 @@ void writer_protector () {
     q = pointerToData;
     pointerToData = p;
     protector.scan();
+    DP_TRACE(Reclaim, reinterpret_cast<uintptr_t>(q));
     delete q;
     usleep(1000000);
   }
@@ -177,6 +287,86 @@ void writer_protector () {
   delete q;
 }
 
+// The recycle modes overwrite the old version as the next one instead
+// of deleting it:
+RecyclePool<DataToBeProtected> recyclePool(2);
+
+DataToBeProtected* recycled (int i) {
+  DataToBeProtected* p = recyclePool.get();
+  if (p == nullptr) {
+    return new DataToBeProtected(i);
+  }
+  p->nr = i;
+  p->isValid = true;
+  return p;
+}
+
+void writer_protector_recycle () {
+  DataToBeProtected* p;
+  DataToBeProtected* q;
+  for (int i = 0; i < T+2; i++) {
+    p = recycled(i);
+    q = pointerToData;
+    pointerToData = p;
+    protector.scan();
+    recyclePool.put(q);
+    usleep(1000000);
+  }
+  q = pointerToData;
+  pointerToData = nullptr;
+  protector.scan();
+  delete q;
+}
+
+void writer_guardian_recycle () {
+  for (int i = 0; i < T+2; i++) {
+    recyclePool.put(guardian.replace(recycled(i)));
+    usleep(1000000);
+  }
+  guardian.exchange(nullptr);
+}
+
+// Like writer_protector, but the grace period is done incrementally
+// between other work, and we report the longest pause of a single step:
+uint64_t incrementalSteps = 0;
+chrono::nanoseconds longestStep(0);
+
+void graceIncrementally () {
+  auto grace = protector.startGracePeriod();
+  while (true) {
+    auto start = chrono::steady_clock::now();
+    bool done = grace.step(16, chrono::microseconds(20));
+    longestStep = max(longestStep, chrono::duration_cast<chrono::nanoseconds>(
+                                     chrono::steady_clock::now() - start));
+    incrementalSteps++;
+    if (done) {
+      return;
+    }
+    usleep(100);   // the writer's other work
+  }
+}
+
+void writer_protector_incremental () {
+  DataToBeProtected* p;
+  DataToBeProtected* q;
+  incrementalSteps = 0;
+  longestStep = chrono::nanoseconds(0);
+  for (int i = 0; i < T+2; i++) {
+    p = new DataToBeProtected(i);
+    q = pointerToData;
+    pointerToData = p;
+    graceIncrementally();
+    delete q;
+    usleep(1000000);
+  }
+  q = pointerToData;
+  pointerToData = nullptr;
+  graceIncrementally();
+  delete q;
+  cout << "Grace periods: " << T+3 << ", steps: " << incrementalSteps
+       << ", longest step: " << longestStep.count() / 1000.0 << "us" << endl;
+}
+
 void writer_unprotected () {
   DataToBeProtected* p;
   for (int i = 0; i < T+2; i++) {
@@ -205,50 +395,180 @@ void writer_mutex () {
   unprotected = nullptr;
 }
 
+void writer_spinlock () {
+  DataToBeProtected* p;
+  for (int i = 0; i < T+2; i++) {
+    p = new DataToBeProtected(i);
+    {
+      lock_guard<SpinLock> locker(spinLock);
+      delete unprotected;
+      unprotected = p;
+    }
+    usleep(1000000);
+  }
+  lock_guard<SpinLock> locker(spinLock);
+  delete unprotected;
+  unprotected = nullptr;
+}
+
+void writer_shared_mutex () {
+  DataToBeProtected* p;
+  for (int i = 0; i < T+2; i++) {
+    p = new DataToBeProtected(i);
+    {
+      lock_guard<shared_mutex> locker(sharedMutex);
+      delete unprotected;
+      unprotected = p;
+    }
+    usleep(1000000);
+  }
+  lock_guard<shared_mutex> locker(sharedMutex);
+  delete unprotected;
+  unprotected = nullptr;
+}
+
 void writer_shared_ptr () {
   for (int i = 0; i < T+2; i++) {
-    atomic_store(&global_shared_ptr, make_shared<DataToBeProtected>(i));
+    global_shared_ptr.store(make_shared<DataToBeProtected const>(i));
     usleep(1000000);
   }
+  global_shared_ptr.store(nullptr);
 }
 
-char const* modes[] = {"guardian", "unprotected", "std::mutex", "std::shared_ptr",
-                       "protector"};
+void writer_seqlock () {
+  for (int i = 0; i < T+2; i++) {
+    seqLock.write(SeqLockData{i, true});
+    usleep(1000000);
+  }
+  seqLock.write(SeqLockData{0, false});
+}
+
+// Nested leases in one thread, on two guardians sharing the records:
+// unlease() must give back the most recent lease of its guardian even
+// if a slot below it was freed and taken again, and leases beyond
+// maxHazards must go to an overflow record.
+bool nestedLeasesWork () {
+  DynamicDataGuardian<DataToBeProtected> a;
+  DynamicDataGuardian<DataToBeProtected> b;
+  DataToBeProtected* v1 = new DataToBeProtected(1);
+  DataToBeProtected* v2 = new DataToBeProtected(2);
+  DataToBeProtected* v3 = new DataToBeProtected(3);
+  bool ok = true;
+  a.publish(v1);
+  ok &= a.lease() == v1;        // slot 0
+  b.lease();                    // slot 1
+  a.publish(v2);
+  ok &= a.lease() == v2;        // slot 2
+  b.unlease();                  // frees slot 1
+  a.publish(v3);
+  ok &= a.lease() == v3;        // slot 1 again, the most recent lease
+  a.unlease();
+  ok &= ! a.isHazard(v3) && a.isHazard(v2) && a.isHazard(v1);
+  a.unlease();
+  a.unlease();
+  ok &= ! a.isHazard(v2) && ! a.isHazard(v1);
+
+  for (int i = 0; i < 10; i++) {
+    ok &= a.lease() == v3;
+  }
+  for (int i = 0; i < 10; i++) {
+    a.unlease();
+  }
+  ok &= ! a.isHazard(v3);
+  delete v1;
+  delete v2;
+  return ok;    // v3 is deleted with a
+}
+
+// Only the original five modes run by default, the others with -a or
+// when selected by name:
+struct Mode {
+  char const* name;
+  void (*writer)();
+  void (*reader)(int);
+  bool byDefault;
+};
+
+Mode modes[] = {
+  {"guardian", writer_guardian, reader_guardian, true},
+  {"guardian-recycle", writer_guardian_recycle, reader_guardian, false},
+  {"dynamic-guardian", writer_dynamic_guardian, reader_dynamic_guardian,
+   false},
+  {"unprotected", writer_unprotected, reader_unprotected, true},
+  {"std::mutex", writer_mutex, reader_mutex, true},
+  {"std::atomic<std::shared_ptr>", writer_shared_ptr, reader_shared_ptr,
+   true},
+  {"protector", writer_protector, reader_protector, true},
+  {"protector-recycle", writer_protector_recycle, reader_protector, false},
+  {"protector-incremental", writer_protector_incremental, reader_protector,
+   false},
+  {"spinlock", writer_spinlock, reader_spinlock, false},
+  {"std::shared_mutex", writer_shared_mutex, reader_shared_mutex, false},
+  {"seqlock", writer_seqlock, reader_seqlock, false}
+};
 
 int main (int argc, char* argv[]) {
   std::vector<double> totals;
   std::vector<double> perthread;
   std::vector<int> nrThreads;
 
-  for (int mode = 0; mode < 5; mode++) {
-    for (int j = 1; j < argc; j++) {
+  // Arguments are numbers of threads, "-m NAME" restricts the run to
+  // some of the modes, such that single results can be reproduced, and
+  // "-a" runs all modes:
+  std::vector<int> threadCounts;
+  std::vector<std::string> selected;
+  bool all = false;
+  for (int j = 1; j < argc; j++) {
+    if (std::string(argv[j]) == "-m" && j + 1 < argc) {
+      selected.push_back(argv[++j]);
+    }
+    else if (std::string(argv[j]) == "-a") {
+      all = true;
+    }
+    else {
+      threadCounts.push_back(atoi(argv[j]));
+    }
+  }
+
+  if (! nestedLeasesWork()) {
+    cout << "ALARM: nested leases of a DynamicDataGuardian are wrong"
+         << endl;
+    return 1;
+  }
+
+#ifdef DATAPROTECTOR_TRACE
+  {
+    // Measure what tracing costs per event:
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < 10000000; i++) {
+      DP_TRACE(Use, i);
+    }
+    auto ns = chrono::duration_cast<chrono::nanoseconds>(
+                chrono::steady_clock::now() - start).count();
+    cout << "Tracing costs " << ns / 1e7 << "ns per event" << endl << endl;
+    EventTrace::reset();
+  }
+#endif
+
+  for (Mode const& mode : modes) {
+    if (selected.empty() ? ! all && ! mode.byDefault
+                         : std::find(selected.begin(), selected.end(),
+                                     mode.name) == selected.end()) {
+      continue;
+    }
+    for (int N : threadCounts) {
       nullptrsSeen = 0;
       alarmsSeen = 0;
       total = 0;
-      int N = atoi(argv[j]);
-      cout << "Mode: " << modes[mode] << endl;
+      cout << "Mode: " << mode.name << endl;
       cout << "Nr of threads: " << N << endl;
       vector<thread> readerThreads;
       readerThreads.reserve(N);
-      thread* writerThread;
-
-      switch (mode) {
-        case 0: writerThread = new thread(writer_guardian); break;
-        case 1: writerThread = new thread(writer_unprotected); break;
-        case 2: writerThread = new thread(writer_mutex); break;
-        case 3: writerThread = new thread(writer_shared_ptr); break;
-        case 4: writerThread = new thread(writer_protector); break;
-      }
-      
+      thread* writerThread = new thread(mode.writer);
+
       usleep(500000);
       for (int i = 0; i < N; i++) {
-        switch (mode) {
-          case 0: readerThreads.emplace_back(reader_guardian, i); break;
-          case 1: readerThreads.emplace_back(reader_unprotected, i); break;
-          case 2: readerThreads.emplace_back(reader_mutex, i); break;
-          case 3: readerThreads.emplace_back(reader_shared_ptr, i); break;
-          case 4: readerThreads.emplace_back(reader_protector, i); break;
-        }
+        readerThreads.emplace_back(mode.reader, i);
       }
       writerThread->join();
       for (int i = 0; i < N; i++) {
@@ -269,6 +589,15 @@ int main (int argc, char* argv[]) {
     std::cout << i << "\t" << nrThreads[i] << "\t" << totals[i] << "\t"
               << perthread[i] << std::endl;
   }
+#ifdef DATAPROTECTOR_TRACE
+  if (EventTrace::dumpChromeJson("DataProtectorTest.trace.json")) {
+    std::cout << "Trace written to DataProtectorTest.trace.json" << std::endl;
+  }
+  if (EventTrace::dropped() > 0) {
+    std::cout << "Events dropped for lack of a ring: "
+              << EventTrace::dropped() << std::endl;
+  }
+#endif
   return 0;
 }
 
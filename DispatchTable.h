@@ -0,0 +1,181 @@
+#ifndef DISPATCH_TABLE_H
+#define DISPATCH_TABLE_H 1
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <stdio.h>
+
+#include "ProtectedPtr.h"
+
+// A table of request handlers which can be reconfigured at runtime. The
+// table itself is immutable and published through a ProtectedPtr, so a
+// lookup and the call of the handler run inside one read section, with
+// no mutex and no reference count:
+//
+//   DispatchTable<std::string, void (Request&)> routes;
+//   routes.set("/status", [] (Request& r) -> void { ... });
+//
+//   if (! routes.call(path, request)) {
+//     notFound(request);
+//   }
+//
+// Every reconfiguration copies the table, changes the copy and publishes
+// it. The handlers are held by shared pointers, so the copy only copies
+// pointers and not the std::function objects with their captured state.
+// The old table is destroyed after the grace period, and with it the
+// last reference to a replaced handler, so a handler can still be
+// running while it is replaced.
+//
+// A handler must not reconfigure the table it is called from, since the
+// grace period would wait for itself. call() notes the tables whose
+// handlers run in this thread, and a reconfiguration from inside one of
+// them reports this on stderr and returns false instead of deadlocking.
+// The same holds for a reconfiguration under a Guard from read(), which
+// is not detected.
+
+template<typename Key, typename Signature,
+         typename Protector = DataProtector<64>>
+class DispatchTable;
+
+template<typename Key, typename R, typename... Args, typename Protector>
+class DispatchTable<Key, R (Args...), Protector> {
+
+  public:
+
+    typedef std::function<R (Args...)> Handler;
+    typedef std::unordered_map<Key, std::shared_ptr<Handler const>> Table;
+    typedef typename ProtectedPtr<Table, Protector>::Guard Guard;
+
+    // What call() returns: whether a handler was found, and its result:
+    typedef typename std::conditional<std::is_void<R>::value, bool,
+                                      std::optional<R>>::type Result;
+
+  private:
+
+    ProtectedPtr<Table, Protector> _table;
+    std::mutex _mutex;   // serializes the reconfigurations
+
+    // The tables whose handlers run in this thread, innermost first:
+    struct Calling {
+      DispatchTable const* table;
+      Calling const* outer;
+    };
+
+    static thread_local Calling const* _calling;
+
+    // Pushes a table onto _calling for the duration of a handler:
+    class CallScope {
+        Calling _c;
+
+      public:
+        explicit CallScope (DispatchTable const* t) : _c{t, _calling} {
+          _calling = &_c;
+        }
+
+        ~CallScope () {
+          _calling = _c.outer;
+        }
+
+        CallScope (CallScope const&) = delete;
+        CallScope& operator= (CallScope const&) = delete;
+    };
+
+  public:
+
+    DispatchTable () : _table(new Table) {
+    }
+
+    // For several lookups under one read section:
+    Guard read () {
+      return _table.read();
+    }
+
+    // Calls the handler for key, if there is one:
+    template<typename... A>
+    Result call (Key const& key, A&&... args) {
+      auto guard(_table.read());
+      auto it = guard->find(key);
+      if (it == guard->end()) {
+        return Result();
+      }
+      CallScope scope(this);
+      if constexpr (std::is_void<R>::value) {
+        (*it->second)(std::forward<A>(args)...);
+        return true;
+      }
+      else {
+        return Result((*it->second)(std::forward<A>(args)...));
+      }
+    }
+
+    // The reconfigurations return false if called from a handler of
+    // this table, see above:
+    bool set (Key const& key, Handler h) {
+      auto p = std::make_shared<Handler const>(std::move(h));
+      return update([&key, &p] (Table& t) -> void {
+        t[key] = std::move(p);
+      });
+    }
+
+    bool erase (Key const& key) {
+      return update([&key] (Table& t) -> void {
+        t.erase(key);
+      });
+    }
+
+    // Replaces the whole table:
+    bool assign (std::unordered_map<Key, Handler> handlers) {
+      if (calledFromHandler()) {
+        return false;
+      }
+      Table* t = new Table;
+      for (auto& h : handlers) {
+        t->emplace(h.first,
+                   std::make_shared<Handler const>(std::move(h.second)));
+      }
+      std::lock_guard<std::mutex> locker(_mutex);
+      _table.publish(t);
+      return true;
+    }
+
+    // Applies any change to a copy of the table and publishes it:
+    template<typename Modify>
+    bool update (Modify const& modify) {
+      if (calledFromHandler()) {
+        return false;
+      }
+      std::lock_guard<std::mutex> locker(_mutex);
+      Table* copy;
+      {
+        auto guard(_table.read());
+        copy = new Table(*guard);
+      }
+      modify(*copy);
+      _table.publish(copy);
+      return true;
+    }
+
+  private:
+
+    bool calledFromHandler () const {
+      for (Calling const* c = _calling; c != nullptr; c = c->outer) {
+        if (c->table == this) {
+          fprintf(stderr, "DispatchTable: a handler tried to reconfigure "
+                  "the table it was called from, which would deadlock\n");
+          return true;
+        }
+      }
+      return false;
+    }
+};
+
+template<typename Key, typename R, typename... Args, typename Protector>
+thread_local typename DispatchTable<Key, R (Args...), Protector>::Calling
+  const* DispatchTable<Key, R (Args...), Protector>::_calling = nullptr;
+
+#endif
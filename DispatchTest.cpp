@@ -0,0 +1,210 @@
+#include "DispatchTable.h"
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// A router with K routes dispatches requests to std::function handlers
+// while an operator reconfigures single routes at a fixed interval. We
+// compare the DispatchTable with a std::mutex around the map and with a
+// std::atomic<std::shared_ptr> to an immutable map. Every handler
+// captures a shared state object that knows its route, and the state
+// marks itself as destroyed, so a handler that runs after its state
+// was freed is seen as an alarm.
+
+using namespace std;
+
+typedef chrono::steady_clock Clock;
+
+struct HandlerState {
+  explicit HandlerState (uint64_t r) : route(r), isValid(true) {
+  }
+  ~HandlerState () {
+    isValid = false;
+  }
+  uint64_t route;
+  bool isValid;
+};
+
+typedef function<uint64_t (uint64_t)> Handler;
+typedef unordered_map<uint64_t, Handler> Routes;
+
+// Settings, see usage() below:
+int seconds = 2;
+uint64_t nrRoutes = 64;
+int reconfigureMicros = 1000;
+
+atomic<bool> stop;
+atomic<uint64_t> alarmsSeen;
+mutex mut;
+uint64_t totalCalls = 0;
+
+Handler makeHandler (uint64_t route) {
+  auto state = make_shared<HandlerState>(route);
+  return [state] (uint64_t request) -> uint64_t {
+    if (! state->isValid) {
+      alarmsSeen++;
+    }
+    return request + state->route;
+  };
+}
+
+Routes makeRoutes () {
+  Routes r;
+  for (uint64_t k = 0; k < nrRoutes; k++) {
+    r[k] = makeHandler(k);
+  }
+  return r;
+}
+
+void check (uint64_t request, uint64_t route, uint64_t result) {
+  if (result != request + route) {
+    alarmsSeen++;
+  }
+}
+
+template<typename Call, typename Reconfigure>
+void run (char const* scheme, int N, Call const& call,
+          Reconfigure const& reconfigure) {
+  stop = false;
+  totalCalls = 0;
+  vector<thread> threads;
+  for (int i = 0; i < N; i++) {
+    threads.emplace_back([&call, i] () -> void {
+      uint64_t x = i + 1;
+      uint64_t count = 0;
+      while (! stop) {
+        for (int j = 0; j < 1000; j++) {
+          x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+          call(count, (x >> 33) % nrRoutes);
+          count++;
+        }
+      }
+      lock_guard<mutex> locker(mut);
+      totalCalls += count;
+    });
+  }
+  uint64_t changes = 0;
+  Clock::time_point start = Clock::now();
+  Clock::time_point end = start + chrono::seconds(seconds);
+  while (Clock::now() < end) {
+    usleep(reconfigureMicros);
+    reconfigure(changes++ % nrRoutes);
+  }
+  stop = true;
+  for (thread& t : threads) {
+    t.join();
+  }
+  double elapsed = chrono::duration_cast<chrono::nanoseconds>(
+                     Clock::now() - start).count() / 1e9;
+  cout << scheme << "\t" << N << "\t" << totalCalls / 1e6 / elapsed << "\t"
+       << totalCalls / 1e6 / elapsed / N << "\t" << changes << endl;
+}
+
+void runDispatchTable (int N) {
+  DispatchTable<uint64_t, uint64_t (uint64_t)> table;
+  table.assign(makeRoutes());
+  run("protector", N, [&table] (uint64_t request, uint64_t route) -> void {
+    auto result = table.call(route, request);
+    check(request, route, result ? *result : 0);
+  }, [&table] (uint64_t route) -> void {
+    table.set(route, makeHandler(route));
+  });
+}
+
+void runMutex (int N) {
+  mutex lock;
+  Routes routes = makeRoutes();
+  run("std::mutex", N, [&] (uint64_t request, uint64_t route) -> void {
+    lock_guard<mutex> guard(lock);
+    check(request, route, routes[route](request));
+  }, [&] (uint64_t route) -> void {
+    Handler h = makeHandler(route);
+    lock_guard<mutex> guard(lock);
+    routes[route] = h;
+  });
+}
+
+void runSharedPtr (int N) {
+  atomic<shared_ptr<Routes const>> routes(make_shared<Routes>(makeRoutes()));
+  run("std::atomic<std::shared_ptr>", N,
+      [&] (uint64_t request, uint64_t route) -> void {
+    shared_ptr<Routes const> r = routes.load();
+    check(request, route, r->find(route)->second(request));
+  }, [&] (uint64_t route) -> void {
+    auto copy = make_shared<Routes>(*routes.load());
+    (*copy)[route] = makeHandler(route);
+    routes.store(copy);
+  });
+}
+
+// A handler that reconfigures its own table must be refused instead of
+// waiting for its own read section, one on another table is fine:
+bool reconfigureFromHandlerIsRefused () {
+  DispatchTable<int, bool (int)> table;
+  DispatchTable<int, bool (int)> other;
+  table.set(0, [&] (int) -> bool {
+    return ! table.set(1, [] (int) -> bool { return true; }) &&
+           other.set(1, [] (int) -> bool { return true; });
+  });
+  auto result = table.call(0, 0);
+  return result && *result && ! table.call(1, 0) && other.call(1, 0) &&
+         table.set(1, [] (int) -> bool { return true; });
+}
+
+void usage () {
+  cout << "Usage: DispatchTest [-t SECONDS] [-k ROUTES] "
+       << "[-r RECONFIGUREMICROS] THREADS...\n"
+       << "  defaults: -t " << seconds << " -k " << nrRoutes << " -r "
+       << reconfigureMicros << endl;
+}
+
+int main (int argc, char* argv[]) {
+  vector<int> threadCounts;
+  for (int i = 1; i < argc; i++) {
+    if (argv[i][0] == '-' && i + 1 < argc) {
+      switch (argv[i][1]) {
+        case 't': seconds = atoi(argv[++i]); continue;
+        case 'k': nrRoutes = strtoull(argv[++i], nullptr, 10); continue;
+        case 'r': reconfigureMicros = atoi(argv[++i]); continue;
+      }
+      usage();
+      return 1;
+    }
+    int n = atoi(argv[i]);
+    if (n <= 0) {
+      usage();
+      return 1;
+    }
+    threadCounts.push_back(n);
+  }
+  if (threadCounts.empty() || seconds <= 0 || nrRoutes == 0) {
+    usage();
+    return 1;
+  }
+
+  alarmsSeen = 0;
+  if (! reconfigureFromHandlerIsRefused()) {
+    cout << "ALARM: a handler could reconfigure its own table" << endl;
+    alarmsSeen++;
+  }
+  cout << "Dispatched calls in M/s:" << endl;
+  cout << "scheme\tthreads\tM/s\tM/s/T\tchanges" << endl;
+  for (int N : threadCounts) {
+    runDispatchTable(N);
+    runMutex(N);
+    runSharedPtr(N);
+  }
+  cout << "alarms seen: " << alarmsSeen << endl;
+  return 0;
+}
@@ -0,0 +1,386 @@
+#ifndef DYNAMIC_DATA_GUARDIAN_H
+#define DYNAMIC_DATA_GUARDIAN_H 1
+
+#include <mutex>
+#include <atomic>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "EventTrace.h"
+#include "ThreadExit.h"
+#include "WaitStrategy.h"
+
+// A DataGuardian without a compile-time bound on the number of threads.
+// The hazard pointers live in records in a lock-free singly linked list
+// which only ever grows. A thread acquires a record by setting its
+// active flag with a compare-and-swap, and only if no inactive record
+// is found it allocates a new one and pushes it to the front of the
+// list. A record is given back by clearing the active flag, and is then
+// reused by the next thread that needs one. Therefore the list has as
+// many records as threads have been reading at the same time, and
+// isHazard() only looks at those which are active.
+//
+// As with the slots of the DataProtector, the records are shared by all
+// instances with the same template parameters, which means that they
+// can outlive any single guardian and can be given back at thread exit
+// without knowing the guardian. Records are never freed.
+//
+// A record has maxHazards hazard pointers, each noting the guardian it
+// belongs to and when it was taken, so a thread can hold leases on
+// several guardians of the same type at once, or nested leases on one
+// guardian, which must then be given back in reverse order. unlease()
+// gives back the most recent lease of the guardian, whichever slot it
+// is in. If all slots of a record are taken, a further lease goes to an
+// overflow record which is acquired on demand and given back together
+// with the record.
+//
+// There are two ways to read:
+//
+//   lease() and unlease()           use a record that belongs to this
+//                                   thread, it is acquired with the
+//                                   first lease() and given back when
+//                                   the thread terminates. A lease
+//                                   that is not given back by then is
+//                                   repaired, see ThreadExit.h.
+//   lease(r) and unlease(r)         use a record obtained by acquire()
+//                                   and given back by release(r).
+
+template<typename T, typename Wait = SleepWait, int maxHazards = 4>
+class DynamicDataGuardian {
+
+    struct TPtr {
+      std::atomic<T const*> ptr;
+      char padding[64-sizeof(std::atomic<T const*>)];
+    };
+
+  public:
+
+    struct alignas(64) Record {
+      std::atomic<T const*> ptr[maxHazards];
+      // Only used by the thread holding the record:
+      DynamicDataGuardian const* owner[maxHazards];
+      uint64_t stamp[maxHazards];   // larger for more recent leases
+      uint64_t nextStamp;
+      Record* overflow;   // for leases beyond maxHazards, or nullptr
+      std::atomic<bool> active;
+      Record* next;   // never changes once the record is in the list
+    };
+
+  private:
+
+    static std::atomic<Record*> _records;
+    static std::atomic<int> _nrRecords;
+    static thread_local Record* _myRecord;
+
+  public:
+    DynamicDataGuardian () {
+      _P[0].ptr = nullptr;
+      _P[1].ptr = nullptr;
+      _V = 0;
+      _grace.started = 0;
+      _grace.completed = 0;
+    }
+
+    ~DynamicDataGuardian () {
+      std::lock_guard<std::mutex> lock(_mutex);
+      T const* temp = _P[_V & 1].ptr.load();
+      _wait.waitUntil([this, temp] () -> bool { return ! isHazard(temp); },
+                      0);
+      DP_TRACE(Reclaim, reinterpret_cast<uintptr_t>(temp));
+      delete temp;  // OK, if nullptr
+      _P[_V & 1].ptr = nullptr;
+    }
+
+    // Finds an inactive record and activates it, or adds a new one:
+    static Record* acquire () {
+      for (Record* r = _records.load(); r != nullptr; r = r->next) {
+        bool expected = false;
+        if (! r->active.load(std::memory_order_relaxed) &&
+            r->active.compare_exchange_strong(expected, true)) {
+          return r;
+        }
+      }
+      Record* r = new Record;
+      for (int i = 0; i < maxHazards; i++) {
+        r->ptr[i] = nullptr;
+        r->owner[i] = nullptr;
+        r->stamp[i] = 0;
+      }
+      r->nextStamp = 0;
+      r->overflow = nullptr;
+      r->active = true;
+      Record* head = _records.load();
+      do {
+        r->next = head;
+      } while (! _records.compare_exchange_weak(head, r));
+      _nrRecords++;
+      return r;
+    }
+
+    // Also gives back the overflow records of r:
+    static void release (Record* r) {
+      if (r->overflow != nullptr) {
+        release(r->overflow);
+        r->overflow = nullptr;
+      }
+      for (int i = 0; i < maxHazards; i++) {
+        r->ptr[i] = nullptr;
+        r->owner[i] = nullptr;
+        r->stamp[i] = 0;
+      }
+      r->nextStamp = 0;
+      r->active.store(false, std::memory_order_release);
+    }
+
+    // The number of records ever allocated, which is the largest number
+    // of threads that have held a record at the same time:
+    static int records () {
+      return _nrRecords;
+    }
+
+    // Only active records are scanned, see the proof below:
+    bool isHazard (T const* p) {
+      for (Record* r = _records.load(); r != nullptr; r = r->next) {
+        if (! r->active.load()) {   // memory_order_seq_cst
+          continue;
+        }
+        for (int i = 0; i < maxHazards; i++) {
+          T const* g = r->ptr[i].load(std::memory_order_relaxed);
+          if (g != nullptr && g == p) {
+            return true;
+          }
+        }
+      }
+      return false;
+    }
+
+    // Introspection, for example by the ProtectorRegistry. The records
+    // are shared by all guardians with the same template parameters, a
+    // record counts the leases its thread holds on any of them:
+    static int slots () {
+      return records();
+    }
+
+    template<typename V>
+    void slotCounts (std::vector<V>& counts) const {
+      counts.clear();
+      for (Record* r = _records.load(); r != nullptr; r = r->next) {
+        int busy = 0;
+        if (r->active.load(std::memory_order_relaxed)) {
+          for (int i = 0; i < maxHazards; i++) {
+            busy += r->ptr[i].load(std::memory_order_relaxed) != nullptr;
+          }
+        }
+        counts.push_back(busy);
+      }
+    }
+
+    // Only this guardian, the records are shared and counted by
+    // recordMemory():
+    size_t memory () const {
+      return sizeof(_P);
+    }
+
+    static size_t recordMemory () {
+      return sizeof(Record) * records();
+    }
+
+    T const* lease (Record* r) {
+      uint64_t stamp = ++r->nextStamp;
+      int i = 0;
+      while (r->owner[i] != nullptr) {
+        if (++i == maxHazards) {
+          if (r->overflow == nullptr) {
+            r->overflow = acquire();
+          }
+          r = r->overflow;
+          i = 0;
+        }
+      }
+      r->owner[i] = this;
+      r->stamp[i] = stamp;
+
+      uint64_t v;
+      T const* p;
+
+      while (true) {
+        v = _V.load(std::memory_order_consume);           // (XXX)
+        p = _P[v & 1].ptr.load(std::memory_order_relaxed);
+        r->ptr[i] = p;                     // implicit memory_order_seq_cst
+        if (_V.load(std::memory_order_relaxed) != v) {    // (YYY)
+          r->ptr[i] = nullptr;      // implicit memory_order_seq_cst
+          continue;
+        }
+        break;
+      };
+      DP_TRACE(Use, i);
+      return p;
+    }
+
+    // Gives back the most recent lease of this guardian:
+    void unlease (Record* r) {
+      Record* found = nullptr;
+      int i = 0;
+      for (Record* s = r; s != nullptr; s = s->overflow) {
+        for (int j = 0; j < maxHazards; j++) {
+          if (s->owner[j] == this &&
+              (found == nullptr || s->stamp[j] > found->stamp[i])) {
+            found = s;
+            i = j;
+          }
+        }
+      }
+      if (found == nullptr) {
+        return;   // no lease of this guardian
+      }
+      DP_TRACE(Unuse, i);
+      found->ptr[i] = nullptr;      // implicit memory_order_seq_cst
+      found->owner[i] = nullptr;
+      _wait.notify();
+    }
+
+    T const* lease () {
+      Record* r = _myRecord;
+      if (r == nullptr) {
+        r = registerThread();
+      }
+      return lease(r);
+    }
+
+    void unlease () {
+      Record* r = _myRecord;
+      if (r != nullptr) {   // nullptr if already given back at thread exit
+        unlease(r);
+      }
+    }
+
+    // Publishes replacement and returns the previous object once no
+    // reader can see it any more, such that the caller can overwrite it
+    // as the next version instead of deleting it:
+    T const* replace (T const* replacement) {
+      std::lock_guard<std::mutex> lock(_mutex);
+
+      uint64_t v = _V.load(std::memory_order_relaxed);
+      _P[(v + 1) & 1].ptr.store(replacement, std::memory_order_relaxed);
+      _V = v + 1;    // implicit memory_order_seq_cst
+      DP_TRACE(ScanStart, 0);
+      _grace.started++;
+      T const* p = _P[v & 1].ptr.load(std::memory_order_relaxed);
+      _wait.waitUntil([this, p] () -> bool { return ! isHazard(p); }, 0);
+      DP_TRACE(ScanEnd, 0);
+      _grace.completed++;
+      _P[v & 1].ptr = nullptr;
+      return p;
+    }
+
+    // Publishes replacement without waiting and returns the previous
+    // object, which may only be deleted once isHazard() has returned
+    // false for it, for example by the ReclamationService. This starts
+    // a grace period, whoever waits for it reports its end with
+    // completeGracePeriods():
+    T const* publish (T const* replacement) {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _grace.started++;
+      uint64_t v = _V.load(std::memory_order_relaxed);
+      _P[(v + 1) & 1].ptr.store(replacement, std::memory_order_relaxed);
+      _V = v + 1;    // implicit memory_order_seq_cst
+      return _P[v & 1].ptr.load(std::memory_order_relaxed);
+    }
+
+    void exchange (T const* replacement) {
+      T const* p = replace(replacement);
+      DP_TRACE(Reclaim, reinterpret_cast<uintptr_t>(p));
+      delete p;
+    }
+
+    void completeGracePeriods (uint64_t n) {
+      _grace.completed += n;
+    }
+
+    // Grace periods started by replace(), exchange() and publish() and
+    // not yet complete, and completed ones, as for the DataProtector:
+    uint64_t gracePeriodsInFlight () const {
+      uint64_t completed = _grace.completed;
+      return _grace.started - completed;
+    }
+
+    uint64_t gracePeriods () const {
+      return _grace.completed;
+    }
+
+  private:
+
+    static Record* registerThread () {
+      Record* r = acquire();
+      _myRecord = r;
+      ThreadExit::onExit(&releaseThreadRecord, r, 0);
+      return r;
+    }
+
+    // Called at thread exit. A writer waiting for a lease repaired here
+    // is not notified, since we do not know the guardian, it notices
+    // the next time it polls, see WaitStrategy.h.
+    static void releaseThreadRecord (void* record, int) {
+      Record* r = static_cast<Record*>(record);
+      for (Record* s = r; s != nullptr; s = s->overflow) {
+        for (int i = 0; i < maxHazards; i++) {
+          if (s->ptr[i].load() != nullptr) {
+            fprintf(stderr, "ThreadExit: thread terminated with a lease of "
+                    "a DynamicDataGuardian, repairing\n");
+            ThreadExit::repaired()++;
+          }
+        }
+      }
+      _myRecord = nullptr;
+      release(r);
+    }
+
+    TPtr _P[2];
+    std::atomic<uint64_t> _V;   // the current version is _P[_V & 1]
+    char padding3[64-sizeof(std::atomic<uint64_t>)];
+    std::mutex _mutex;
+    Wait _wait;
+
+    // Only changed by writers, in their own cache line, for statistics:
+    struct alignas(64) GraceCounts {
+      std::atomic<uint64_t> started;
+      std::atomic<uint64_t> completed;
+    };
+    GraceCounts _grace;
+
+  // The proof in DataGuardian.h carries over, with one additional
+  // point: the writer must find the record of every reader that passed
+  // (YYY) before the change to _V. The record was pushed to the list
+  // with a seq_cst compare-and-swap before the reader's store to
+  // r->ptr[i], which precedes the writer's store to _V in the total order,
+  // so the writer's seq_cst load of _records in isHazard() sees the
+  // record or a later head. This holds for overflow records as well,
+  // they are in the list like any other. Records are never removed from
+  // the list, therefore the walk is safe without any further protection.
+  // isHazard() skips inactive records. A reader sets active with a
+  // seq_cst compare-and-swap (or a seq_cst store for a new record)
+  // before its store to r->ptr[i], so if that store precedes the change
+  // to _V in the total order, so does the activation, and the writer's
+  // seq_cst load of active after its change to _V sees true, or the
+  // false of a later release(), which clears the hazard pointers before
+  // and thus ends the lease. The load must be seq_cst for this, an
+  // acquire load could still see the false from before the activation.
+  // A record reused by another thread was cleared by release() before,
+  // so the new owner starts with nullptrs like a fresh record. Which
+  // guardian a hazard pointer belongs to does not matter to isHazard(),
+  // owner[] and stamp[] are only needed to find the slot again in
+  // unlease().
+};
+
+template<typename T, typename Wait, int maxHazards>
+std::atomic<typename DynamicDataGuardian<T, Wait, maxHazards>::Record*>
+DynamicDataGuardian<T, Wait, maxHazards>::_records(nullptr);
+template<typename T, typename Wait, int maxHazards>
+std::atomic<int> DynamicDataGuardian<T, Wait, maxHazards>::_nrRecords(0);
+template<typename T, typename Wait, int maxHazards>
+thread_local typename DynamicDataGuardian<T, Wait, maxHazards>::Record*
+DynamicDataGuardian<T, Wait, maxHazards>::_myRecord = nullptr;
+
+#endif
@@ -0,0 +1,289 @@
+#ifndef EVENT_TRACE_H
+#define EVENT_TRACE_H 1
+
+// Low-overhead per-thread event tracing for the DataProtector and the
+// DataGuardian. Every thread writes its events into its own ring buffer
+// with a single release store, so there is no contention between
+// threads and no locking. Timestamps are taken from the time stamp
+// counter where available. The rings are only read when dumping, which
+// writes Chrome's trace_event JSON format, to be viewed in
+// chrome://tracing or Perfetto.
+//
+// When a thread terminates, its ring is kept until its events have been
+// dumped (or reset()), and then handed to the next thread that starts
+// tracing, so threads that come and go do not add memory. At most
+// MaxRings rings exist, a thread that finds none free records nothing,
+// its events are counted in dropped().
+//
+// Tracing is compiled in only if DATAPROTECTOR_TRACE is defined, in
+// that case DP_TRACE(Type, arg) records an event of type
+// EventTrace::Type. Otherwise DP_TRACE expands to nothing and costs
+// nothing at all.
+
+#ifdef DATAPROTECTOR_TRACE
+
+#include <atomic>
+#include <chrono>
+#include <stdint.h>
+#include <stdio.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+class EventTrace {
+
+  public:
+
+    enum Type : uint32_t {
+      Use = 0,
+      Unuse = 1,
+      ScanStart = 2,
+      ScanEnd = 3,
+      SleepStart = 4,
+      SleepEnd = 5,
+      Reclaim = 6
+    };
+
+    // Number of events kept per thread, older ones are overwritten:
+    static uint64_t const RingSize = 1 << 16;
+
+    // Number of rings (of 1 MiB each) at most:
+    static int const MaxRings = 256;
+
+  private:
+
+    enum RingState : int {
+      Owned = 0,    // a live thread writes into it
+      Exited = 1,   // its thread has terminated, not dumped yet
+      Free = 2      // may be taken by another thread
+    };
+
+    // The owning thread is the only writer. An event is two words, the
+    // timestamp and the type and argument, stored relaxed, published by
+    // the release store to _head. _head only grows, also when the ring
+    // changes hands, the events of the current owner start at _start:
+    struct Ring {
+      std::atomic<uint64_t> _head;
+      char _padding[64 - sizeof(std::atomic<uint64_t>)];
+      Ring* _next;
+      std::atomic<uint64_t> _start;
+      std::atomic<uint32_t> _tid;
+      std::atomic<int> _state;
+      std::atomic<uint64_t> _words[2 * RingSize];
+    };
+
+    // Zero initialized, such that access to it is a plain thread-local
+    // access:
+    struct Mine {
+      Ring* ring;
+      bool exited;   // the destructor of Hook has run
+    };
+
+    struct Hook {
+      ~Hook () {
+        Mine& m = mine();
+        if (m.ring != nullptr) {
+          m.ring->_state.store(Exited, std::memory_order_release);
+          m.ring = nullptr;
+        }
+        m.exited = true;
+      }
+    };
+
+    static std::atomic<Ring*>& rings () {
+      static std::atomic<Ring*> list(nullptr);
+      return list;
+    }
+
+    static std::atomic<uint32_t>& nextTid () {
+      static std::atomic<uint32_t> tid(0);
+      return tid;
+    }
+
+    static std::atomic<int>& nrRings () {
+      static std::atomic<int> n(0);
+      return n;
+    }
+
+    static Mine& mine () {
+      static thread_local Mine m;
+      return m;
+    }
+
+    // The point in time and the counter value at which tracing started,
+    // to convert ticks to microseconds when dumping:
+    struct Epoch {
+      uint64_t ticks;
+      std::chrono::steady_clock::time_point time;
+      Epoch () : ticks(now()), time(std::chrono::steady_clock::now()) {
+      }
+    };
+
+    static Epoch const& epoch () {
+      static Epoch e;
+      return e;
+    }
+
+  public:
+
+    static uint64_t now () {
+#if defined(__x86_64__) || defined(__i386__)
+      return __rdtsc();
+#else
+      return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+    }
+
+    static void record (Type type, uint64_t arg) {
+      Ring* r = mine().ring;
+      if (r == nullptr) {
+        r = registerThread();
+        if (r == nullptr) {
+          dropped().fetch_add(1, std::memory_order_relaxed);
+          return;
+        }
+      }
+      uint64_t h = r->_head.load(std::memory_order_relaxed);
+      uint64_t pos = 2 * (h & (RingSize - 1));
+      r->_words[pos].store(now(), std::memory_order_relaxed);
+      r->_words[pos + 1].store((arg << 8) | type, std::memory_order_relaxed);
+      r->_head.store(h + 1, std::memory_order_release);
+    }
+
+    // The number of events not recorded because no ring was free:
+    static std::atomic<uint64_t>& dropped () {
+      static std::atomic<uint64_t> count(0);
+      return count;
+    }
+
+    // Forgets all events recorded so far and frees the rings of threads
+    // which have terminated. Only call this when no other thread is
+    // tracing at the same time.
+    static void reset () {
+      for (Ring* r = rings().load(); r != nullptr; r = r->_next) {
+        r->_start.store(r->_head.load(), std::memory_order_release);
+        int exited = Exited;
+        r->_state.compare_exchange_strong(exited, Free);
+      }
+    }
+
+    // Writes all events still in the rings to a Chrome trace file. This
+    // can be called while threads are still tracing, events overwritten
+    // during the dump are skipped. The rings of threads which have
+    // terminated are free afterwards. Returns false on I/O errors.
+    static bool dumpChromeJson (char const* path) {
+      FILE* f = fopen(path, "w");
+      if (f == nullptr) {
+        return false;
+      }
+      Epoch const& e = epoch();
+      double ticksPerMicro = 1.0;
+      double elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                         std::chrono::steady_clock::now() - e.time).count();
+      if (elapsed > 0) {
+        ticksPerMicro = (now() - e.ticks) / elapsed * 1000.0;
+      }
+
+      static char const* names[] = {"read", "read", "scan", "scan",
+                                    "sleep", "sleep", "reclaim"};
+      static char const* phases[] = {"B", "E", "B", "E", "B", "E", "i"};
+
+      fprintf(f, "{\"traceEvents\":[\n");
+      bool first = true;
+      for (Ring* r = rings().load(); r != nullptr; r = r->_next) {
+        // Read before the events, so that all of them are seen if the
+        // thread has terminated:
+        int state = r->_state.load(std::memory_order_acquire);
+        if (state == Free) {
+          continue;
+        }
+        uint32_t tid = r->_tid.load(std::memory_order_relaxed);
+        uint64_t head = r->_head.load(std::memory_order_acquire);
+        uint64_t from = head > RingSize ? head - RingSize : 0;
+        uint64_t start = r->_start.load(std::memory_order_relaxed);
+        if (from < start) {
+          from = start;
+        }
+        for (uint64_t i = from; i < head; i++) {
+          uint64_t pos = 2 * (i & (RingSize - 1));
+          uint64_t ticks = r->_words[pos].load(std::memory_order_relaxed);
+          uint64_t word = r->_words[pos + 1].load(std::memory_order_relaxed);
+          std::atomic_thread_fence(std::memory_order_acquire);
+          // The owner might have overwritten this event in the meantime:
+          if (r->_head.load(std::memory_order_relaxed) >= i + RingSize) {
+            continue;
+          }
+          uint32_t type = word & 0xff;
+          if (type > Reclaim || ticks < e.ticks) {
+            continue;
+          }
+          fprintf(f, "%s{\"name\":\"%s\",\"ph\":\"%s\",\"ts\":%.3f,"
+                     "\"pid\":1,\"tid\":%u,\"args\":{\"arg\":%llu}%s}",
+                  first ? "" : ",\n", names[type], phases[type],
+                  (ticks - e.ticks) / ticksPerMicro, tid,
+                  static_cast<unsigned long long>(word >> 8),
+                  type == Reclaim ? ",\"s\":\"t\"" : "");
+          first = false;
+        }
+        if (state == Exited) {
+          r->_state.compare_exchange_strong(state, Free);
+        }
+      }
+      fprintf(f, "\n]}\n");
+      return fclose(f) == 0;
+    }
+
+  private:
+
+    // Takes a free ring or makes a new one, returns nullptr if there is
+    // none. Rings stay in the list and are never freed, such that a dump
+    // can run concurrently:
+    static Ring* registerThread () {
+      Mine& m = mine();
+      if (m.exited) {
+        return nullptr;   // called from a later thread_local destructor
+      }
+      epoch();
+      Ring* r = nullptr;
+      for (Ring* q = rings().load(); q != nullptr; q = q->_next) {
+        int free = Free;
+        if (q->_state.compare_exchange_strong(free, Owned)) {
+          r = q;
+          r->_start.store(r->_head.load(std::memory_order_relaxed),
+                          std::memory_order_relaxed);
+          break;
+        }
+      }
+      if (r == nullptr) {
+        if (nrRings().fetch_add(1) >= MaxRings) {
+          nrRings()--;
+          return nullptr;
+        }
+        r = new Ring();
+        r->_head = 0;
+        r->_start = 0;
+        r->_state = Owned;
+        r->_next = rings().load();
+        while (! rings().compare_exchange_weak(r->_next, r)) {
+        }
+      }
+      r->_tid.store(nextTid()++, std::memory_order_relaxed);
+      static thread_local Hook h;
+      (void) h;
+      m.ring = r;
+      return r;
+    }
+};
+
+#define DP_TRACE(type, arg) \
+  EventTrace::record(EventTrace::type, static_cast<uint64_t>(arg))
+
+#else
+
+#define DP_TRACE(type, arg) do { } while (false)
+
+#endif
+
+#endif
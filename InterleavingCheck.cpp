@@ -0,0 +1,648 @@
+#include <deque>
+#include <iostream>
+#include <string>
+#include <unordered_set>
+#include <vector>
+#include <stdint.h>
+#include <stdlib.h>
+
+// An exhaustive interleaving checker for the read and reclaim protocols
+// of the DataProtector and the DataGuardian. The protocols are written
+// down as small programs, one per thread, and the checker explores
+// every interleaving of their steps with a depth-first search, under a
+// memory model with store buffers:
+//
+//   - every thread has a FIFO store buffer per variable, a relaxed
+//     store goes into it and reaches memory later, in a separate step
+//     that the search schedules like any other, so stores to different
+//     variables can become visible in any order,
+//   - a release store waits until the thread's earlier stores to other
+//     variables have reached memory,
+//   - a seq_cst store and a seq_cst fence wait until the thread's
+//     buffers are empty, and the seq_cst store goes to memory directly,
+//   - a read-modify-write waits until no thread has a buffered store to
+//     the variable, so that it reads the latest value and no two of them
+//     overlap. A relaxed or release one puts its result into the buffer
+//     like a store of the same order, a seq_cst one writes to memory,
+//   - a membarrier (the system call used by AsymmetricOrder) waits
+//     until the buffers of all threads are empty, as it runs a full
+//     barrier on every thread of the process,
+//   - a load sees the thread's own latest buffered store to the
+//     variable, otherwise memory,
+//   - a relaxed store or read-modify-write may be executed ahead of
+//     the loads and uses directly before it, if it does not depend on
+//     them and they do not read its variable, so that a load can be
+//     satisfied after a later relaxed store. A release or seq_cst one
+//     never overtakes an earlier load.
+//
+// This allows the reorderings the protocols have to defend against, a
+// store followed by a load of another variable (the "store buffering"
+// pattern, see MemoryOrderPolicy.h), and the reads of a read section
+// moving past a relaxed store or decrement that ends it. It is an
+// approximation of the C++ memory model and not the model itself:
+// loads are never reordered with later loads, a store overtakes only
+// the loads directly before it, and all threads see memory in the
+// same order. A variant that passes here can still be wrong under
+// those relaxations, a safe result is evidence, not a proof.
+//
+// The protocols below are transcribed by hand from DataProtector.h,
+// MemoryOrderPolicy.h and DataGuardian.h, the checker does not look at
+// the headers. A change to the memory orders there must be made here as
+// well, or the check says nothing about it.
+//
+// Every configuration states whether it must be safe. A safe one must
+// have no interleaving in which a reader uses an object after the
+// writer has freed it, an unsafe one must produce such an interleaving,
+// which is printed as a counterexample. The program exits with 1 if
+// any configuration does not behave as expected. The search remembers
+// the states it has seen, so spin loops and retries terminate.
+
+using namespace std;
+
+enum Order {
+  Relaxed,
+  Release,
+  SeqCst
+};
+
+enum OpCode {
+  Store,       // var = value or register, with order
+  Load,        // reg = var, or reg = var + index register
+  Rmw,         // var += value, with order
+  Fence,       // seq_cst fence
+  Membarrier,  // a full barrier on every thread
+  AwaitZero,   // waits until var is 0
+  AwaitNe,     // waits until var != reg
+  Use,         // reads the object in reg, must not be freed
+  Free,        // frees the object value
+  JumpIfNe,    // jumps to target if reg != reg2
+  Done
+};
+
+struct Instr {
+  OpCode op;
+  int var;       // variable
+  int reg;       // register written or read
+  int reg2;      // second register, -1 if none
+  int value;     // constant to store or free, if reg2 < 0 for Store
+  Order order;
+  int target;    // jump target
+};
+
+int const NrRegs = 4;
+
+// A name like T0 or C1, built with += since g++ 12 warns wrongly about
+// "T" + to_string(i):
+string named (char const* prefix, size_t i) {
+  string s(prefix);
+  s += to_string(i);
+  return s;
+}
+
+Instr store (int var, int value, Order o) {
+  return Instr{Store, var, -1, -1, value, o, 0};
+}
+
+Instr storeReg (int var, int reg, Order o) {
+  return Instr{Store, var, -1, reg, 0, o, 0};
+}
+
+Instr load (int reg, int var) {
+  return Instr{Load, var, reg, -1, 0, SeqCst, 0};
+}
+
+Instr loadIndexed (int reg, int var, int indexReg) {
+  return Instr{Load, var, reg, indexReg, 0, SeqCst, 0};
+}
+
+Instr fetchAdd (int var, int value, Order o) {
+  return Instr{Rmw, var, -1, -1, value, o, 0};
+}
+
+Instr fence () {
+  return Instr{Fence, 0, -1, -1, 0, SeqCst, 0};
+}
+
+Instr membarrier () {
+  return Instr{Membarrier, 0, -1, -1, 0, SeqCst, 0};
+}
+
+Instr awaitZero (int var) {
+  return Instr{AwaitZero, var, -1, -1, 0, SeqCst, 0};
+}
+
+Instr awaitNe (int var, int reg) {
+  return Instr{AwaitNe, var, reg, -1, 0, SeqCst, 0};
+}
+
+Instr use (int reg) {
+  return Instr{Use, 0, reg, -1, 0, SeqCst, 0};
+}
+
+Instr freeObject (int value) {
+  return Instr{Free, 0, -1, -1, value, SeqCst, 0};
+}
+
+Instr jumpIfNe (int reg, int reg2, int target) {
+  return Instr{JumpIfNe, 0, reg, reg2, 0, SeqCst, target};
+}
+
+struct Config {
+  string name;
+  bool safe;                            // expected result
+  vector<string> vars;
+  vector<int> initial;                  // initial values of vars
+  vector<int> initialRegs;              // of every thread
+  vector<vector<Instr>> threads;
+};
+
+struct ThreadState {
+  int pc;
+  int ahead;   // an instruction already executed ahead of pc, or -1
+  int regs[NrRegs];
+  vector<deque<int>> buffers;   // per variable, oldest first
+};
+
+struct State {
+  vector<ThreadState> threads;
+  vector<int> memory;
+  uint32_t freed;   // bit i set: object i is freed
+};
+
+class Checker {
+    Config const& _config;
+    unordered_set<string> _seen;
+    vector<string> _trace;
+    uint64_t _states;
+    bool _violation;
+
+  public:
+    explicit Checker (Config const& c)
+      : _config(c), _states(0), _violation(false) {
+    }
+
+    uint64_t states () const {
+      return _states;
+    }
+
+    vector<string> const& trace () const {
+      return _trace;
+    }
+
+    // Returns true if an interleaving uses a freed object:
+    bool run () {
+      State s;
+      s.memory = _config.initial;
+      s.freed = 0;
+      for (size_t t = 0; t < _config.threads.size(); t++) {
+        ThreadState ts;
+        ts.pc = 0;
+        ts.ahead = -1;
+        for (int r = 0; r < NrRegs; r++) {
+          ts.regs[r] = r < static_cast<int>(_config.initialRegs.size())
+                       ? _config.initialRegs[r] : 0;
+        }
+        ts.buffers.resize(_config.vars.size());
+        s.threads.push_back(ts);
+      }
+      search(s);
+      return _violation;
+    }
+
+  private:
+
+    static string key (State const& s) {
+      string k;
+      for (ThreadState const& t : s.threads) {
+        k += static_cast<char>(t.pc);
+        k += static_cast<char>(t.ahead);
+        for (int r = 0; r < NrRegs; r++) {
+          k += static_cast<char>(t.regs[r]);
+        }
+        for (deque<int> const& b : t.buffers) {
+          k += static_cast<char>(b.size());
+          for (int v : b) {
+            k += static_cast<char>(v);
+          }
+        }
+      }
+      for (int v : s.memory) {
+        k += static_cast<char>(v);
+      }
+      k += to_string(s.freed);
+      return k;
+    }
+
+    static int visible (State const& s, size_t t, int var) {
+      deque<int> const& b = s.threads[t].buffers[var];
+      return b.empty() ? s.memory[var] : b.back();
+    }
+
+    // No thread has a buffered store to var:
+    static bool nothingBuffered (State const& s, int var) {
+      for (ThreadState const& t : s.threads) {
+        if (! t.buffers[var].empty()) {
+          return false;
+        }
+      }
+      return true;
+    }
+
+    static bool buffersEmpty (State const& s, size_t t, int except) {
+      vector<deque<int>> const& bs = s.threads[t].buffers;
+      for (size_t v = 0; v < bs.size(); v++) {
+        if (static_cast<int>(v) != except && ! bs[v].empty()) {
+          return false;
+        }
+      }
+      return true;
+    }
+
+    // Executes the Store or Rmw in of thread t on n, returns false if it
+    // cannot run in the state s:
+    static bool write (State const& s, State& n, size_t t,
+                       Instr const& in) {
+      ThreadState const& ts = s.threads[t];
+      ThreadState& nt = n.threads[t];
+      bool enabled = true;
+      int value;
+      if (in.op == Store) {
+        value = in.reg2 >= 0 ? ts.regs[in.reg2] : in.value;
+      }
+      else {
+        value = s.memory[in.var] + in.value;
+        enabled = nothingBuffered(s, in.var);
+      }
+      if (in.order == SeqCst) {
+        enabled = enabled && buffersEmpty(s, t, -1);
+        n.memory[in.var] = value;
+      }
+      else {
+        enabled = enabled &&
+                  (in.order == Relaxed || buffersEmpty(s, t, in.var));
+        nt.buffers[in.var].push_back(value);
+      }
+      return enabled;
+    }
+
+    // The relaxed Store or Rmw after the loads and uses starting at pc
+    // that may be executed ahead of them, or -1:
+    int overtaking (ThreadState const& ts, vector<Instr> const& code) const {
+      if (ts.ahead >= 0) {
+        return -1;
+      }
+      uint32_t loadedRegs = 0;
+      uint32_t loadedVars = 0;
+      int i = ts.pc;
+      for (; code[i].op == Load || code[i].op == Use; i++) {
+        if (code[i].op == Load) {
+          if (code[i].reg2 >= 0) {
+            return -1;   // the variable is not known in advance
+          }
+          loadedRegs |= 1u << code[i].reg;
+          loadedVars |= 1u << code[i].var;
+        }
+      }
+      Instr const& in = code[i];
+      if (i == ts.pc || (in.op != Store && in.op != Rmw) ||
+          in.order != Relaxed || ((loadedVars >> in.var) & 1) ||
+          (in.reg2 >= 0 && ((loadedRegs >> in.reg2) & 1))) {
+        return -1;
+      }
+      return i;
+    }
+
+    string describe (size_t t, Instr const& in, State const& s) const {
+      ThreadState const& ts = s.threads[t];
+      string d = named("T", t) + " ";
+      string var = in.var < static_cast<int>(_config.vars.size())
+                   ? _config.vars[in.var] : "?";
+      static char const* orders[] = {"relaxed", "release", "seq_cst"};
+      switch (in.op) {
+        case Store:
+          return d + "store " + var + " = " +
+                 to_string(in.reg2 >= 0 ? ts.regs[in.reg2] : in.value) +
+                 " (" + orders[in.order] + ")";
+        case Load:
+          if (in.reg2 >= 0) {
+            var = _config.vars[in.var + ts.regs[in.reg2]];
+          }
+          return d + "load r" + to_string(in.reg) + " = " + var;
+        case Rmw:
+          return d + "fetch_add " + var + " += " + to_string(in.value) +
+                 " (" + orders[in.order] + ")";
+        case Fence:
+          return d + "fence (seq_cst)";
+        case Membarrier:
+          return d + "membarrier";
+        case AwaitZero:
+          return d + "sees " + var + " == 0";
+        case AwaitNe:
+          return d + "sees " + var + " != " + to_string(ts.regs[in.reg]);
+        case Use:
+          return d + "uses object " + to_string(ts.regs[in.reg]);
+        case Free:
+          return d + "frees object " + to_string(in.value);
+        case JumpIfNe:
+          return d + "compares r" + to_string(in.reg) + " with r" +
+                 to_string(in.reg2);
+        case Done:
+          break;
+      }
+      return d + "done";
+    }
+
+    void search (State const& s) {
+      if (_violation || ! _seen.insert(key(s)).second) {
+        return;
+      }
+      _states++;
+      for (size_t t = 0; t < s.threads.size() && ! _violation; t++) {
+        ThreadState const& ts = s.threads[t];
+
+        // A buffered store of this thread reaches memory:
+        for (size_t v = 0; v < ts.buffers.size(); v++) {
+          if (ts.buffers[v].empty()) {
+            continue;
+          }
+          State n = s;
+          n.memory[v] = n.threads[t].buffers[v].front();
+          n.threads[t].buffers[v].pop_front();
+          _trace.push_back(named("T", t) + " flushes " +
+                           _config.vars[v] + " = " + to_string(n.memory[v]));
+          search(n);
+          if (_violation) {
+            return;
+          }
+          _trace.pop_back();
+        }
+
+        // A relaxed store of this thread overtakes the loads before it:
+        int later = overtaking(ts, _config.threads[t]);
+        if (later >= 0) {
+          Instr const& in = _config.threads[t][later];
+          State n = s;
+          n.threads[t].ahead = later;
+          if (write(s, n, t, in)) {
+            _trace.push_back(describe(t, in, s) + ", ahead of the loads");
+            search(n);
+            if (_violation) {
+              return;
+            }
+            _trace.pop_back();
+          }
+        }
+
+        // The next instruction of this thread:
+        Instr const& in = _config.threads[t][ts.pc];
+        if (in.op == Done) {
+          continue;
+        }
+        State n = s;
+        ThreadState& nt = n.threads[t];
+        bool enabled = true;
+        switch (in.op) {
+          case Store:
+          case Rmw:
+            enabled = write(s, n, t, in);
+            nt.pc++;
+            break;
+          case Load: {
+            int var = in.var + (in.reg2 >= 0 ? ts.regs[in.reg2] : 0);
+            nt.regs[in.reg] = visible(s, t, var);
+            nt.pc++;
+            break;
+          }
+          case Fence:
+            enabled = buffersEmpty(s, t, -1);
+            nt.pc++;
+            break;
+          case Membarrier:
+            for (size_t u = 0; u < s.threads.size() && enabled; u++) {
+              enabled = buffersEmpty(s, u, -1);
+            }
+            nt.pc++;
+            break;
+          case AwaitZero:
+            enabled = visible(s, t, in.var) == 0;
+            nt.pc++;
+            break;
+          case AwaitNe:
+            enabled = visible(s, t, in.var) != ts.regs[in.reg];
+            nt.pc++;
+            break;
+          case Use:
+            if ((s.freed >> ts.regs[in.reg]) & 1) {
+              _trace.push_back(describe(t, in, s) + ", which is freed");
+              _violation = true;
+              return;
+            }
+            nt.pc++;
+            break;
+          case Free:
+            n.freed |= 1u << in.value;
+            nt.pc++;
+            break;
+          case JumpIfNe:
+            nt.pc = ts.regs[in.reg] != ts.regs[in.reg2] ? in.target
+                                                         : ts.pc + 1;
+            break;
+          case Done:
+            break;
+        }
+        if (! enabled) {
+          continue;
+        }
+        if (nt.pc == nt.ahead) {
+          nt.pc++;   // was executed ahead
+          nt.ahead = -1;
+        }
+        _trace.push_back(describe(t, in, s));
+        search(n);
+        if (_violation) {
+          return;
+        }
+        _trace.pop_back();
+      }
+    }
+};
+
+// The DataProtector: every reader has a slot counter C<i>, or all share
+// C0 if sharedSlot is set, and reads the object PTR points to, the
+// writer publishes object 2 instead of object 1, waits for all counters
+// to be 0 and frees object 1. The policies are those of
+// MemoryOrderPolicy.h:
+//
+//   enter   fetch_add of the counter with order enterOrder, then a fence
+//           if readerFence is set
+//   leave   fetch_add of -1 with order leaveOrder
+//   writer  store of PTR with order publishOrder, then a fence if
+//           writerFence is set and a membarrier if writerMembarrier is
+//           set (beforeScan()), then the scan
+//
+// AsymmetricOrder with membarrier available has no reader fence, its
+// signal fence only restrains the compiler, which the model never
+// reorders anyway.
+Config protector (string name, bool safe, int readers, Order enterOrder,
+                  bool readerFence, Order leaveOrder, Order publishOrder,
+                  bool writerFence, bool writerMembarrier = false,
+                  bool sharedSlot = false) {
+  Config c;
+  c.name = name;
+  c.safe = safe;
+  c.vars.push_back("PTR");
+  c.initial.push_back(1);
+  int slots = sharedSlot ? 1 : readers;
+  for (int i = 0; i < slots; i++) {
+    c.vars.push_back(named("C", i));
+    c.initial.push_back(0);
+  }
+  for (int i = 0; i < readers; i++) {
+    int slot = sharedSlot ? 1 : 1 + i;
+    vector<Instr> r;
+    r.push_back(fetchAdd(slot, 1, enterOrder));
+    if (readerFence) {
+      r.push_back(fence());
+    }
+    r.push_back(load(0, 0));
+    r.push_back(use(0));
+    r.push_back(fetchAdd(slot, -1, leaveOrder));
+    r.push_back(Instr{Done, 0, -1, -1, 0, SeqCst, 0});
+    c.threads.push_back(r);
+  }
+  vector<Instr> w;
+  w.push_back(store(0, 2, publishOrder));
+  if (writerFence) {
+    w.push_back(fence());
+  }
+  if (writerMembarrier) {
+    w.push_back(membarrier());
+  }
+  for (int i = 0; i < slots; i++) {
+    w.push_back(awaitZero(1 + i));
+  }
+  w.push_back(freeObject(1));
+  w.push_back(Instr{Done, 0, -1, -1, 0, SeqCst, 0});
+  c.threads.push_back(w);
+  return c;
+}
+
+// The DataGuardian: readers run lease() with their hazard pointer H<i>
+// and retry if the version V changed, the writer runs replace(), that
+// is, it stores object 2 into P1, flips V from 0 to 1, waits until no
+// hazard pointer holds object 1 and frees it:
+//
+//   lease     v = V; p = P[v]; H<i> = p (hazardOrder); retry if V != v
+//   unlease   H<i> = 0 (hazardOrder)
+//   writer    P1 = 2 (relaxed); V = 1 (versionOrder); wait; free
+Config guardian (string name, bool safe, int readers, Order hazardOrder,
+                 Order versionOrder) {
+  Config c;
+  c.name = name;
+  c.safe = safe;
+  c.vars = {"V", "P0", "P1"};
+  c.initial = {0, 1, 0};
+  c.initialRegs = {0, 0, 0, 0};
+  for (int i = 0; i < readers; i++) {
+    c.vars.push_back(named("H", i));
+    c.initial.push_back(0);
+    int h = 3 + i;
+    vector<Instr> r;
+    r.push_back(load(0, 0));               // 0: v = V
+    r.push_back(loadIndexed(1, 1, 0));     // 1: p = P[v]
+    r.push_back(storeReg(h, 1, hazardOrder));  // 2: H = p
+    r.push_back(load(2, 0));               // 3: v2 = V
+    r.push_back(jumpIfNe(0, 2, 0));        // 4: retry if v != v2
+    r.push_back(use(1));                   // 5
+    r.push_back(store(h, 0, hazardOrder)); // 6: H = 0
+    r.push_back(Instr{Done, 0, -1, -1, 0, SeqCst, 0});
+    c.threads.push_back(r);
+  }
+  vector<Instr> w;
+  w.push_back(store(2, 2, Relaxed));
+  w.push_back(store(0, 1, versionOrder));
+  w.push_back(Instr{Load, 1, 3, -1, 0, SeqCst, 0});   // r3 = P0, i.e. 1
+  for (int i = 0; i < readers; i++) {
+    w.push_back(awaitNe(3 + i, 3));
+  }
+  w.push_back(freeObject(1));
+  w.push_back(Instr{Done, 0, -1, -1, 0, SeqCst, 0});
+  c.threads.push_back(w);
+  return c;
+}
+
+void usage () {
+  cout << "Usage: InterleavingCheck [-r READERS] [-v VERBOSE]\n"
+       << "  defaults: -r 2 -v 0" << endl;
+}
+
+int main (int argc, char* argv[]) {
+  int readers = 2;
+  bool verbose = false;
+  for (int i = 1; i < argc; i++) {
+    if (argv[i][0] == '-' && i + 1 < argc) {
+      switch (argv[i][1]) {
+        case 'r': readers = atoi(argv[++i]); continue;
+        case 'v': verbose = atoi(argv[++i]) != 0; continue;
+      }
+    }
+    usage();
+    return 1;
+  }
+  if (readers <= 0 || readers > 3) {
+    usage();
+    return 1;
+  }
+
+  vector<Config> configs = {
+    protector("protector SeqCstOrder", true, readers,
+              SeqCst, false, SeqCst, SeqCst, false),
+    protector("protector ReleaseFenceOrder", true, readers,
+              Relaxed, true, Release, Relaxed, true),
+    protector("protector AsymmetricOrder", true, readers,
+              Relaxed, false, Release, Relaxed, true, true),
+    protector("protector SeqCstOrder shared", true, readers,
+              SeqCst, false, SeqCst, SeqCst, false, false, true),
+    protector("protector ReleaseFence shared", true, readers,
+              Relaxed, true, Release, Relaxed, true, false, true),
+    protector("protector Asymmetric shared", true, readers,
+              Relaxed, false, Release, Relaxed, true, true, true),
+    protector("protector relaxed leave", false, readers,
+              Relaxed, true, Relaxed, Relaxed, true),
+    protector("protector no membarrier", false, readers,
+              Relaxed, false, Release, Relaxed, true),
+    protector("protector relaxed enter", false, readers,
+              Relaxed, false, Release, SeqCst, false),
+    protector("protector no writer fence", false, readers,
+              Relaxed, true, Release, Relaxed, false),
+    protector("protector release enter", false, readers,
+              Release, false, Release, SeqCst, false),
+    guardian("guardian seq_cst", true, readers, SeqCst, SeqCst),
+    guardian("guardian release hazard", false, readers, Release, SeqCst),
+    guardian("guardian release version", false, readers, SeqCst, Release),
+  };
+
+  int wrong = 0;
+  cout << "configuration\t\t\tstates\tresult\t\texpected" << endl;
+  for (Config const& c : configs) {
+    Checker checker(c);
+    bool violation = checker.run();
+    bool ok = violation != c.safe;
+    string name = c.name;
+    name.resize(32, ' ');
+    cout << name << checker.states() << "\t"
+         << (violation ? "use after free" : "safe\t") << "\t"
+         << (c.safe ? "safe" : "use after free")
+         << (ok ? "" : "\tWRONG") << endl;
+    if (! ok) {
+      wrong++;
+    }
+    if (violation && (verbose || ! ok)) {
+      for (string const& step : checker.trace()) {
+        cout << "    " << step << endl;
+      }
+    }
+  }
+  cout << "configurations not as expected: " << wrong << endl;
+  return wrong == 0 ? 0 : 1;
+}
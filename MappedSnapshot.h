@@ -0,0 +1,208 @@
+#ifndef MAPPED_SNAPSHOT_H
+#define MAPPED_SNAPSHOT_H 1
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+#include "ProtectedPtr.h"
+
+// Versions that are read in place from a memory-mapped file instead of
+// being parsed into heap objects. A snapshot file has a small header
+// and then a flat, position-independent image of the data, in which all
+// references are RelPtr, that is, offsets relative to the reference
+// itself. Such an image is valid at any address, so loading a version
+// is just mapping the file:
+//
+//   MappedSnapshot snapshot;
+//   snapshot.load("catalog.snap");             // map, publish, unmap old
+//
+//   {
+//     auto guard(snapshot.read());
+//     Catalog const* c = guard->root<Catalog>();
+//     ...
+//   }
+//
+// The old mapping is unmapped only after the grace period. A file must
+// not be changed once it is mapped, so new versions are always written
+// to a new file which is then renamed, as SnapshotBuilder::write() does.
+// Renaming over a mapped file is fine, the mapping keeps the old inode.
+
+// A reference inside a snapshot, 0 is the nullptr:
+template<typename T>
+struct RelPtr {
+  int64_t offset;
+
+  T const* get () const {
+    if (offset == 0) {
+      return nullptr;
+    }
+    return reinterpret_cast<T const*>(
+             reinterpret_cast<char const*>(this) + offset);
+  }
+
+  T const* operator-> () const {
+    return get();
+  }
+
+  T const& operator[] (size_t i) const {
+    return get()[i];
+  }
+};
+
+struct SnapshotHeader {
+  char magic[8];      // "DPSNAP01"
+  uint64_t size;      // of the whole file
+  uint64_t root;      // offset of the root object from the file start
+  uint64_t padding;
+};
+
+// A snapshot file mapped read-only into memory:
+class MappedFile {
+
+    void* _data;
+    size_t _size;
+
+    MappedFile (void* data, size_t size) : _data(data), _size(size) {
+    }
+
+  public:
+
+    ~MappedFile () {
+      munmap(_data, _size);
+    }
+
+    MappedFile (MappedFile const&) = delete;
+    MappedFile& operator= (MappedFile const&) = delete;
+
+    // Maps the file and checks its header, returns nullptr on failure.
+    // With populate, all pages are read in now, otherwise the readers
+    // fault them in on first access:
+    static MappedFile* open (std::string const& path, bool populate) {
+      int fd = ::open(path.c_str(), O_RDONLY);
+      if (fd < 0) {
+        return nullptr;
+      }
+      struct stat st;
+      if (fstat(fd, &st) != 0 ||
+          static_cast<size_t>(st.st_size) < sizeof(SnapshotHeader)) {
+        ::close(fd);
+        return nullptr;
+      }
+      size_t size = st.st_size;
+      void* p = mmap(nullptr, size, PROT_READ,
+                     MAP_PRIVATE | (populate ? MAP_POPULATE : 0), fd, 0);
+      ::close(fd);   // the mapping keeps the file open
+      if (p == MAP_FAILED) {
+        return nullptr;
+      }
+      SnapshotHeader const* h = static_cast<SnapshotHeader const*>(p);
+      if (memcmp(h->magic, "DPSNAP01", 8) != 0 || h->size != size ||
+          h->root < sizeof(SnapshotHeader) || h->root >= size) {
+        munmap(p, size);
+        return nullptr;
+      }
+      return new MappedFile(p, size);
+    }
+
+    char const* data () const {
+      return static_cast<char const*>(_data);
+    }
+
+    size_t size () const {
+      return _size;
+    }
+
+    template<typename T>
+    T const* root () const {
+      return reinterpret_cast<T const*>(
+               data() + reinterpret_cast<SnapshotHeader const*>(_data)->root);
+    }
+};
+
+template<typename Protector = DataProtector<64>>
+class MappedSnapshot {
+
+    ProtectedPtr<MappedFile, Protector> _file;
+
+  public:
+
+    typedef typename ProtectedPtr<MappedFile, Protector>::Guard Guard;
+
+    // The guard's pointer is nullptr before the first load():
+    Guard read () {
+      return _file.read();
+    }
+
+    // Maps the file and publishes it, the previous file is unmapped
+    // after the grace period. Returns false if the file cannot be
+    // mapped, the current version stays then:
+    bool load (std::string const& path, bool populate = false) {
+      MappedFile* f = MappedFile::open(path, populate);
+      if (f == nullptr) {
+        return false;
+      }
+      _file.publish(f);
+      return true;
+    }
+};
+
+// Writes a snapshot file: the image is built in memory by appending
+// objects, references between them are set with link().
+class SnapshotBuilder {
+
+    std::vector<char> _buf;
+
+  public:
+
+    SnapshotBuilder () : _buf(sizeof(SnapshotHeader), 0) {
+    }
+
+    // Appends n bytes (zeroed if data is nullptr) at the given alignment
+    // and returns their offset:
+    uint64_t append (void const* data, size_t n, size_t align = 8) {
+      size_t off = (_buf.size() + align - 1) / align * align;
+      _buf.resize(off + n, 0);
+      if (data != nullptr) {
+        memcpy(_buf.data() + off, data, n);
+      }
+      return off;
+    }
+
+    // Only valid until the next append():
+    template<typename T>
+    T* at (uint64_t offset) {
+      return reinterpret_cast<T*>(_buf.data() + offset);
+    }
+
+    // Makes the RelPtr at offset ref point to offset target:
+    void link (uint64_t ref, uint64_t target) {
+      at<RelPtr<char>>(ref)->offset = static_cast<int64_t>(target) -
+                                      static_cast<int64_t>(ref);
+    }
+
+    // Writes the file under a temporary name and renames it, such that
+    // nobody ever maps a half written file:
+    bool write (std::string const& path, uint64_t root) {
+      SnapshotHeader* h = at<SnapshotHeader>(0);
+      memcpy(h->magic, "DPSNAP01", 8);
+      h->size = _buf.size();
+      h->root = root;
+      std::string tmp = path + ".tmp";
+      FILE* f = fopen(tmp.c_str(), "wb");
+      if (f == nullptr) {
+        return false;
+      }
+      bool ok = fwrite(_buf.data(), 1, _buf.size(), f) == _buf.size();
+      ok = fclose(f) == 0 && ok;
+      return ok && rename(tmp.c_str(), path.c_str()) == 0;
+    }
+};
+
+#endif
@@ -0,0 +1,300 @@
+#include "MappedSnapshot.h"
+#include "ProtectedPtr.h"
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// Compares two ways of loading a catalog of N entries (key, value and a
+// name) from a file: parsing a text file into an unordered_map, which
+// is published through a ProtectedPtr, and mapping a flat snapshot file
+// with a MappedSnapshot. We measure the load time and the lookup
+// throughput of reader threads while the writer keeps reloading two
+// versions of the file alternately. The value of every entry is its key
+// xor the version, so readers notice a torn or unmapped version.
+
+using namespace std;
+
+typedef chrono::steady_clock Clock;
+
+// The flat format:
+struct FlatEntry {
+  uint64_t key;
+  uint64_t value;
+  RelPtr<char> name;
+};
+
+struct FlatCatalog {
+  uint64_t version;
+  uint64_t n;
+  RelPtr<FlatEntry> entries;   // sorted by key
+};
+
+// The heap format:
+struct HeapCatalog {
+  uint64_t version;
+  unordered_map<uint64_t, pair<uint64_t, string>> entries;
+};
+
+// Settings, see usage() below:
+int seconds = 3;
+uint64_t nrEntries = 1000000;
+int reloadMillis = 200;
+bool populate = false;
+string dir = "/tmp";
+
+atomic<bool> stop;
+atomic<uint64_t> alarmsSeen;
+mutex mut;
+uint64_t totalReads = 0;
+
+uint64_t keyOf (uint64_t i) {
+  return i * 2654435761ULL;
+}
+
+string nameOf (uint64_t i) {
+  return "entry-" + to_string(i);
+}
+
+bool writeText (string const& path, uint64_t version) {
+  ofstream out(path + ".tmp");
+  out << version << "\n";
+  for (uint64_t i = 0; i < nrEntries; i++) {
+    out << keyOf(i) << " " << (keyOf(i) ^ version) << " " << nameOf(i)
+        << "\n";
+  }
+  out.close();
+  return out.good() && rename((path + ".tmp").c_str(), path.c_str()) == 0;
+}
+
+bool writeFlat (string const& path, uint64_t version) {
+  // Entries sorted by key for binary search:
+  vector<uint64_t> order(nrEntries);
+  for (uint64_t i = 0; i < nrEntries; i++) {
+    order[i] = i;
+  }
+  sort(order.begin(), order.end(), [] (uint64_t a, uint64_t b) -> bool {
+    return keyOf(a) < keyOf(b);
+  });
+  SnapshotBuilder b;
+  uint64_t root = b.append(nullptr, sizeof(FlatCatalog));
+  uint64_t entries = b.append(nullptr, nrEntries * sizeof(FlatEntry));
+  b.at<FlatCatalog>(root)->version = version;
+  b.at<FlatCatalog>(root)->n = nrEntries;
+  b.link(root + offsetof(FlatCatalog, entries), entries);
+  for (uint64_t j = 0; j < nrEntries; j++) {
+    uint64_t i = order[j];
+    string name = nameOf(i);
+    uint64_t s = b.append(name.c_str(), name.size() + 1, 1);
+    uint64_t e = entries + j * sizeof(FlatEntry);
+    b.at<FlatEntry>(e)->key = keyOf(i);
+    b.at<FlatEntry>(e)->value = keyOf(i) ^ version;
+    b.link(e + offsetof(FlatEntry, name), s);
+  }
+  return b.write(path, root);
+}
+
+HeapCatalog* parseText (string const& path) {
+  ifstream in(path);
+  HeapCatalog* c = new HeapCatalog;
+  in >> c->version;
+  c->entries.reserve(nrEntries);
+  uint64_t key, value;
+  string name;
+  while (in >> key >> value >> name) {
+    c->entries.emplace(key, make_pair(value, name));
+  }
+  return c;
+}
+
+FlatEntry const* find (FlatCatalog const* c, uint64_t key) {
+  FlatEntry const* e = c->entries.get();
+  uint64_t lo = 0;
+  uint64_t hi = c->n;
+  while (lo < hi) {
+    uint64_t mid = (lo + hi) / 2;
+    if (e[mid].key < key) {
+      lo = mid + 1;
+    }
+    else {
+      hi = mid;
+    }
+  }
+  return lo < c->n && e[lo].key == key ? e + lo : nullptr;
+}
+
+template<typename Lookup>
+void readerLoop (int seed, Lookup const& lookup) {
+  uint64_t x = seed;
+  uint64_t count = 0;
+  while (! stop) {
+    for (int j = 0; j < 100; j++) {
+      x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+      if (! lookup(keyOf((x >> 33) % nrEntries))) {
+        alarmsSeen++;
+      }
+      count++;
+    }
+  }
+  lock_guard<mutex> locker(mut);
+  totalReads += count;
+}
+
+double millisSince (Clock::time_point t) {
+  return chrono::duration_cast<chrono::microseconds>(Clock::now() - t)
+         .count() / 1000.0;
+}
+
+void report (char const* scheme, double firstLoad, vector<double> const& loads,
+             int N) {
+  double sum = 0;
+  for (double l : loads) {
+    sum += l;
+  }
+  cout << scheme << "\t" << N << "\t" << firstLoad << "\t"
+       << (loads.empty() ? 0.0 : sum / loads.size()) << "\t"
+       << totalReads / 1e6 / seconds << endl;
+}
+
+void runHeap (string const (&paths)[2], int N) {
+  Clock::time_point t = Clock::now();
+  ProtectedPtr<HeapCatalog> catalog(parseText(paths[0]));
+  double firstLoad = millisSince(t);
+  stop = false;
+  totalReads = 0;
+  vector<thread> readers;
+  for (int i = 0; i < N; i++) {
+    readers.emplace_back([&catalog, i] () -> void {
+      readerLoop(i + 1, [&catalog] (uint64_t key) -> bool {
+        auto guard(catalog.read());
+        auto it = guard->entries.find(key);
+        return it != guard->entries.end() &&
+               it->second.first == (key ^ guard->version);
+      });
+    });
+  }
+  vector<double> loads;
+  Clock::time_point end = Clock::now() + chrono::seconds(seconds);
+  for (int v = 1; Clock::now() < end; v++) {
+    usleep(reloadMillis * 1000);
+    t = Clock::now();
+    catalog.publish(parseText(paths[v % 2]));
+    loads.push_back(millisSince(t));
+  }
+  stop = true;
+  for (thread& r : readers) {
+    r.join();
+  }
+  report("parse", firstLoad, loads, N);
+}
+
+void runMapped (string const (&paths)[2], int N) {
+  Clock::time_point t = Clock::now();
+  MappedSnapshot<> snapshot;
+  if (! snapshot.load(paths[0], populate)) {
+    cout << "Cannot map " << paths[0] << endl;
+    return;
+  }
+  double firstLoad = millisSince(t);
+  stop = false;
+  totalReads = 0;
+  vector<thread> readers;
+  for (int i = 0; i < N; i++) {
+    readers.emplace_back([&snapshot, i] () -> void {
+      readerLoop(i + 1, [&snapshot] (uint64_t key) -> bool {
+        auto guard(snapshot.read());
+        FlatCatalog const* c = guard->root<FlatCatalog>();
+        FlatEntry const* e = find(c, key);
+        return e != nullptr && e->value == (key ^ c->version) &&
+               strncmp(e->name.get(), "entry-", 6) == 0;
+      });
+    });
+  }
+  vector<double> loads;
+  Clock::time_point end = Clock::now() + chrono::seconds(seconds);
+  for (int v = 1; Clock::now() < end; v++) {
+    usleep(reloadMillis * 1000);
+    t = Clock::now();
+    if (! snapshot.load(paths[v % 2], populate)) {
+      cout << "Cannot map " << paths[v % 2] << endl;
+    }
+    loads.push_back(millisSince(t));
+  }
+  stop = true;
+  for (thread& r : readers) {
+    r.join();
+  }
+  report(populate ? "mmap+populate" : "mmap", firstLoad, loads, N);
+}
+
+void usage () {
+  cout << "Usage: MappedSnapshotTest [-t SECONDS] [-n ENTRIES] "
+       << "[-r RELOADMILLIS] [-d DIR] [-p] THREADS...\n"
+       << "  -p maps with MAP_POPULATE\n"
+       << "  defaults: -t " << seconds << " -n " << nrEntries << " -r "
+       << reloadMillis << " -d " << dir << endl;
+}
+
+int main (int argc, char* argv[]) {
+  vector<int> threadCounts;
+  for (int i = 1; i < argc; i++) {
+    if (string(argv[i]) == "-p") {
+      populate = true;
+      continue;
+    }
+    if (argv[i][0] == '-' && i + 1 < argc) {
+      switch (argv[i][1]) {
+        case 't': seconds = atoi(argv[++i]); continue;
+        case 'n': nrEntries = strtoull(argv[++i], nullptr, 10); continue;
+        case 'r': reloadMillis = atoi(argv[++i]); continue;
+        case 'd': dir = argv[++i]; continue;
+      }
+      usage();
+      return 1;
+    }
+    int n = atoi(argv[i]);
+    if (n <= 0) {
+      usage();
+      return 1;
+    }
+    threadCounts.push_back(n);
+  }
+  if (threadCounts.empty() || seconds <= 0 || nrEntries == 0) {
+    usage();
+    return 1;
+  }
+
+  string base = dir + "/MappedSnapshotTest-" + to_string(getpid());
+  string text[2] = {base + "-1.txt", base + "-2.txt"};
+  string flat[2] = {base + "-1.snap", base + "-2.snap"};
+  for (int v = 0; v < 2; v++) {
+    if (! writeText(text[v], v + 1) || ! writeFlat(flat[v], v + 1)) {
+      cout << "Cannot write the files in " << dir << endl;
+      return 1;
+    }
+  }
+
+  alarmsSeen = 0;
+  cout << "Load times in ms, reads in M/s:" << endl;
+  cout << "scheme\tthreads\tfirst\treload\treads" << endl;
+  for (int N : threadCounts) {
+    runHeap(text, N);
+    runMapped(flat, N);
+  }
+  cout << "alarms seen: " << alarmsSeen << endl;
+  for (int v = 0; v < 2; v++) {
+    unlink(text[v].c_str());
+    unlink(flat[v].c_str());
+  }
+  return 0;
+}
@@ -0,0 +1,146 @@
+#ifndef MEMORY_ORDER_POLICY_H
+#define MEMORY_ORDER_POLICY_H 1
+
+#include <atomic>
+
+#ifdef __linux__
+#include <linux/membarrier.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Memory order policies for the reader counters of the DataProtector.
+// A policy provides
+//
+//   static void init ()                     called by the constructor
+//   static void enter (std::atomic<C>& c)   reader increments its counter
+//   static void leave (std::atomic<C>& c)   reader decrements its counter
+//   static void beforeScan ()               writer, after publishing and
+//                                           before reading the counters
+//
+// The correctness argument in DataProtector.md needs that a reader
+// which has incremented its counter and then loads the old pointer is
+// seen by the writer which has stored the new pointer and then reads
+// the counters. This is the "store buffering" pattern, so both sides
+// need a full barrier between their store and their load. The policies
+// differ in where this barrier comes from.
+
+// The original: both counter updates are seq_cst read-modify-write
+// operations, and the seq_cst store to the pointer and the seq_cst
+// loads of the counters do the rest.
+class SeqCstOrder {
+
+  public:
+
+    static void init () {
+    }
+
+    template<typename C>
+    static void enter (std::atomic<C>& c) {
+      c.fetch_add(1, std::memory_order_seq_cst);
+    }
+
+    template<typename C>
+    static void leave (std::atomic<C>& c) {
+      c.fetch_sub(1, std::memory_order_seq_cst);
+    }
+
+    static void beforeScan () {
+    }
+};
+
+// A relaxed increment followed by a seq_cst fence, and a release
+// decrement, such that all reads of the data happen before the counter
+// drops. The writer puts a seq_cst fence between publishing and
+// scanning. The two fences establish the order. On x86 the fence is an
+// extra mfence after the locked increment, which already is a full
+// barrier, so this only pays off on weakly ordered machines, where the
+// release decrement is cheaper than a seq_cst one.
+class ReleaseFenceOrder {
+
+  public:
+
+    static void init () {
+    }
+
+    template<typename C>
+    static void enter (std::atomic<C>& c) {
+      c.fetch_add(1, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+
+    template<typename C>
+    static void leave (std::atomic<C>& c) {
+      c.fetch_sub(1, std::memory_order_release);
+    }
+
+    static void beforeScan () {
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+};
+
+// Asymmetric fences: the reader only prevents the compiler from
+// reordering, the writer uses the membarrier system call, which runs a
+// full barrier on every CPU currently executing a thread of this
+// process. This moves all the cost to the (rare) writer. If membarrier
+// is not available, readers fall back to a real fence, which costs them
+// one predictable branch in the fast path. Note that the increment
+// itself still has to be an atomic read-modify-write, since several
+// threads can share a slot, so on x86 the gain is small.
+class AsymmetricOrder {
+
+  public:
+
+    static std::atomic<bool>& available () {
+      static std::atomic<bool> flag(false);
+      return flag;
+    }
+
+    static void init () {
+      static bool registered = registerProcess();
+      (void) registered;
+    }
+
+    template<typename C>
+    static void enter (std::atomic<C>& c) {
+      c.fetch_add(1, std::memory_order_relaxed);
+      if (available().load(std::memory_order_relaxed)) {
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+      }
+      else {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+      }
+    }
+
+    template<typename C>
+    static void leave (std::atomic<C>& c) {
+      c.fetch_sub(1, std::memory_order_release);
+    }
+
+    static void beforeScan () {
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+#ifdef __linux__
+      if (available().load(std::memory_order_relaxed)) {
+        syscall(SYS_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0, 0);
+      }
+#endif
+    }
+
+  private:
+
+    // Readers only skip the fence after registration has succeeded, and
+    // from then on every scan issues the membarrier:
+    static bool registerProcess () {
+#ifdef __linux__
+      long cmds = syscall(SYS_membarrier, MEMBARRIER_CMD_QUERY, 0, 0);
+      if (cmds >= 0 && (cmds & MEMBARRIER_CMD_PRIVATE_EXPEDITED) != 0 &&
+          syscall(SYS_membarrier,
+                  MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0, 0) == 0) {
+        available() = true;
+      }
+#endif
+      return available();
+    }
+};
+
+#endif
@@ -0,0 +1,134 @@
+#ifndef MODULE_MANAGER_H
+#define MODULE_MANAGER_H 1
+
+#include <dlfcn.h>
+#include <string>
+
+#include "ProtectedPtr.h"
+
+// Hot-swappable plugins. A plugin is a shared library which exports a
+// function
+//
+//   extern "C" Api const* <entry> ();
+//
+// that returns a table of function pointers of type Api. The manager
+// keeps the loaded module in a ProtectedPtr, so calls into the plugin
+// run inside a read section instead of under a lock:
+//
+//   ModuleManager<HandlerApi> handlers("handlerApi");
+//   handlers.load("./handler-v1.so");
+//
+//   {
+//     auto guard(handlers.read());
+//     guard->api()->handle(request);
+//   }
+//
+//   handlers.load("./handler-v2.so");   // dlclose of v1 after scan()
+//
+// The library is only closed when no thread can be executing its code
+// any more, provided that the plugin does not keep code running outside
+// of calls, for example in threads it started itself, in atexit or
+// thread-local destructors, or in callbacks registered elsewhere, and
+// that no pointer into the plugin (including the Api table) is used
+// after the guard is gone.
+//
+// dlopen() returns the handle of an already loaded library if the file
+// is the same, so a new version must be a new file, either under a new
+// name or renamed over the old one.
+
+template<typename Api>
+class Module {
+
+    void* _handle;
+    Api const* _api;
+    std::string _path;
+
+    Module (void* h, Api const* a, std::string const& p)
+      : _handle(h), _api(a), _path(p) {
+    }
+
+  public:
+
+    typedef Api const* (*EntryFunc) ();
+
+    ~Module () {
+      dlclose(_handle);
+    }
+
+    Module (Module const&) = delete;
+    Module& operator= (Module const&) = delete;
+
+    // Loads the library and calls its entry function, returns nullptr
+    // and sets error on failure:
+    static Module* open (std::string const& path, std::string const& entry,
+                         std::string& error) {
+      void* h = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+      if (h == nullptr) {
+        error = dlerror();
+        return nullptr;
+      }
+      EntryFunc f = reinterpret_cast<EntryFunc>(dlsym(h, entry.c_str()));
+      Api const* a = f != nullptr ? f() : nullptr;
+      if (a == nullptr) {
+        error = "no entry " + entry + " in " + path;
+        dlclose(h);
+        return nullptr;
+      }
+      return new Module(h, a, path);
+    }
+
+    Api const* api () const {
+      return _api;
+    }
+
+    std::string const& path () const {
+      return _path;
+    }
+
+    // Any other symbol of the library, valid as long as the guard:
+    void* symbol (char const* name) const {
+      return dlsym(_handle, name);
+    }
+};
+
+template<typename Api, typename Protector = DataProtector<64>>
+class ModuleManager {
+
+    std::string _entry;
+    ProtectedPtr<Module<Api>, Protector> _module;
+
+  public:
+
+    typedef typename ProtectedPtr<Module<Api>, Protector>::Guard Guard;
+
+    explicit ModuleManager (std::string const& entry) : _entry(entry) {
+    }
+
+    // The guard's pointer is nullptr before the first load():
+    Guard read () {
+      return _module.read();
+    }
+
+    // Loads the library at path and publishes it, the previous one is
+    // closed after the grace period. On failure, the current module
+    // stays and the reason is stored in error:
+    bool load (std::string const& path, std::string* error = nullptr) {
+      std::string e;
+      Module<Api>* m = Module<Api>::open(path, _entry, e);
+      if (m == nullptr) {
+        if (error != nullptr) {
+          *error = e;
+        }
+        return false;
+      }
+      _module.publish(m);
+      return true;
+    }
+
+    // Closes the current module after the grace period:
+    void unload () {
+      _module.publish(nullptr);
+    }
+};
+
+#endif
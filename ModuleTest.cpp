@@ -0,0 +1,168 @@
+#include "ModuleManager.h"
+#include "TestPlugin.h"
+
+#include <chrono>
+#include <iostream>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// Readers call a function of a plugin (TestPlugin.cpp, built as
+// TestPlugin1.so and TestPlugin2.so) in a loop while a writer reloads
+// the two versions alternately. We compare the ModuleManager, where the
+// calls run inside a read section and the old library is closed after
+// scan(), with the usual std::shared_mutex around every call. If a
+// library were closed while a thread still runs its code, the test
+// would crash.
+
+using namespace std;
+
+typedef chrono::steady_clock Clock;
+
+// Settings, see usage() below:
+int seconds = 2;
+int reloadMicros = 10000;
+string dir = ".";
+
+atomic<bool> stop;
+atomic<uint64_t> alarmsSeen;
+mutex mut;
+uint64_t totalCalls = 0;
+
+string pluginPath (int v) {
+  return dir + "/TestPlugin" + to_string(v) + ".so";
+}
+
+void check (TestPluginApi const* api, uint64_t request) {
+  if (api->handle(request) != request + api->version) {
+    alarmsSeen++;
+  }
+}
+
+template<typename Call, typename Reload>
+void run (char const* scheme, int N, Call const& call, Reload const& reload) {
+  stop = false;
+  totalCalls = 0;
+  vector<thread> threads;
+  for (int i = 0; i < N; i++) {
+    threads.emplace_back([&call, i] () -> void {
+      uint64_t count = 0;
+      while (! stop) {
+        for (int j = 0; j < 1000; j++) {
+          call(count + i);
+          count++;
+        }
+      }
+      lock_guard<mutex> locker(mut);
+      totalCalls += count;
+    });
+  }
+  uint64_t reloads = 0;
+  Clock::time_point start = Clock::now();
+  Clock::time_point end = start + chrono::seconds(seconds);
+  while (Clock::now() < end) {
+    usleep(reloadMicros);
+    if (! reload(reloads % 2 + 1)) {
+      cout << "Cannot load " << pluginPath(reloads % 2 + 1) << endl;
+      break;
+    }
+    reloads++;
+  }
+  stop = true;
+  for (thread& t : threads) {
+    t.join();
+  }
+  double elapsed = chrono::duration_cast<chrono::nanoseconds>(
+                     Clock::now() - start).count() / 1e9;
+  cout << scheme << "\t" << N << "\t" << totalCalls / 1e6 / elapsed << "\t"
+       << totalCalls / 1e6 / elapsed / N << "\t" << reloads << endl;
+}
+
+void runManager (int N) {
+  ModuleManager<TestPluginApi> manager("testPluginApi");
+  string error;
+  if (! manager.load(pluginPath(1), &error)) {
+    cout << error << endl;
+    return;
+  }
+  run("protector", N, [&manager] (uint64_t request) -> void {
+    auto guard(manager.read());
+    check(guard->api(), request);
+  }, [&manager] (int v) -> bool {
+    return manager.load(pluginPath(v));
+  });
+}
+
+void runSharedMutex (int N) {
+  shared_mutex lock;
+  string error;
+  Module<TestPluginApi>* module =
+    Module<TestPluginApi>::open(pluginPath(1), "testPluginApi", error);
+  if (module == nullptr) {
+    cout << error << endl;
+    return;
+  }
+  run("std::shared_mutex", N, [&lock, &module] (uint64_t request) -> void {
+    shared_lock<shared_mutex> guard(lock);
+    check(module->api(), request);
+  }, [&lock, &module] (int v) -> bool {
+    string e;
+    Module<TestPluginApi>* m =
+      Module<TestPluginApi>::open(pluginPath(v), "testPluginApi", e);
+    if (m == nullptr) {
+      return false;
+    }
+    unique_lock<shared_mutex> guard(lock);
+    swap(m, module);
+    delete m;
+    return true;
+  });
+  delete module;
+}
+
+void usage () {
+  cout << "Usage: ModuleTest [-t SECONDS] [-r RELOADMICROS] [-d PLUGINDIR] "
+       << "THREADS...\n"
+       << "  defaults: -t " << seconds << " -r " << reloadMicros << " -d "
+       << dir << endl;
+}
+
+int main (int argc, char* argv[]) {
+  vector<int> threadCounts;
+  for (int i = 1; i < argc; i++) {
+    if (argv[i][0] == '-' && i + 1 < argc) {
+      switch (argv[i][1]) {
+        case 't': seconds = atoi(argv[++i]); continue;
+        case 'r': reloadMicros = atoi(argv[++i]); continue;
+        case 'd': dir = argv[++i]; continue;
+      }
+      usage();
+      return 1;
+    }
+    int n = atoi(argv[i]);
+    if (n <= 0) {
+      usage();
+      return 1;
+    }
+    threadCounts.push_back(n);
+  }
+  if (threadCounts.empty() || seconds <= 0) {
+    usage();
+    return 1;
+  }
+
+  alarmsSeen = 0;
+  cout << "Plugin calls in M/s:" << endl;
+  cout << "scheme\tthreads\tM/s\tM/s/T\treloads" << endl;
+  for (int N : threadCounts) {
+    runManager(N);
+    runSharedMutex(N);
+  }
+  cout << "alarms seen: " << alarmsSeen << endl;
+  return 0;
+}
@@ -0,0 +1,253 @@
+#include "DataProtector.h"
+#include "TypeStablePool.h"
+
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// Tiny lookups: a directory maps N keys to payloads of 16 to 64 bytes,
+// and readers copy the payload of a random key. We compare two schemes:
+//
+//   protector    the directory holds pointers to heap objects, readers
+//                enter a read section like reader_protector in
+//                DataProtectorTest.cpp, the writer deletes replaced
+//                objects after a grace period
+//   optimistic   the directory holds indices into a TypeStablePool,
+//                readers copy and validate without touching any slot,
+//                the pool reuses replaced objects after a grace period
+//
+// A writer replaces the payloads of random keys continuously. All
+// words of a payload are equal, so readers can detect torn copies.
+
+using namespace std;
+
+typedef chrono::steady_clock Clock;
+
+template<int Bytes>
+struct Payload {
+  uint64_t w[Bytes / 8];
+
+  void set (uint64_t v) {
+    for (int i = 0; i < Bytes / 8; i++) {
+      w[i] = v;
+    }
+  }
+
+  bool consistent () const {
+    for (int i = 1; i < Bytes / 8; i++) {
+      if (w[i] != w[0]) {
+        return false;
+      }
+    }
+    return true;
+  }
+};
+
+// Settings, see usage() below:
+int seconds = 2;
+uint64_t nrKeys = 100000;
+int batch = 64;          // updates per grace period of the writer
+int pauseMicros = 100;   // writer pause after every batch
+
+atomic<bool> stop;
+atomic<uint64_t> alarmsSeen;
+mutex mut;
+uint64_t totalReads = 0;
+uint64_t totalRetries = 0;
+
+uint64_t nextRandom (uint64_t& x) {
+  x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+  return x >> 33;
+}
+
+void finishReader (uint64_t count, uint64_t retries) {
+  lock_guard<mutex> locker(mut);
+  totalReads += count;
+  totalRetries += retries;
+}
+
+template<typename P, typename Reader, typename Writer>
+void run (char const* scheme, int N, Reader const& reader,
+          Writer const& writer) {
+  stop = false;
+  totalReads = 0;
+  totalRetries = 0;
+  vector<thread> threads;
+  for (int i = 0; i < N; i++) {
+    threads.emplace_back(reader, i + 1);
+  }
+  uint64_t updates = 0;
+  uint64_t x = 12345;
+  Clock::time_point start = Clock::now();
+  Clock::time_point end = start + chrono::seconds(seconds);
+  while (Clock::now() < end) {
+    writer(x, updates);
+    usleep(pauseMicros);
+  }
+  stop = true;
+  for (thread& t : threads) {
+    t.join();
+  }
+  double elapsed = chrono::duration_cast<chrono::nanoseconds>(
+                     Clock::now() - start).count() / 1e9;
+  cout << scheme << "\t" << sizeof(P) << "\t" << N << "\t"
+       << totalReads / 1e6 / elapsed << "\t"
+       << totalReads / 1e6 / elapsed / N << "\t" << totalRetries << "\t"
+       << updates / elapsed << endl;
+}
+
+template<int Bytes>
+void runProtector (int N) {
+  typedef Payload<Bytes> P;
+  DataProtector<64> protector;
+  unique_ptr<atomic<P*>[]> directory(new atomic<P*>[nrKeys]);
+  for (uint64_t k = 0; k < nrKeys; k++) {
+    P* p = new P;
+    p->set(k);
+    directory[k] = p;
+  }
+  run<P>("protector", N, [&] (int seed) -> void {
+    uint64_t x = seed;
+    uint64_t count = 0;
+    while (! stop) {
+      for (int j = 0; j < 1000; j++) {
+        uint64_t k = nextRandom(x) % nrKeys;
+        P copy;
+        {
+          auto unuser(protector.use());
+          copy = *directory[k].load();
+        }
+        if (! copy.consistent()) {
+          alarmsSeen++;
+        }
+        count++;
+      }
+    }
+    finishReader(count, 0);
+  }, [&] (uint64_t& x, uint64_t& updates) -> void {
+    vector<P*> old;
+    for (int j = 0; j < batch; j++) {
+      uint64_t k = nextRandom(x) % nrKeys;
+      P* p = new P;
+      p->set(updates++);
+      old.push_back(directory[k].exchange(p));
+    }
+    protector.scan();
+    for (P* p : old) {
+      delete p;
+    }
+  });
+  for (uint64_t k = 0; k < nrKeys; k++) {
+    delete directory[k].load();
+  }
+}
+
+template<int Bytes>
+void runOptimistic (int N) {
+  typedef Payload<Bytes> P;
+  TypeStablePool<P> pool(batch);
+  unique_ptr<atomic<uint32_t>[]> directory(new atomic<uint32_t>[nrKeys]);
+  for (uint64_t k = 0; k < nrKeys; k++) {
+    P p;
+    p.set(k);
+    directory[k] = pool.allocate(k, p);
+    if (directory[k] == TypeStablePool<P>::InvalidIndex) {
+      cout << "The pool is full after " << k << " keys" << endl;
+      alarmsSeen++;
+      return;
+    }
+  }
+  run<P>("optimistic", N, [&] (int seed) -> void {
+    uint64_t x = seed;
+    uint64_t count = 0;
+    uint64_t retries = 0;
+    while (! stop) {
+      for (int j = 0; j < 1000; j++) {
+        uint64_t k = nextRandom(x) % nrKeys;
+        P copy;
+        while (! pool.read(directory[k].load(), k, copy)) {
+          retries++;
+        }
+        if (! copy.consistent()) {
+          alarmsSeen++;
+        }
+        count++;
+      }
+    }
+    finishReader(count, retries);
+  }, [&] (uint64_t& x, uint64_t& updates) -> void {
+    for (int j = 0; j < batch; j++) {
+      uint64_t k = nextRandom(x) % nrKeys;
+      P p;
+      p.set(updates++);
+      // A new object for the new value, like in the protector case:
+      uint32_t i = pool.allocate(k, p);
+      if (i == TypeStablePool<P>::InvalidIndex) {
+        pool.reclaim();   // frees the retired objects, if there are any
+        i = pool.allocate(k, p);
+      }
+      if (i == TypeStablePool<P>::InvalidIndex) {
+        alarmsSeen++;   // the pool is full, leave the key as it is
+        continue;
+      }
+      pool.retire(directory[k].exchange(i));
+    }
+  });
+}
+
+template<int Bytes>
+void runBoth (int N) {
+  runProtector<Bytes>(N);
+  runOptimistic<Bytes>(N);
+}
+
+void usage () {
+  cout << "Usage: OptimisticTest [-t SECONDS] [-n KEYS] [-b BATCH] "
+       << "[-p PAUSEMICROS] THREADS...\n"
+       << "  defaults: -t " << seconds << " -n " << nrKeys << " -b "
+       << batch << " -p " << pauseMicros << endl;
+}
+
+int main (int argc, char* argv[]) {
+  vector<int> threadCounts;
+  for (int i = 1; i < argc; i++) {
+    if (argv[i][0] == '-' && i + 1 < argc) {
+      switch (argv[i][1]) {
+        case 't': seconds = atoi(argv[++i]); continue;
+        case 'n': nrKeys = strtoull(argv[++i], nullptr, 10); continue;
+        case 'b': batch = atoi(argv[++i]); continue;
+        case 'p': pauseMicros = atoi(argv[++i]); continue;
+      }
+      usage();
+      return 1;
+    }
+    int n = atoi(argv[i]);
+    if (n <= 0) {
+      usage();
+      return 1;
+    }
+    threadCounts.push_back(n);
+  }
+  if (threadCounts.empty() || seconds <= 0 || nrKeys == 0 || batch <= 0) {
+    usage();
+    return 1;
+  }
+
+  alarmsSeen = 0;
+  cout << "Reads in M/s, updates per second:" << endl;
+  cout << "scheme\tbytes\tthreads\tM/s\tM/s/T\tretries\tupd/s" << endl;
+  for (int N : threadCounts) {
+    runBoth<16>(N);
+    runBoth<32>(N);
+    runBoth<64>(N);
+  }
+  cout << "alarms seen: " << alarmsSeen << endl;
+  return 0;
+}
@@ -0,0 +1,140 @@
+#include "DataProtector.h"
+
+#include <chrono>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <stdint.h>
+#include <thread>
+#include <vector>
+#include <stdlib.h>
+#include <unistd.h>
+
+// Instantiates the DataProtector with every combination of memory order
+// policy, slot alignment and counter width and measures the reader
+// throughput, together with the mean duration of scan(), such that the
+// best variant can be chosen per platform at build time. The readers do
+// the same as reader_protector in DataProtectorTest.cpp.
+
+#define maxN 64
+
+using namespace std;
+
+typedef chrono::steady_clock Clock;
+
+struct DataToBeProtected {
+  DataToBeProtected(int i) : nr(i), isValid(true) {
+  }
+  ~DataToBeProtected() {
+    isValid = false;
+  }
+  int nr;
+  bool isValid;
+};
+
+int seconds = 2;
+
+atomic<bool> stop;
+atomic<uint64_t> alarmsSeen;
+mutex mut;
+uint64_t total = 0;
+
+template<typename Order, int Align, typename Counter>
+void run (char const* order, char const* counter, int N) {
+  DataProtector<64, SleepWait, Order, Align, Counter> protector;
+  atomic<DataToBeProtected*> pointerToData(new DataToBeProtected(0));
+  stop = false;
+  total = 0;
+
+  vector<thread> readers;
+  for (int i = 0; i < N; i++) {
+    readers.emplace_back([&protector, &pointerToData] () -> void {
+      uint64_t count = 0;
+      while (! stop) {
+        for (int j = 0; j < 1000; j++) {
+          count++;
+          auto unuser(protector.use());
+          DataToBeProtected const* p = pointerToData;
+          if (! p->isValid) {
+            alarmsSeen++;
+          }
+        }
+      }
+      lock_guard<mutex> locker(mut);
+      total += count;
+    });
+  }
+
+  uint64_t scans = 0;
+  uint64_t scanNanos = 0;
+  Clock::time_point start = Clock::now();
+  Clock::time_point end = start + chrono::seconds(seconds);
+  for (int i = 1; Clock::now() < end; i++) {
+    DataToBeProtected* q = pointerToData;
+    pointerToData = new DataToBeProtected(i);
+    Clock::time_point t = Clock::now();
+    protector.scan();
+    scanNanos += chrono::duration_cast<chrono::nanoseconds>(
+                   Clock::now() - t).count();
+    scans++;
+    delete q;
+    usleep(10000);
+  }
+  stop = true;
+  for (thread& t : readers) {
+    t.join();
+  }
+  double elapsed = chrono::duration_cast<chrono::nanoseconds>(
+                     Clock::now() - start).count() / 1e9;
+  delete pointerToData.load();
+
+  cout << order << "\t" << Align << "\t" << counter << "\t" << N << "\t"
+       << total / 1e6 / elapsed << "\t" << total / 1e6 / elapsed / N << "\t"
+       << (scans > 0 ? scanNanos / scans / 1000.0 : 0.0) << endl;
+}
+
+template<typename Order>
+void runAll (char const* order, int N) {
+  run<Order, 64, int32_t>(order, "int32", N);
+  run<Order, 64, int64_t>(order, "int64", N);
+  run<Order, 128, int32_t>(order, "int32", N);
+  run<Order, 128, int64_t>(order, "int64", N);
+}
+
+void usage () {
+  cout << "Usage: PolicyTest [-t SECONDS] THREADS...\n"
+       << "  defaults: -t " << seconds << endl;
+}
+
+int main (int argc, char* argv[]) {
+  vector<int> threadCounts;
+  for (int i = 1; i < argc; i++) {
+    if (string(argv[i]) == "-t" && i + 1 < argc) {
+      seconds = atoi(argv[++i]);
+      continue;
+    }
+    int n = atoi(argv[i]);
+    if (n <= 0 || n > maxN) {
+      usage();
+      return 1;
+    }
+    threadCounts.push_back(n);
+  }
+  if (threadCounts.empty() || seconds <= 0) {
+    usage();
+    return 1;
+  }
+
+  alarmsSeen = 0;
+  AsymmetricOrder::init();
+  cout << "membarrier available: "
+       << (AsymmetricOrder::available() ? "yes" : "no") << endl;
+  cout << "order\talign\tcounter\tthreads\tM/s\tM/s/T\tscan us" << endl;
+  for (int N : threadCounts) {
+    runAll<SeqCstOrder>("seq_cst", N);
+    runAll<ReleaseFenceOrder>("release+fence", N);
+    runAll<AsymmetricOrder>("asymmetric", N);
+  }
+  cout << "alarms seen: " << alarmsSeen << endl;
+  return 0;
+}
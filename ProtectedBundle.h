@@ -0,0 +1,109 @@
+#ifndef PROTECTED_BUNDLE_H
+#define PROTECTED_BUNDLE_H 1
+
+#include <memory>
+#include <mutex>
+#include <tuple>
+#include <utility>
+
+#include "ProtectedPtr.h"
+
+// Several objects that must change together, published as one unit.
+// The bundle is an immutable tuple of shared pointers behind a single
+// ProtectedPtr, so a reader gets a consistent cut of all members with
+// one read section, exactly as expensive as reading a single
+// ProtectedPtr:
+//
+//   ProtectedBundle<Schema, IndexList, Permissions> catalog(s, i, p);
+//
+//   {
+//     auto snapshot(catalog.read());
+//     Schema const* s = snapshot.get<0>();
+//     Permissions const* p = snapshot.get<2>();
+//     ...
+//   }
+//
+//   catalog.publish(s2, i2, p2);       // all three at once
+//   catalog.set<1>(i3);                // only one, the others are kept
+//
+// The shared pointers are only touched by the writer, who copies them
+// into the new bundle; readers use the raw pointers and never change a
+// reference count. A member that is no longer part of any bundle is
+// destroyed with the last bundle that held it, after its grace period.
+//
+// The Protector of the ProtectedPtr is the first template parameter of
+// BasicProtectedBundle, since it cannot follow the members with a
+// default. ProtectedBundle uses a DataProtector<64>:
+//
+//   BasicProtectedBundle<DataProtector<64, FutexWait>, Schema, IndexList>
+
+template<typename Protector, typename... Ts>
+class BasicProtectedBundle {
+
+  public:
+
+    typedef std::tuple<std::shared_ptr<Ts const>...> Members;
+
+  private:
+
+    ProtectedPtr<Members, Protector> _bundle;
+    std::mutex _mutex;   // serializes the writers
+
+  public:
+
+    class Snapshot {
+        typename ProtectedPtr<Members, Protector>::Guard _guard;
+
+      public:
+        explicit Snapshot (
+            typename ProtectedPtr<Members, Protector>::Guard&& g)
+          : _guard(std::move(g)) {
+        }
+
+        template<size_t I>
+        typename std::tuple_element<I, std::tuple<Ts...>>::type const*
+        get () const {
+          return std::get<I>(*_guard).get();
+        }
+    };
+
+    explicit BasicProtectedBundle (std::shared_ptr<Ts const>... members)
+      : _bundle(new Members(std::move(members)...)) {
+    }
+
+    Snapshot read () {
+      return Snapshot(_bundle.read());
+    }
+
+    // Replaces all members with one grace period:
+    void publish (std::shared_ptr<Ts const>... members) {
+      std::lock_guard<std::mutex> locker(_mutex);
+      _bundle.publish(new Members(std::move(members)...));
+    }
+
+    // Replaces member I and keeps the others:
+    template<size_t I>
+    void set (typename std::tuple_element<I, Members>::type member) {
+      update([&member] (Members& m) -> void {
+        std::get<I>(m) = std::move(member);
+      });
+    }
+
+    // Applies any change to a copy of the members and publishes it:
+    template<typename Modify>
+    void update (Modify const& modify) {
+      std::lock_guard<std::mutex> locker(_mutex);
+      Members* copy;
+      {
+        auto guard(_bundle.read());
+        copy = new Members(*guard);
+      }
+      modify(*copy);
+      _bundle.publish(copy);
+    }
+};
+
+template<typename... Ts>
+using ProtectedBundle = BasicProtectedBundle<DataProtector<64>, Ts...>;
+
+#endif
@@ -0,0 +1,197 @@
+#ifndef PROTECTED_PTR_H
+#define PROTECTED_PTR_H 1
+
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+
+#include "DataProtector.h"
+
+// A pointer to an immutable object, protected by a DataProtector. This
+// is the pattern of reader_protector and writer_protector in
+// DataProtectorTest.cpp packaged into a class:
+//
+//   ProtectedPtr<Catalog> catalog(new Catalog(...));
+//
+//   {
+//     auto guard(catalog.read());
+//     lookup(guard->...);
+//   }
+//
+//   catalog.publish(new Catalog(...));   // deletes the old one
+//
+// Readers must not keep the pointer beyond the lifetime of the guard.
+// Writers are serialized by a mutex. The Protector must provide use()
+// and scan() like the DataProtector.
+//
+// A version that is needed for a long time, for example to write it to
+// disk, is pinned instead of being read under a guard, since a long
+// read section would block every scan(). A pinned version that is
+// replaced is not deleted after its grace period but when the last pin
+// goes away. Pinning takes a mutex and is meant to be rare, the read
+// path does not change.
+
+template<typename T, typename Protector = DataProtector<64>>
+class ProtectedPtr {
+
+    Protector _prot;
+    std::atomic<T const*> _ptr;
+    std::mutex _mutex;
+
+    struct PinState {
+      int pins;
+      bool retired;   // replaced, delete with the last pin
+    };
+
+    std::mutex _pinMutex;
+    std::unordered_map<T const*, PinState> _pinned;
+
+  public:
+
+    class Guard {
+        typename Protector::UnUser _unuser;
+        T const* _p;
+
+      public:
+        Guard (typename Protector::UnUser&& u, T const* p)
+          : _unuser(std::move(u)), _p(p) {
+        }
+
+        T const* get () const {
+          return _p;
+        }
+
+        T const* operator-> () const {
+          return _p;
+        }
+
+        T const& operator* () const {
+          return *_p;
+        }
+
+        explicit operator bool () const {
+          return _p != nullptr;
+        }
+    };
+
+    // Keeps a version alive independently of the reader slots:
+    class Pin {
+        ProtectedPtr* _owner;
+        T const* _p;
+
+      public:
+        Pin (ProtectedPtr* o, T const* p) : _owner(o), _p(p) {
+        }
+
+        ~Pin () {
+          if (_owner != nullptr) {
+            _owner->unpin(_p);
+          }
+        }
+
+        Pin (Pin&& that) : _owner(that._owner), _p(that._p) {
+          that._owner = nullptr;
+        }
+
+        Pin (Pin const&) = delete;
+        Pin& operator= (Pin const&) = delete;
+        Pin& operator= (Pin&&) = delete;
+
+        T const* get () const {
+          return _p;
+        }
+
+        T const* operator-> () const {
+          return _p;
+        }
+
+        T const& operator* () const {
+          return *_p;
+        }
+    };
+
+    explicit ProtectedPtr (T const* p = nullptr) : _ptr(p) {
+    }
+
+    // No reader may be active any more:
+    ~ProtectedPtr () {
+      delete _ptr.load();
+    }
+
+    ProtectedPtr (ProtectedPtr const&) = delete;
+    ProtectedPtr& operator= (ProtectedPtr const&) = delete;
+
+    Protector& protector () {
+      return _prot;
+    }
+
+    Guard read () {
+      auto unuser(_prot.use());
+      return Guard(std::move(unuser), _ptr.load());
+    }
+
+    // Pins the current version, which can be nullptr:
+    Pin pin () {
+      auto unuser(_prot.use());
+      T const* p = _ptr.load();
+      // The version cannot be deleted before our read section ends, and
+      // exchange() looks at the pins only after the grace period:
+      std::lock_guard<std::mutex> locker(_pinMutex);
+      if (p != nullptr) {
+        _pinned[p].pins++;
+      }
+      return Pin(this, p);
+    }
+
+    // Publishes p and returns the previous object once no reader can
+    // see it any more, such that the caller can reuse it. If the
+    // previous object is pinned, it still belongs to the pins and is
+    // deleted with the last one, then nullptr is returned:
+    T const* exchange (T const* p) {
+      std::lock_guard<std::mutex> locker(_mutex);
+      T const* old = _ptr.exchange(p);
+      _prot.scan();
+      std::lock_guard<std::mutex> pinLocker(_pinMutex);
+      auto it = _pinned.find(old);
+      if (it != _pinned.end()) {
+        it->second.retired = true;
+        return nullptr;
+      }
+      return old;
+    }
+
+    // Publishes p and deletes the previous object, or leaves that to
+    // the last unpin:
+    void publish (T const* p) {
+      T const* old = exchange(p);
+      if (old != nullptr) {
+        DP_TRACE(Reclaim, reinterpret_cast<uintptr_t>(old));
+        delete old;
+      }
+    }
+
+  private:
+
+    void unpin (T const* p) {
+      if (p == nullptr) {
+        return;
+      }
+      {
+        std::lock_guard<std::mutex> locker(_pinMutex);
+        auto it = _pinned.find(p);
+        if (--it->second.pins > 0) {
+          return;
+        }
+        bool retired = it->second.retired;
+        _pinned.erase(it);
+        if (! retired) {
+          return;
+        }
+      }
+      DP_TRACE(Reclaim, reinterpret_cast<uintptr_t>(p));
+      delete p;
+    }
+};
+
+#endif
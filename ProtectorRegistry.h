@@ -0,0 +1,232 @@
+#ifndef PROTECTOR_REGISTRY_H
+#define PROTECTOR_REGISTRY_H 1
+
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// A registry of named protectors and guardians, to look at them while
+// the program runs, for example from an admin endpoint. Registration is
+// opt-in and costs the readers nothing, the registry only reads the
+// slots when a snapshot is taken:
+//
+//   DataProtector<64> prot;
+//   ProtectorRegistry::Registration reg("catalog", prot);
+//
+//   ProtectorRegistry& registry = ProtectorRegistry::instance();
+//   std::string json = ProtectorRegistry::toJson(registry.snapshot());
+//
+// Anything with the introspection methods of the DataProtector (slots(),
+// slotCounts(), memory(), gracePeriods() and gracePeriodsInFlight()) or
+// of the DataGuardian and the DynamicDataGuardian can be registered, and
+// so can a RetireList, which adds its backlog, and anything else that
+// gives access to its protector with protector(), like a ProtectedPtr.
+//
+// The Registration must be destroyed before the registered instance,
+// so it is best declared right after it. The values of a snapshot are
+// read without synchronization with the readers and writers and are
+// only a sample: which instance is the hottest shows after a few
+// snapshots in the number of readers seen.
+
+class ProtectorRegistry {
+
+  public:
+
+    struct Stats {
+      std::string name;
+      std::string kind;
+      std::vector<int64_t> slotCounts;   // readers per slot
+      int busySlots;                     // slots with readers
+      int64_t readers;                   // sum of slotCounts
+      size_t bytes;                      // memory of the slots
+      uint64_t gracePeriods;             // completed
+      uint64_t gracePeriodsInFlight;
+      uint64_t retired;                  // retired, not yet deleted
+
+      Stats ()
+        : busySlots(0), readers(0), bytes(0), gracePeriods(0),
+          gracePeriodsInFlight(0), retired(0) {
+      }
+    };
+
+  private:
+
+    struct Entry {
+      std::string name;
+      void* instance;
+      void (*fill)(void* instance, Stats& stats);
+    };
+
+    std::mutex _mutex;   // protects the following
+    std::map<uint64_t, Entry> _entries;
+    uint64_t _nextId;
+
+    ProtectorRegistry () : _nextId(1) {
+    }
+
+  public:
+
+    static ProtectorRegistry& instance () {
+      static ProtectorRegistry registry;
+      return registry;
+    }
+
+    ProtectorRegistry (ProtectorRegistry const&) = delete;
+    ProtectorRegistry& operator= (ProtectorRegistry const&) = delete;
+
+    // Registers an instance under a name for its lifetime:
+    class Registration {
+        uint64_t _id;
+
+      public:
+        template<typename Instance>
+        Registration (std::string name, Instance& instance)
+          : _id(ProtectorRegistry::instance().add(std::move(name),
+                                                   instance)) {
+        }
+
+        ~Registration () {
+          if (_id != 0) {
+            ProtectorRegistry::instance().remove(_id);
+          }
+        }
+
+        Registration (Registration&& that) : _id(that._id) {
+          that._id = 0;
+        }
+
+        Registration (Registration const&) = delete;
+        Registration& operator= (Registration const&) = delete;
+        Registration& operator= (Registration&&) = delete;
+    };
+
+    // The current state of every registered instance, in the order of
+    // registration:
+    std::vector<Stats> snapshot () {
+      std::lock_guard<std::mutex> locker(_mutex);
+      std::vector<Stats> result;
+      result.reserve(_entries.size());
+      for (auto const& e : _entries) {
+        result.emplace_back();
+        Stats& s = result.back();
+        s.name = e.second.name;
+        e.second.fill(e.second.instance, s);
+        for (int64_t c : s.slotCounts) {
+          if (c > 0) {
+            s.busySlots++;
+            s.readers += c;
+          }
+        }
+      }
+      return result;
+    }
+
+    size_t size () {
+      std::lock_guard<std::mutex> locker(_mutex);
+      return _entries.size();
+    }
+
+    // Formats a snapshot as JSON, with the slot counts only if
+    // withSlots is set:
+    static std::string toJson (std::vector<Stats> const& stats,
+                               bool withSlots = true) {
+      std::ostringstream out;
+      out << "{\"instances\":[";
+      for (size_t i = 0; i < stats.size(); i++) {
+        Stats const& s = stats[i];
+        out << (i > 0 ? "," : "") << "\n  {\"name\":" << quote(s.name)
+            << ",\"kind\":" << quote(s.kind)
+            << ",\"slots\":" << s.slotCounts.size()
+            << ",\"busySlots\":" << s.busySlots
+            << ",\"readers\":" << s.readers
+            << ",\"bytes\":" << s.bytes
+            << ",\"gracePeriods\":" << s.gracePeriods
+            << ",\"gracePeriodsInFlight\":" << s.gracePeriodsInFlight
+            << ",\"retired\":" << s.retired;
+        if (withSlots) {
+          out << ",\"slotCounts\":[";
+          for (size_t j = 0; j < s.slotCounts.size(); j++) {
+            out << (j > 0 ? "," : "") << s.slotCounts[j];
+          }
+          out << "]";
+        }
+        out << "}";
+      }
+      out << "\n]}\n";
+      return out.str();
+    }
+
+  private:
+
+    template<typename Instance>
+    uint64_t add (std::string name, Instance& instance) {
+      Entry e;
+      e.name = std::move(name);
+      e.instance = &instance;
+      e.fill = [] (void* p, Stats& s) -> void {
+        fill(*static_cast<Instance*>(p), s);
+      };
+      std::lock_guard<std::mutex> locker(_mutex);
+      uint64_t id = _nextId++;
+      _entries.emplace(id, std::move(e));
+      return id;
+    }
+
+    void remove (uint64_t id) {
+      std::lock_guard<std::mutex> locker(_mutex);
+      _entries.erase(id);
+    }
+
+    template<typename Instance>
+    static void fill (Instance& i, Stats& s) {
+      if constexpr (requires { i.pending(); i.protector(); }) {
+        fill(i.protector(), s);
+        s.kind = "retire list";
+        s.retired = i.pending();
+      }
+      else if constexpr (requires { i.startGracePeriod(); }) {
+        s.kind = "protector";
+        i.slotCounts(s.slotCounts);
+        s.bytes = i.memory();
+        s.gracePeriods = i.gracePeriods();
+        s.gracePeriodsInFlight = i.gracePeriodsInFlight();
+      }
+      else if constexpr (requires { i.isHazard(nullptr); }) {
+        s.kind = "guardian";
+        i.slotCounts(s.slotCounts);
+        s.bytes = i.memory();
+        s.gracePeriods = i.gracePeriods();
+        s.gracePeriodsInFlight = i.gracePeriodsInFlight();
+      }
+      else {
+        fill(i.protector(), s);
+      }
+    }
+
+    static std::string quote (std::string const& str) {
+      std::string q = "\"";
+      for (char c : str) {
+        if (c == '"' || c == '\\') {
+          q += '\\';
+          q += c;
+        }
+        else if (static_cast<unsigned char>(c) < 0x20) {
+          char buf[8];
+          snprintf(buf, sizeof(buf), "\\u%04x", c);
+          q += buf;
+        }
+        else {
+          q += c;
+        }
+      }
+      return q + "\"";
+    }
+};
+
+#endif
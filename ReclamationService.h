@@ -0,0 +1,368 @@
+#ifndef RECLAMATION_SERVICE_H
+#define RECLAMATION_SERVICE_H 1
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <limits>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// One reclamation service for the whole process, shared by any number
+// of DataProtectors and DataGuardians. Writers hand over the objects
+// they have made unreachable and go on without waiting:
+//
+//   ReclamationService& service = ReclamationService::instance();
+//
+//   Data* old = pointerToData.exchange(new Data(...));
+//   service.retire(protector, old);         // a DataProtector
+//
+//   service.retire(guardian, guardian.publish(new Data(...)));
+//
+// The reclaimer threads collect everything retired since their last
+// round, group it by protector or guardian and start one grace period
+// per instance, that is, one grace period for all objects of a protector
+// in this round, however many there are. Then they advance all grace
+// periods with non-blocking steps, so one slow reader does not hold up
+// the other instances, and delete each group as soon as its grace
+// period is complete. For a protector this is a GracePeriod, for a
+// guardian the objects must not be hazards any more. Grace periods
+// which are not complete yet are kept for the next round, which starts
+// after a pause of interval and also takes the objects retired
+// meanwhile, so a slow reader delays only the objects it may see.
+//
+// The threads are started by the first retire() with the default
+// options, or by configure(), which can restrict them to some CPUs and
+// lower their priority, so reclamation never runs on the CPUs of the
+// latency critical threads. A protector or guardian must not be
+// destroyed while the service still holds objects for it, call flush()
+// first. This holds for static protectors as well: the service stops at
+// static destruction without touching a protector or guardian again and
+// leaves the objects still pending undeleted, since their protectors may
+// be gone by then.
+
+class ReclamationService {
+
+  public:
+
+    struct Options {
+      int threads;                          // number of reclaimer threads
+      std::vector<int> cpus;                // allowed CPUs, empty for all
+      int nice;                             // niceness of the threads
+      std::chrono::microseconds interval;   // pause between rounds
+
+      Options () : threads(1), nice(0), interval(100) {
+      }
+    };
+
+  private:
+
+    struct Retired {
+      void* ptr;
+      void (*deleter)(void*);
+      uint64_t seq;   // number given by retire()
+    };
+
+    // The objects of one protector or guardian in one round, with their
+    // grace period:
+    class Batch {
+      public:
+        std::vector<Retired> objects;
+
+        virtual ~Batch () {
+        }
+
+        // Returns true when the grace period is complete, never waits:
+        virtual bool step () = 0;
+    };
+
+    template<typename Protector>
+    class ProtectorBatch : public Batch {
+        typename Protector::GracePeriod _grace;
+
+      public:
+        explicit ProtectorBatch (Protector* p)
+          : _grace(p->startGracePeriod()) {
+        }
+
+        bool step () override {
+          return _grace.step(std::numeric_limits<int>::max() / 2,
+                             std::chrono::nanoseconds(0));
+        }
+    };
+
+    template<typename Guardian, typename T>
+    class GuardianBatch : public Batch {
+        Guardian* _guardian;
+        size_t _next;   // all objects before are no hazards any more
+
+      public:
+        explicit GuardianBatch (Guardian* g) : _guardian(g), _next(0) {
+          // As in replace(), the check must be ordered after the change
+          // of the version, which was done by another thread:
+          std::atomic_thread_fence(std::memory_order_seq_cst);
+        }
+
+        bool step () override {
+          while (_next < objects.size()) {
+            if (_guardian->isHazard(static_cast<T const*>(
+                                      objects[_next].ptr))) {
+              return false;
+            }
+            _next++;
+          }
+          _guardian->completeGracePeriods(objects.size());
+          return true;
+        }
+    };
+
+    struct Request {
+      void* domain;   // the protector or guardian
+      Batch* (*makeBatch)(void* domain);
+      Retired object;
+    };
+
+    std::mutex _mutex;   // protects all of the following
+    std::condition_variable _cond;
+    std::vector<Request> _incoming;
+    std::vector<std::thread> _threads;
+    Options _options;
+    bool _stopping;
+    bool _abandoning;    // stop without stepping or deleting anything
+    uint64_t _retired;   // number of objects handed over
+    std::set<uint64_t> _pending;   // seq of every object not deleted yet
+
+    std::atomic<uint64_t> _gracePeriods;
+    std::atomic<uint64_t> _rounds;
+
+    ReclamationService ()
+      : _stopping(false), _abandoning(false), _retired(0),
+        _gracePeriods(0), _rounds(0) {
+    }
+
+  public:
+
+    static ReclamationService& instance () {
+      static ReclamationService service;
+      return service;
+    }
+
+    // Runs at static destruction, when protectors and guardians with
+    // objects still pending may already be destroyed:
+    ~ReclamationService () {
+      {
+        std::lock_guard<std::mutex> locker(_mutex);
+        _abandoning = true;
+      }
+      stop();
+    }
+
+    ReclamationService (ReclamationService const&) = delete;
+    ReclamationService& operator= (ReclamationService const&) = delete;
+
+    // Restarts the threads with new options, everything retired so far
+    // is deleted before:
+    void configure (Options const& options) {
+      stop();
+      std::lock_guard<std::mutex> locker(_mutex);
+      _options = options;
+      startThreads();
+    }
+
+    // For a DataProtector: p must not be reachable for new readers any
+    // more. For a DataGuardian: p is the object returned by publish():
+    template<typename Domain, typename T>
+    void retire (Domain& domain, T const* p) {
+      if (p == nullptr) {
+        return;
+      }
+      Request r;
+      r.domain = &domain;
+      if constexpr (requires { domain.startGracePeriod(); }) {
+        r.makeBatch = [] (void* d) -> Batch* {
+          return new ProtectorBatch<Domain>(static_cast<Domain*>(d));
+        };
+      }
+      else {
+        r.makeBatch = [] (void* d) -> Batch* {
+          return new GuardianBatch<Domain, T>(static_cast<Domain*>(d));
+        };
+      }
+      r.object.ptr = const_cast<T*>(p);
+      r.object.deleter = [] (void* q) -> void {
+        delete static_cast<T*>(q);
+      };
+      std::lock_guard<std::mutex> locker(_mutex);
+      if (_threads.empty()) {
+        startThreads();
+      }
+      r.object.seq = ++_retired;
+      _incoming.push_back(r);
+      _pending.insert(r.object.seq);
+    }
+
+    // Waits until everything retired before has been deleted, must not
+    // be called inside a read section. Objects retired meanwhile do not
+    // count, each object retired before must be deleted itself:
+    void flush () {
+      std::unique_lock<std::mutex> locker(_mutex);
+      uint64_t target = _retired;
+      _cond.notify_all();
+      while (! _pending.empty() && *_pending.begin() <= target) {
+        if (_threads.empty()) {
+          startThreads();
+        }
+        _cond.wait_for(locker, _options.interval);
+      }
+    }
+
+    // Deletes everything retired so far and stops the threads:
+    void stop () {
+      std::vector<std::thread> threads;
+      {
+        std::lock_guard<std::mutex> locker(_mutex);
+        _stopping = true;
+        _cond.notify_all();
+        threads.swap(_threads);
+      }
+      for (std::thread& t : threads) {
+        t.join();
+      }
+      std::lock_guard<std::mutex> locker(_mutex);
+      _stopping = false;
+    }
+
+    // Statistics:
+    uint64_t pending () {
+      std::lock_guard<std::mutex> locker(_mutex);
+      return _pending.size();
+    }
+
+    uint64_t gracePeriods () const {
+      return _gracePeriods;
+    }
+
+    uint64_t rounds () const {
+      return _rounds;
+    }
+
+  private:
+
+    // Called with _mutex held:
+    void startThreads () {
+      for (int i = 0; i < _options.threads; i++) {
+        _threads.emplace_back([this] () -> void {
+          setup();
+          run();
+        });
+      }
+    }
+
+    void setup () {
+      if (! _options.cpus.empty()) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int cpu : _options.cpus) {
+          CPU_SET(cpu, &set);
+        }
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+      }
+      if (_options.nice != 0) {
+        // On Linux the niceness is a property of the thread:
+        setpriority(PRIO_PROCESS, static_cast<id_t>(syscall(SYS_gettid)),
+                    _options.nice);
+      }
+    }
+
+    // Each thread keeps the batches whose grace period is not complete
+    // yet and advances them again in the next round, after a pause of
+    // interval, together with the batches of the objects retired
+    // meanwhile:
+    void run () {
+      std::vector<Batch*> batches;
+      std::vector<uint64_t> freed;
+      std::unique_lock<std::mutex> locker(_mutex);
+      while (true) {
+        if (_abandoning && _stopping) {
+          for (Batch* b : batches) {
+            delete b;   // the objects stay, the domain is not touched
+          }
+          return;
+        }
+        if (_incoming.empty() && batches.empty()) {
+          if (_stopping) {
+            return;
+          }
+          _cond.wait_for(locker, _options.interval);
+          continue;
+        }
+        std::vector<Request> requests;
+        requests.swap(_incoming);
+        locker.unlock();
+        startBatches(requests, batches);
+        advance(batches, freed);
+        locker.lock();
+        for (uint64_t seq : freed) {
+          _pending.erase(seq);
+        }
+        freed.clear();
+        _cond.notify_all();
+        if (! batches.empty()) {
+          _cond.wait_for(locker, _options.interval);
+        }
+      }
+    }
+
+    // Starts one grace period per protector or guardian for the objects
+    // retired since the last round:
+    void startBatches (std::vector<Request> const& requests,
+                       std::vector<Batch*>& batches) {
+      if (requests.empty()) {
+        return;
+      }
+      std::unordered_map<void*, Batch*> byDomain;
+      size_t before = batches.size();
+      for (Request const& r : requests) {
+        Batch*& b = byDomain[r.domain];
+        if (b == nullptr) {
+          b = r.makeBatch(r.domain);
+          batches.push_back(b);
+        }
+        b->objects.push_back(r.object);
+      }
+      _gracePeriods += batches.size() - before;
+      _rounds++;
+    }
+
+    // Advances every grace period by one non-blocking step, deletes the
+    // objects of the complete ones and adds their numbers to freed:
+    static void advance (std::vector<Batch*>& batches,
+                         std::vector<uint64_t>& freed) {
+      size_t j = 0;
+      for (size_t i = 0; i < batches.size(); i++) {
+        Batch* b = batches[i];
+        if (b->step()) {
+          for (Retired& o : b->objects) {
+            o.deleter(o.ptr);
+            freed.push_back(o.seq);
+          }
+          delete b;
+        }
+        else {
+          batches[j++] = b;
+        }
+      }
+      batches.resize(j);
+    }
+};
+
+#endif
@@ -0,0 +1,93 @@
+#ifndef RECYCLE_POOL_H
+#define RECYCLE_POOL_H 1
+
+#include <mutex>
+#include <stdint.h>
+#include <vector>
+
+#include "SpinLock.h"
+
+// A bounded pool of reclaimed versions for writers that build versions
+// of the same shape over and over. Instead of deleting the old version
+// after the grace period and allocating a fresh one, the writer puts
+// the old one into the pool and overwrites it in place as the next
+// version, which saves the allocation, the page faults of fresh memory
+// and the destructor:
+//
+//   RecyclePool<Table> pool(2);
+//   Table* t = pool.get();
+//   if (t == nullptr) {
+//     t = new Table(...);
+//   }
+//   t->refill(...);
+//   pool.put(protectedPtr.exchange(t));   // or guardian.replace(t)
+//
+// The protection schemes hand out versions as T const*, but they were
+// allocated as T by the writer and no reader can see them any more once
+// they come back from exchange() or replace(), so put() takes them as
+// T const*. Objects beyond the capacity are deleted. A version that is
+// pinned is not handed back by exchange(), which returns nullptr for it,
+// and put() ignores nullptr.
+
+template<typename T>
+class RecyclePool {
+
+    SpinLock _lock;
+    std::vector<T*> _free;
+    size_t _capacity;
+    uint64_t _hits;
+    uint64_t _misses;
+
+  public:
+
+    explicit RecyclePool (size_t capacity)
+      : _capacity(capacity), _hits(0), _misses(0) {
+      _free.reserve(capacity);
+    }
+
+    ~RecyclePool () {
+      for (T* p : _free) {
+        delete p;
+      }
+    }
+
+    RecyclePool (RecyclePool const&) = delete;
+    RecyclePool& operator= (RecyclePool const&) = delete;
+
+    // A reclaimed object to overwrite, or nullptr if the pool is empty:
+    T* get () {
+      std::lock_guard<SpinLock> locker(_lock);
+      if (_free.empty()) {
+        _misses++;
+        return nullptr;
+      }
+      _hits++;
+      T* p = _free.back();
+      _free.pop_back();
+      return p;
+    }
+
+    void put (T const* p) {
+      if (p == nullptr) {
+        return;
+      }
+      {
+        std::lock_guard<SpinLock> locker(_lock);
+        if (_free.size() < _capacity) {
+          _free.push_back(const_cast<T*>(p));
+          return;
+        }
+      }
+      delete p;
+    }
+
+    uint64_t hits () const {
+      return _hits;
+    }
+
+    uint64_t misses () const {
+      return _misses;
+    }
+};
+
+#endif
@@ -0,0 +1,201 @@
+#include "DataGuardian.h"
+#include "ProtectedPtr.h"
+#include "RecyclePool.h"
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+#include <stdlib.h>
+
+// A writer refreshes a fixed-size table back to back, while readers
+// read random entries. We compare deleting the old version and
+// allocating a new one with recycling the old version through a
+// RecyclePool, for the DataProtector (through a ProtectedPtr) and for
+// the DataGuardian, and report the update rate and the update latency.
+// Every entry of a version holds the version number, so a reader sees
+// an alarm if a version is overwritten while it still reads it.
+
+#define maxN 64
+
+using namespace std;
+
+typedef chrono::steady_clock Clock;
+
+struct Table {
+  Table (uint64_t v, size_t n) : values(n, v) {
+  }
+  void refill (uint64_t v) {
+    fill(values.begin(), values.end(), v);
+  }
+  vector<uint64_t> values;
+};
+
+// Settings, see usage() below:
+int seconds = 2;
+size_t kilobytes = 1024;
+int readers = 2;
+
+atomic<bool> stop;
+atomic<uint64_t> alarmsSeen;
+mutex mut;
+uint64_t totalReads = 0;
+
+void check (Table const* t, uint64_t& x) {
+  x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+  size_t n = t->values.size();
+  if (t->values[(x >> 33) % n] != t->values[0]) {
+    alarmsSeen++;
+  }
+}
+
+void finishReader (uint64_t count) {
+  lock_guard<mutex> locker(mut);
+  totalReads += count;
+}
+
+// Runs the writer, update(v) publishes version v:
+template<typename Update>
+void writerLoop (char const* scheme, bool recycle, Update const& update,
+                 RecyclePool<Table>& pool) {
+  vector<uint64_t> latencies;
+  Clock::time_point start = Clock::now();
+  Clock::time_point end = start + chrono::seconds(seconds);
+  for (uint64_t v = 1; Clock::now() < end; v++) {
+    Clock::time_point t = Clock::now();
+    update(v);
+    latencies.push_back(chrono::duration_cast<chrono::nanoseconds>(
+                          Clock::now() - t).count());
+  }
+  double elapsed = chrono::duration_cast<chrono::nanoseconds>(
+                     Clock::now() - start).count() / 1e9;
+  stop = true;
+  sort(latencies.begin(), latencies.end());
+  size_t n = latencies.size();
+  uint64_t sum = 0;
+  for (uint64_t l : latencies) {
+    sum += l;
+  }
+  // Give the readers time to report:
+  this_thread::sleep_for(chrono::milliseconds(10));
+  lock_guard<mutex> locker(mut);
+  cout << scheme << "\t" << (recycle ? "recycle" : "new") << "\t"
+       << n / elapsed << "\t" << sum / n / 1000.0 << "\t"
+       << latencies[(n * 99) / 100] / 1000.0 << "\t" << pool.hits() << "\t"
+       << totalReads / 1e6 / elapsed << endl;
+}
+
+Table* nextVersion (RecyclePool<Table>& pool, bool recycle, uint64_t v,
+                    size_t n) {
+  Table* t = recycle ? pool.get() : nullptr;
+  if (t == nullptr) {
+    return new Table(v, n);
+  }
+  t->refill(v);
+  return t;
+}
+
+void runProtector (bool recycle, size_t n) {
+  ProtectedPtr<Table> table(new Table(0, n));
+  RecyclePool<Table> pool(2);
+  stop = false;
+  totalReads = 0;
+  vector<thread> threads;
+  for (int i = 0; i < readers; i++) {
+    threads.emplace_back([&table, i] () -> void {
+      uint64_t x = i + 1;
+      uint64_t count = 0;
+      while (! stop) {
+        auto guard(table.read());
+        check(guard.get(), x);
+        count++;
+      }
+      finishReader(count);
+    });
+  }
+  writerLoop("protector", recycle, [&] (uint64_t v) -> void {
+    Table* t = nextVersion(pool, recycle, v, n);
+    if (recycle) {
+      pool.put(table.exchange(t));
+    }
+    else {
+      table.publish(t);
+    }
+  }, pool);
+  for (thread& t : threads) {
+    t.join();
+  }
+}
+
+void runGuardian (bool recycle, size_t n) {
+  DataGuardian<Table, maxN> guardian;
+  guardian.exchange(new Table(0, n));
+  RecyclePool<Table> pool(2);
+  stop = false;
+  totalReads = 0;
+  vector<thread> threads;
+  for (int i = 0; i < readers; i++) {
+    threads.emplace_back([&guardian, i] () -> void {
+      uint64_t x = i + 1;
+      uint64_t count = 0;
+      while (! stop) {
+        check(guardian.lease(i), x);
+        guardian.unlease(i);
+        count++;
+      }
+      finishReader(count);
+    });
+  }
+  writerLoop("guardian", recycle, [&] (uint64_t v) -> void {
+    Table* t = nextVersion(pool, recycle, v, n);
+    if (recycle) {
+      pool.put(guardian.replace(t));
+    }
+    else {
+      guardian.exchange(t);
+    }
+  }, pool);
+  for (thread& t : threads) {
+    t.join();
+  }
+}
+
+void usage () {
+  cout << "Usage: RecycleTest [-t SECONDS] [-s KILOBYTES] [-r READERS]\n"
+       << "  defaults: -t " << seconds << " -s " << kilobytes << " -r "
+       << readers << endl;
+}
+
+int main (int argc, char* argv[]) {
+  for (int i = 1; i < argc; i++) {
+    if (argv[i][0] == '-' && i + 1 < argc) {
+      switch (argv[i][1]) {
+        case 't': seconds = atoi(argv[++i]); continue;
+        case 's': kilobytes = atoi(argv[++i]); continue;
+        case 'r': readers = atoi(argv[++i]); continue;
+      }
+    }
+    usage();
+    return 1;
+  }
+  if (seconds <= 0 || kilobytes == 0 || readers < 0 || readers > maxN) {
+    usage();
+    return 1;
+  }
+  size_t n = (kilobytes << 10) / sizeof(uint64_t);
+
+  alarmsSeen = 0;
+  cout << "Table of " << kilobytes << "KB, " << readers << " readers, "
+       << "update latency in microseconds:" << endl;
+  cout << "scheme\tmode\tupd/s\tmean\tp99\treused\treads M/s" << endl;
+  runProtector(false, n);
+  runProtector(true, n);
+  runGuardian(false, n);
+  runGuardian(true, n);
+  cout << "alarms seen: " << alarmsSeen << endl;
+  return 0;
+}
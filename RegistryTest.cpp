@@ -0,0 +1,227 @@
+#include "DataGuardian.h"
+#include "DataProtector.h"
+#include "ProtectorRegistry.h"
+#include "RetireList.h"
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// K registered DataProtectors, a DataGuardian and a RetireList, each
+// protecting its own pointer. Readers pick an instance at random, but
+// the first protector gets half of all reads. A writer updates random
+// instances. The main thread takes a snapshot of the registry every
+// few milliseconds, reports how long this took, and which instance had
+// the most readers summed over all snapshots, which should be the first
+// protector. With -j the last snapshot is printed as JSON.
+
+using namespace std;
+
+typedef chrono::steady_clock Clock;
+
+struct Data {
+  explicit Data (uint64_t v) : version(v), isValid(true) {
+  }
+  ~Data () {
+    isValid = false;
+  }
+  uint64_t version;
+  bool isValid;
+};
+
+int const maxThreads = 64;
+
+struct Instance {
+  DataProtector<64> prot;
+  ProtectorRegistry::Registration reg;
+  atomic<Data*> ptr;
+
+  explicit Instance (string const& name) : reg(name, prot), ptr(new Data(0)) {
+  }
+
+  ~Instance () {
+    delete ptr.load();
+  }
+};
+
+typedef DataGuardian<Data, maxThreads> Guardian;
+
+// Settings, see usage() below:
+int seconds = 2;
+int nrInstances = 100;
+int intervalMillis = 10;
+bool printJson = false;
+
+atomic<bool> stop;
+atomic<uint64_t> alarmsSeen;
+
+void check (Data const* d) {
+  if (! d->isValid) {
+    alarmsSeen++;
+  }
+}
+
+uint64_t nextRandom (uint64_t& x) {
+  x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+  return x >> 33;
+}
+
+void run (int N) {
+  vector<unique_ptr<Instance>> instances;
+  for (int k = 0; k < nrInstances; k++) {
+    instances.emplace_back(new Instance("protector-" + to_string(k)));
+  }
+  Guardian guardian;
+  ProtectorRegistry::Registration guardianReg("guardian", guardian);
+  guardian.exchange(new Data(0));
+  RetireList<> retired;
+  ProtectorRegistry::Registration retiredReg("retire-list", retired);
+  atomic<Data*> retiredPtr(new Data(0));
+
+  stop = false;
+  vector<thread> threads;
+  for (int i = 0; i < N; i++) {
+    threads.emplace_back([&, i] () -> void {
+      uint64_t x = i + 1;
+      while (! stop) {
+        uint64_t r = nextRandom(x) % (2 * nrInstances + 4);
+        if (r < static_cast<uint64_t>(nrInstances)) {
+          r = 0;   // the hot one
+        }
+        else {
+          r -= nrInstances;
+        }
+        if (r < static_cast<uint64_t>(nrInstances)) {
+          Instance& inst = *instances[r];
+          auto unuser(inst.prot.use());
+          check(inst.ptr.load());
+        }
+        else if (r < static_cast<uint64_t>(nrInstances) + 2) {
+          check(guardian.lease(i));
+          guardian.unlease(i);
+        }
+        else {
+          auto section(retired.use());
+          check(retiredPtr.load());
+        }
+      }
+    });
+  }
+  threads.emplace_back([&] () -> void {
+    uint64_t x = 4711;
+    uint64_t v = 0;
+    while (! stop) {
+      uint64_t k = nextRandom(x) % (nrInstances + 2);
+      v++;
+      if (k < static_cast<uint64_t>(nrInstances)) {
+        Instance& inst = *instances[k];
+        Data* old = inst.ptr.exchange(new Data(v));
+        inst.prot.scan();
+        delete old;
+      }
+      else if (k == static_cast<uint64_t>(nrInstances)) {
+        guardian.exchange(new Data(v));
+      }
+      else {
+        retired.retire(retiredPtr.exchange(new Data(v)));
+      }
+      usleep(10);
+    }
+  });
+
+  ProtectorRegistry& registry = ProtectorRegistry::instance();
+  vector<int64_t> readers;
+  vector<ProtectorRegistry::Stats> last;
+  uint64_t snapshots = 0;
+  chrono::nanoseconds spent(0);
+  Clock::time_point end = Clock::now() + chrono::seconds(seconds);
+  while (Clock::now() < end) {
+    usleep(intervalMillis * 1000);
+    Clock::time_point t = Clock::now();
+    last = registry.snapshot();
+    spent += Clock::now() - t;
+    snapshots++;
+    readers.resize(last.size());
+    for (size_t j = 0; j < last.size(); j++) {
+      readers[j] += last[j].readers;
+    }
+  }
+  stop = true;
+  for (thread& t : threads) {
+    t.join();
+  }
+  // Every exchange() of the guardian is a completed grace period:
+  for (ProtectorRegistry::Stats const& s : registry.snapshot()) {
+    if (s.name == "guardian" &&
+        (s.gracePeriods == 0 || s.gracePeriodsInFlight != 0)) {
+      cout << "ALARM: guardian grace periods not counted" << endl;
+      alarmsSeen++;
+    }
+  }
+
+  size_t hottest = 0;
+  for (size_t j = 1; j < readers.size(); j++) {
+    if (readers[j] > readers[hottest]) {
+      hottest = j;
+    }
+  }
+  cout << N << "\t" << last.size() << "\t" << snapshots << "\t"
+       << spent.count() / 1e3 / snapshots << "\t"
+       << (last.empty() ? "" : last[hottest].name) << endl;
+  if (printJson) {
+    cout << ProtectorRegistry::toJson(last, false);
+  }
+  retired.retire(retiredPtr.exchange(nullptr));
+}
+
+void usage () {
+  cout << "Usage: RegistryTest [-t SECONDS] [-k INSTANCES] "
+       << "[-i INTERVALMILLIS] [-j PRINTJSON] THREADS...\n"
+       << "  defaults: -t " << seconds << " -k " << nrInstances << " -i "
+       << intervalMillis << " -j " << printJson << endl;
+}
+
+int main (int argc, char* argv[]) {
+  vector<int> threadCounts;
+  for (int i = 1; i < argc; i++) {
+    if (argv[i][0] == '-' && i + 1 < argc) {
+      switch (argv[i][1]) {
+        case 't': seconds = atoi(argv[++i]); continue;
+        case 'k': nrInstances = atoi(argv[++i]); continue;
+        case 'i': intervalMillis = atoi(argv[++i]); continue;
+        case 'j': printJson = atoi(argv[++i]) != 0; continue;
+      }
+      usage();
+      return 1;
+    }
+    int n = atoi(argv[i]);
+    if (n <= 0 || n > maxThreads) {
+      usage();
+      return 1;
+    }
+    threadCounts.push_back(n);
+  }
+  if (threadCounts.empty() || seconds <= 0 || nrInstances <= 0 ||
+      intervalMillis <= 0) {
+    usage();
+    return 1;
+  }
+
+  alarmsSeen = 0;
+  cout << "Registered instances, snapshots, time per snapshot in us, "
+       << "hottest instance:" << endl;
+  cout << "threads\tinst.\tsnaps\tus\thottest" << endl;
+  for (int N : threadCounts) {
+    run(N);
+  }
+  cout << "alarms seen: " << alarmsSeen << endl;
+  return 0;
+}
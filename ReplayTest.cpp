@@ -0,0 +1,433 @@
+#include "DataGuardian.h"
+#include "DataProtector.h"
+#include "SpinLock.h"
+#include "WorkloadTrace.h"
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdlib.h>
+#include <unistd.h>
+
+// Replays a recorded workload (see WorkloadTrace.h) against the various
+// protection schemes. Every reader thread of the trace becomes a thread
+// which enters and leaves its read sections at the recorded times, all
+// publications are done by one writer thread at the recorded times. We
+// report how late the read sections could be entered compared to the
+// trace, how long the grace periods of the publications took, and how
+// much longer the whole replay took than the recording.
+//
+// For testing, "ReplayTest record" produces a synthetic trace with
+// bursty readers, occasional long read sections and irregular
+// publications, while protecting the data with a DataProtector.
+
+#define maxN 64
+
+using namespace std;
+
+typedef chrono::steady_clock Clock;
+
+struct DataToBeProtected {
+  DataToBeProtected(int i) : nr(i), isValid(true) {
+  }
+  ~DataToBeProtected() {
+    isValid = false;
+  }
+  int nr;
+  bool isValid;
+};
+
+atomic<uint64_t> nullptrsSeen;
+atomic<uint64_t> alarmsSeen;
+
+void check (DataToBeProtected const* p) {
+  if (p == nullptr) {
+    nullptrsSeen++;
+  }
+  else if (! p->isValid) {
+    alarmsSeen++;
+  }
+}
+
+// The schemes. Each has a read() which runs body with the current data
+// inside a read section, a publish() which installs a new version and
+// frees the old one when that is safe, and a finish() to clean up.
+
+DataProtector<64> protector;
+atomic<DataToBeProtected*> pointerToData(nullptr);
+
+struct ProtectorScheme {
+  template<typename F>
+  static void read (int, F const& body) {
+    auto unuser(protector.use());
+    body(pointerToData.load());
+  }
+  static void publish (int i) {
+    DataToBeProtected* q = pointerToData;
+    pointerToData = new DataToBeProtected(i);
+    protector.scan();
+    delete q;
+  }
+  static void finish () {
+    DataToBeProtected* q = pointerToData;
+    pointerToData = nullptr;
+    protector.scan();
+    delete q;
+  }
+};
+
+DataGuardian<DataToBeProtected, maxN> guardian;
+
+struct GuardianScheme {
+  template<typename F>
+  static void read (int id, F const& body) {
+    body(guardian.lease(id));
+    guardian.unlease(id);
+  }
+  static void publish (int i) {
+    guardian.exchange(new DataToBeProtected(i));
+  }
+  static void finish () {
+    guardian.exchange(nullptr);
+  }
+};
+
+DataToBeProtected const* underLock = nullptr;
+mutex dataMutex;
+shared_mutex sharedMutex;
+SpinLock spinLock;
+
+template<typename Lock, typename ReaderLock, Lock& lock>
+struct LockScheme {
+  template<typename F>
+  static void read (int, F const& body) {
+    ReaderLock locker(lock);
+    body(underLock);
+  }
+  static void publish (int i) {
+    DataToBeProtected* p = new DataToBeProtected(i);
+    lock_guard<Lock> locker(lock);
+    delete underLock;
+    underLock = p;
+  }
+  static void finish () {
+    lock_guard<Lock> locker(lock);
+    delete underLock;
+    underLock = nullptr;
+  }
+};
+
+atomic<shared_ptr<DataToBeProtected const>> sharedPtr;
+
+struct SharedPtrScheme {
+  template<typename F>
+  static void read (int, F const& body) {
+    shared_ptr<DataToBeProtected const> p = sharedPtr.load();
+    body(p.get());
+  }
+  static void publish (int i) {
+    sharedPtr.store(make_shared<DataToBeProtected const>(i));
+  }
+  static void finish () {
+    sharedPtr.store(nullptr);
+  }
+};
+
+// Sleeps most of the time and spins for the last bit, because the
+// sleep is not precise enough for short gaps:
+void waitUntil (Clock::time_point t) {
+  Clock::time_point now = Clock::now();
+  if (t - now > chrono::microseconds(100)) {
+    this_thread::sleep_for(t - now - chrono::microseconds(50));
+  }
+  while (Clock::now() < t) {
+    cpuRelax();
+  }
+}
+
+struct Section {
+  uint64_t enter;
+  uint64_t exit;
+};
+
+// Results, protected by mut:
+mutex mut;
+uint64_t sectionsReplayed = 0;
+uint64_t totalEnterDelay = 0;
+uint64_t maxEnterDelay = 0;
+
+template<typename Scheme>
+void replayReader (int id, vector<Section> const* sections,
+                   Clock::time_point start, double speed) {
+  uint64_t sum = 0;
+  uint64_t worst = 0;
+  for (Section const& s : *sections) {
+    Clock::time_point scheduled
+      = start + chrono::nanoseconds(static_cast<int64_t>(s.enter / speed));
+    Clock::time_point leave
+      = start + chrono::nanoseconds(static_cast<int64_t>(s.exit / speed));
+    waitUntil(scheduled);
+    Scheme::read(id, [&] (DataToBeProtected const* p) {
+      uint64_t delay = chrono::duration_cast<chrono::nanoseconds>(
+                         Clock::now() - scheduled).count();
+      sum += delay;
+      worst = max(worst, delay);
+      check(p);
+      // Hold the read section as long as in the trace:
+      while (Clock::now() < leave) {
+        cpuRelax();
+      }
+    });
+  }
+  lock_guard<mutex> locker(mut);
+  sectionsReplayed += sections->size();
+  totalEnterDelay += sum;
+  maxEnterDelay = max(maxEnterDelay, worst);
+}
+
+template<typename Scheme>
+void replay (WorkloadTrace const& trace, double speed) {
+  // Split the trace into the sections of each thread and the publishes:
+  vector<vector<Section>> sections(trace.nrThreads);
+  vector<uint64_t> open(trace.nrThreads, 0);
+  vector<uint64_t> publishes;
+  for (WorkloadEvent const& e : trace.events) {
+    switch (e.type) {
+      case WorkloadEvent::Enter: open[e.thread] = e.nanos; break;
+      case WorkloadEvent::Exit:
+        sections[e.thread].push_back(Section{open[e.thread], e.nanos});
+        break;
+      case WorkloadEvent::Publish: publishes.push_back(e.nanos); break;
+    }
+  }
+
+  sectionsReplayed = 0;
+  totalEnterDelay = 0;
+  maxEnterDelay = 0;
+  nullptrsSeen = 0;
+  alarmsSeen = 0;
+  Scheme::publish(0);
+
+  Clock::time_point start = Clock::now() + chrono::milliseconds(100);
+  vector<thread> readers;
+  int id = 0;
+  for (auto const& s : sections) {
+    if (! s.empty() && id < maxN) {
+      readers.emplace_back(replayReader<Scheme>, id++, &s, start, speed);
+    }
+  }
+  if (id == maxN) {
+    cout << "Warning: only the first " << maxN << " reader threads replayed"
+         << endl;
+  }
+
+  uint64_t graceTotal = 0;
+  uint64_t graceMax = 0;
+  for (size_t i = 0; i < publishes.size(); i++) {
+    waitUntil(start + chrono::nanoseconds(
+                        static_cast<int64_t>(publishes[i] / speed)));
+    Clock::time_point t = Clock::now();
+    Scheme::publish(static_cast<int>(i + 1));
+    uint64_t d = chrono::duration_cast<chrono::nanoseconds>(
+                   Clock::now() - t).count();
+    graceTotal += d;
+    graceMax = max(graceMax, d);
+  }
+  for (thread& t : readers) {
+    t.join();
+  }
+  double took = chrono::duration_cast<chrono::nanoseconds>(
+                  Clock::now() - start).count() / 1e9;
+  Scheme::finish();
+
+  double recorded = trace.events.empty() ? 0.0
+                    : trace.events.back().nanos / speed / 1e9;
+  cout << "Sections: " << sectionsReplayed << ", enter delay: mean "
+       << (sectionsReplayed > 0 ? totalEnterDelay / sectionsReplayed : 0)
+       << "ns, max " << maxEnterDelay << "ns" << endl;
+  cout << "Publishes: " << publishes.size() << ", publish+reclaim: mean "
+       << (publishes.empty() ? 0 : graceTotal / publishes.size())
+       << "ns, max " << graceMax << "ns" << endl;
+  cout << "Replay took " << took << "s for " << recorded << "s of trace"
+       << endl;
+  cout << "nullptr values seen: " << nullptrsSeen
+       << ", alarms seen: " << alarmsSeen << endl << endl;
+}
+
+// The synthetic workload for "record":
+WorkloadRecorder recorder;
+atomic<bool> stopRecording;
+
+void recordReader (int seed) {
+  mt19937 rng(seed);
+  uniform_int_distribution<int> burstLength(10, 1000);
+  uniform_int_distribution<int> idleMicros(100, 10000);
+  uniform_int_distribution<int> percent(0, 99);
+  while (! stopRecording) {
+    int n = burstLength(rng);
+    for (int i = 0; i < n; i++) {
+      WorkloadRecorder::Section section(recorder);
+      auto unuser(protector.use());
+      check(pointerToData);
+      // Most sections are short, a few hold on for a while:
+      if (percent(rng) == 0) {
+        usleep(100);
+      }
+    }
+    usleep(idleMicros(rng));
+  }
+}
+
+void recordWriter () {
+  mt19937 rng(4711);
+  uniform_int_distribution<int> gapMicros(1000, 50000);
+  int i = 0;
+  while (! stopRecording) {
+    recorder.recordPublish();
+    ProtectorScheme::publish(i++);
+    usleep(gapMicros(rng));
+  }
+}
+
+// A thread that alternates between two recorders must keep one thread
+// id in each, and more recorders than fit into its cache:
+bool alternatingThreadKeepsItsId () {
+  vector<unique_ptr<WorkloadRecorder>> recorders;
+  for (int i = 0; i < 6; i++) {
+    recorders.emplace_back(new WorkloadRecorder());
+    recorders.back()->start();
+  }
+  for (int j = 0; j < 100; j++) {
+    for (auto& r : recorders) {
+      r->recordPublish();
+    }
+  }
+  for (auto& r : recorders) {
+    r->stop();
+    WorkloadTrace t = r->trace();
+    if (t.nrThreads != 1 || t.events.size() != 100) {
+      return false;
+    }
+  }
+  return true;
+}
+
+int record (string const& file, int seconds, int nrThreads) {
+  if (! alternatingThreadKeepsItsId()) {
+    cout << "ALARM: a thread got a new log for every recorder switch"
+         << endl;
+    return 1;
+  }
+  ProtectorScheme::publish(0);
+  recorder.start();
+  stopRecording = false;
+  thread writer(recordWriter);
+  vector<thread> readers;
+  for (int i = 0; i < nrThreads; i++) {
+    readers.emplace_back(recordReader, i + 1);
+  }
+  sleep(seconds);
+  stopRecording = true;
+  for (thread& t : readers) {
+    t.join();
+  }
+  writer.join();
+  recorder.stop();
+  ProtectorScheme::finish();
+  WorkloadTrace trace = recorder.trace();
+  if (! trace.write(file)) {
+    cout << "Could not write " << file << endl;
+    return 1;
+  }
+  cout << "Recorded " << trace.events.size() << " events of "
+       << trace.nrThreads << " threads to " << file << endl;
+  return 0;
+}
+
+struct Mode {
+  char const* name;
+  void (*replay)(WorkloadTrace const&, double);
+};
+
+Mode modes[] = {
+  {"protector", replay<ProtectorScheme>},
+  {"guardian", replay<GuardianScheme>},
+  {"std::mutex", replay<LockScheme<mutex, lock_guard<mutex>, dataMutex>>},
+  {"std::shared_mutex",
+   replay<LockScheme<shared_mutex, shared_lock<shared_mutex>, sharedMutex>>},
+  {"spinlock",
+   replay<LockScheme<SpinLock, lock_guard<SpinLock>, spinLock>>},
+  {"std::atomic<std::shared_ptr>", replay<SharedPtrScheme>}
+};
+
+void usage () {
+  cout << "Usage: ReplayTest record FILE [SECONDS [THREADS]]\n"
+       << "       ReplayTest replay FILE [-m MODE]... [-x SPEED]" << endl;
+}
+
+int main (int argc, char* argv[]) {
+  if (argc < 3) {
+    usage();
+    return 1;
+  }
+  string command = argv[1];
+  string file = argv[2];
+  if (command == "record") {
+    int seconds = argc > 3 ? atoi(argv[3]) : 5;
+    int nrThreads = argc > 4 ? atoi(argv[4]) : 4;
+    if (seconds <= 0 || nrThreads <= 0 || nrThreads > maxN) {
+      usage();
+      return 1;
+    }
+    return record(file, seconds, nrThreads);
+  }
+  if (command != "replay") {
+    usage();
+    return 1;
+  }
+
+  vector<string> selected;
+  double speed = 1.0;
+  for (int i = 3; i < argc; i++) {
+    string arg = argv[i];
+    if (arg == "-m" && i + 1 < argc) {
+      selected.push_back(argv[++i]);
+    }
+    else if (arg == "-x" && i + 1 < argc) {
+      speed = atof(argv[++i]);
+    }
+    else {
+      usage();
+      return 1;
+    }
+  }
+  if (speed <= 0) {
+    usage();
+    return 1;
+  }
+
+  WorkloadTrace trace;
+  if (! trace.read(file)) {
+    cout << "Could not read trace " << file << endl;
+    return 1;
+  }
+  cout << "Trace " << file << ": " << trace.events.size() << " events of "
+       << trace.nrThreads << " threads, replay speed " << speed << endl
+       << endl;
+  for (Mode const& mode : modes) {
+    if (! selected.empty() &&
+        find(selected.begin(), selected.end(), mode.name) == selected.end()) {
+      continue;
+    }
+    cout << "Mode: " << mode.name << endl;
+    mode.replay(trace, speed);
+  }
+  return 0;
+}
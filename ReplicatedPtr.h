@@ -0,0 +1,220 @@
+#ifndef REPLICATED_PTR_H
+#define REPLICATED_PTR_H 1
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "ProtectedPtr.h"
+
+// A protected pointer that keeps one replica of every version per NUMA
+// node, such that readers only touch memory of their own node. The
+// writer passes a function that builds one replica; it is called once
+// per node by a thread that is bound to the CPUs of that node, so the
+// replica's pages are allocated on that node by the first touch policy
+// of the kernel. All replicas are published together and the old ones
+// are deleted after a single grace period:
+//
+//   ReplicatedPtr<Table> table;
+//   table.publish([&] () -> Table* { return new Table(source); });
+//
+//   {
+//     auto guard(table.read());    // the replica of this thread's node
+//     lookup(guard->...);
+//   }
+//
+// Readers find their node with sched_getcpu(), which is a vDSO call,
+// and only look again every RecheckInterval reads, since threads can
+// migrate. A reader that reads the replica of another node is slower,
+// but still correct. The topology is read from /sys at construction,
+// without it there is a single node.
+
+template<typename T, typename Protector = DataProtector<64>>
+class ReplicatedPtr {
+
+    static int const RecheckInterval = 256;
+
+    struct alignas(64) Replica {
+      std::atomic<T const*> ptr;
+    };
+
+    Protector _prot;
+    std::vector<std::vector<int>> _cpusOfNode;
+    std::vector<int> _nodeOfCpu;
+    int _nrNodes;
+    Replica* _replicas;
+    std::mutex _mutex;
+
+    struct ThreadNode {
+      int node;
+      int countdown;
+    };
+
+    static thread_local ThreadNode _myNode;
+
+  public:
+
+    typedef typename ProtectedPtr<T, Protector>::Guard Guard;
+
+    ReplicatedPtr () {
+      readTopology();
+      _nrNodes = static_cast<int>(_cpusOfNode.size());
+      _replicas = new Replica[_nrNodes];
+      for (int i = 0; i < nodes(); i++) {
+        _replicas[i].ptr = nullptr;
+      }
+    }
+
+    // No reader may be active any more:
+    ~ReplicatedPtr () {
+      for (int i = 0; i < nodes(); i++) {
+        delete _replicas[i].ptr.load();
+      }
+      delete[] _replicas;
+    }
+
+    ReplicatedPtr (ReplicatedPtr const&) = delete;
+    ReplicatedPtr& operator= (ReplicatedPtr const&) = delete;
+
+    int nodes () const {
+      return _nrNodes;
+    }
+
+    Guard read () {
+      auto unuser(_prot.use());
+      return Guard(std::move(unuser), _replicas[myNode()].ptr.load());
+    }
+
+    // Builds a replica per node with make, publishes them and deletes
+    // the previous replicas after the grace period:
+    void publish (std::function<T* ()> const& make) {
+      std::vector<T*> fresh(nodes(), nullptr);
+      if (nodes() == 1) {
+        fresh[0] = make();
+      }
+      else {
+        std::vector<std::thread> builders;
+        for (int n = 0; n < nodes(); n++) {
+          builders.emplace_back([this, n, &make, &fresh] () -> void {
+            bindToNode(n);
+            fresh[n] = make();
+          });
+        }
+        for (std::thread& t : builders) {
+          t.join();
+        }
+      }
+      std::lock_guard<std::mutex> locker(_mutex);
+      std::vector<T const*> old(nodes());
+      for (int n = 0; n < nodes(); n++) {
+        old[n] = _replicas[n].ptr.exchange(fresh[n]);
+      }
+      _prot.scan();
+      for (int n = 0; n < nodes(); n++) {
+        DP_TRACE(Reclaim, reinterpret_cast<uintptr_t>(old[n]));
+        delete old[n];
+      }
+    }
+
+  private:
+
+    int myNode () {
+      if (_nrNodes == 1) {
+        return 0;
+      }
+      ThreadNode& t = _myNode;
+      if (--t.countdown <= 0) {
+        int cpu = sched_getcpu();
+        t.node = cpu >= 0 && cpu < static_cast<int>(_nodeOfCpu.size())
+                 ? _nodeOfCpu[cpu] : 0;
+        t.countdown = RecheckInterval;
+      }
+      // Another ReplicatedPtr can have more nodes than this one:
+      return t.node < nodes() ? t.node : 0;
+    }
+
+    void bindToNode (int n) {
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      for (int cpu : _cpusOfNode[n]) {
+        CPU_SET(cpu, &set);
+      }
+      pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+
+    // Reads /sys/devices/system/node/node<N>/cpulist, which looks like
+    // "0-7,16-23":
+    void readTopology () {
+      DIR* dir = opendir("/sys/devices/system/node");
+      std::vector<int> ids;
+      if (dir != nullptr) {
+        while (struct dirent* e = readdir(dir)) {
+          int id;
+          if (sscanf(e->d_name, "node%d", &id) == 1) {
+            ids.push_back(id);
+          }
+        }
+        closedir(dir);
+      }
+      std::sort(ids.begin(), ids.end());
+      for (int id : ids) {
+        std::string path = "/sys/devices/system/node/node" +
+                           std::to_string(id) + "/cpulist";
+        FILE* f = fopen(path.c_str(), "r");
+        if (f == nullptr) {
+          continue;
+        }
+        std::vector<int> cpus;
+        int lo, hi;
+        char sep;
+        while (fscanf(f, "%d", &lo) == 1) {
+          hi = lo;
+          sep = '\n';
+          if (fscanf(f, "%c", &sep) == 1 && sep == '-') {
+            if (fscanf(f, "%d", &hi) != 1) {
+              break;
+            }
+            if (fscanf(f, "%c", &sep) != 1) {
+              sep = '\n';
+            }
+          }
+          for (int c = lo; c <= hi; c++) {
+            cpus.push_back(c);
+          }
+          if (sep != ',') {
+            break;
+          }
+        }
+        fclose(f);
+        if (! cpus.empty()) {
+          _cpusOfNode.push_back(cpus);
+        }
+      }
+      if (_cpusOfNode.empty()) {
+        _cpusOfNode.push_back(std::vector<int>());
+      }
+      for (size_t n = 0; n < _cpusOfNode.size(); n++) {
+        for (int cpu : _cpusOfNode[n]) {
+          if (cpu >= static_cast<int>(_nodeOfCpu.size())) {
+            _nodeOfCpu.resize(cpu + 1, 0);
+          }
+          _nodeOfCpu[cpu] = n;
+        }
+      }
+    }
+};
+
+template<typename T, typename Protector>
+thread_local typename ReplicatedPtr<T, Protector>::ThreadNode
+ReplicatedPtr<T, Protector>::_myNode = {0, 0};
+
+#endif
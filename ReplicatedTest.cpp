@@ -0,0 +1,131 @@
+#include "ProtectedPtr.h"
+#include "ReplicatedPtr.h"
+
+#include <chrono>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// Random lookups into a read-only table of a configurable size, which
+// is published either once through a ProtectedPtr or with one replica
+// per NUMA node through a ReplicatedPtr. The readers are spread over
+// all CPUs by the scheduler, so with the ProtectedPtr the readers on
+// all but one node read remote memory. A writer republishes the table
+// every 100ms. On a machine with a single node both should be equal.
+
+using namespace std;
+
+typedef chrono::steady_clock Clock;
+
+struct Table {
+  Table (uint64_t v, size_t n) : version(v), values(n) {
+    for (size_t i = 0; i < n; i++) {
+      values[i] = v ^ i;
+    }
+  }
+  uint64_t version;
+  vector<uint64_t> values;
+};
+
+// Settings, see usage() below:
+int seconds = 3;
+size_t megabytes = 256;
+
+atomic<bool> stop;
+atomic<uint64_t> alarmsSeen;
+mutex mut;
+uint64_t totalReads = 0;
+
+template<typename Ptr>
+void run (char const* scheme, Ptr& ptr,
+          function<void (uint64_t)> const& publish, int N) {
+  stop = false;
+  totalReads = 0;
+  vector<thread> readers;
+  for (int i = 0; i < N; i++) {
+    readers.emplace_back([&ptr, i] () -> void {
+      uint64_t x = i + 1;
+      uint64_t count = 0;
+      while (! stop) {
+        for (int j = 0; j < 1000; j++) {
+          auto guard(ptr.read());
+          x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+          size_t k = (x >> 20) % guard->values.size();
+          if (guard->values[k] != (guard->version ^ k)) {
+            alarmsSeen++;
+          }
+          count++;
+        }
+      }
+      lock_guard<mutex> locker(mut);
+      totalReads += count;
+    });
+  }
+  Clock::time_point start = Clock::now();
+  Clock::time_point end = start + chrono::seconds(seconds);
+  for (uint64_t v = 2; Clock::now() < end; v++) {
+    usleep(100000);
+    publish(v);
+  }
+  stop = true;
+  for (thread& t : readers) {
+    t.join();
+  }
+  double elapsed = chrono::duration_cast<chrono::nanoseconds>(
+                     Clock::now() - start).count() / 1e9;
+  cout << scheme << "\t" << N << "\t" << totalReads / 1e6 / elapsed << "\t"
+       << totalReads / 1e6 / elapsed / N << endl;
+}
+
+void usage () {
+  cout << "Usage: ReplicatedTest [-t SECONDS] [-s MEGABYTES] THREADS...\n"
+       << "  defaults: -t " << seconds << " -s " << megabytes << endl;
+}
+
+int main (int argc, char* argv[]) {
+  vector<int> threadCounts;
+  for (int i = 1; i < argc; i++) {
+    if (argv[i][0] == '-' && i + 1 < argc) {
+      switch (argv[i][1]) {
+        case 't': seconds = atoi(argv[++i]); continue;
+        case 's': megabytes = atoi(argv[++i]); continue;
+      }
+      usage();
+      return 1;
+    }
+    int n = atoi(argv[i]);
+    if (n <= 0) {
+      usage();
+      return 1;
+    }
+    threadCounts.push_back(n);
+  }
+  if (threadCounts.empty() || seconds <= 0 || megabytes == 0) {
+    usage();
+    return 1;
+  }
+  size_t n = (megabytes << 20) / sizeof(uint64_t);
+
+  alarmsSeen = 0;
+  ProtectedPtr<Table> single(new Table(1, n));
+  ReplicatedPtr<Table> replicated;
+  replicated.publish([n] () -> Table* { return new Table(1, n); });
+  cout << "NUMA nodes: " << replicated.nodes() << ", table: " << megabytes
+       << "MB" << endl;
+  cout << "scheme\tthreads\tM/s\tM/s/T" << endl;
+  for (int N : threadCounts) {
+    run("single", single, [&single, n] (uint64_t v) -> void {
+      single.publish(new Table(v, n));
+    }, N);
+    run("replicated", replicated, [&replicated, n] (uint64_t v) -> void {
+      replicated.publish([v, n] () -> Table* { return new Table(v, n); });
+    }, N);
+  }
+  cout << "alarms seen: " << alarmsSeen << endl;
+  return 0;
+}
@@ -0,0 +1,292 @@
+#ifndef RETIRE_LIST_H
+#define RETIRE_LIST_H 1
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <optional>
+#include <utility>
+#include <vector>
+#include <stddef.h>
+#include <unistd.h>
+
+#include "DataProtector.h"
+#include "SpinLock.h"
+
+// Deferred reclamation with a DataProtector: a writer retires the old
+// version and goes on without waiting, and the retired objects are
+// deleted after a grace period by whoever calls poll(). This can be the
+// readers themselves: a read section entered with use() calls poll()
+// after it has been left, once every helpEvery read sections of the
+// thread. No extra thread is needed and the writer never blocks:
+//
+//   RetireList<> retired;
+//
+//   {
+//     auto section(retired.use());
+//     read(pointerToData);
+//   }                                    // may help with reclamation
+//
+//   Data* old = pointerToData;
+//   pointerToData = new Data(...);
+//   retired.retire(old);
+//
+// poll() never waits. It only takes the reclamation mutex if nobody else
+// holds it, advances the grace period of the oldest batch by one
+// non-blocking GracePeriod::step(), and deletes at most maxFree objects
+// whose grace period is complete. The cost of a read section is
+// therefore bounded, and reclamation keeps pace with the rate of read
+// sections. A batch is everything retired since the previous grace
+// period was started.
+//
+// By default a grace period is started as soon as something has been
+// retired and the previous one is complete. With setWindow() a batch is
+// instead collected for up to maxDelay or until it has maxBatch
+// objects, whichever comes first, so a burst of updates needs a single
+// grace period. This trades a bounded additional delay of the deletion,
+// and the memory held meanwhile, for fewer grace periods. A window with
+// a batch size but without a time limit gets DefaultMaxDelay, so that a
+// batch that never fills up is not held forever.
+
+template<typename Protector = DataProtector<64>>
+class RetireList {
+
+    struct Retired {
+      void* ptr;
+      void (*deleter)(void*);
+    };
+
+    Protector _prot;
+
+    SpinLock _lock;                  // protects _open
+    std::vector<Retired> _open;      // not yet in a grace period
+
+    // Size and age of _open, such that poll() can decide without the
+    // lock whether the batching window is over:
+    std::atomic<size_t> _openSize;
+    std::atomic<std::chrono::steady_clock::rep> _openSince;
+
+    std::chrono::steady_clock::duration _maxDelay;
+    size_t _maxBatch;                // 0 for no limit
+
+    std::mutex _reclaim;             // protects the following
+    std::vector<Retired> _waiting;   // in the grace period _grace
+    std::optional<typename Protector::GracePeriod> _grace;
+    std::vector<Retired> _free;      // grace period complete
+    size_t _nextFree;                // all before have been deleted
+
+    std::atomic<size_t> _pending;    // retired and not yet deleted
+    std::atomic<uint64_t> _gracePeriods;
+    std::atomic<uint64_t> _freed;
+
+    int _slotsPerStep;
+    size_t _maxFree;
+    unsigned _helpEvery;
+
+    static thread_local unsigned _countdown;
+
+  public:
+
+    // The time limit of a window which only has a batch size:
+    static constexpr std::chrono::microseconds DefaultMaxDelay{10000};
+
+    // A read section, which leaves the protector before it helps:
+    class Section {
+        RetireList* _list;
+        std::optional<typename Protector::UnUser> _unuser;
+
+      public:
+        Section (RetireList* l, typename Protector::UnUser&& u)
+          : _list(l), _unuser(std::move(u)) {
+        }
+
+        Section (Section&& that)
+          : _list(that._list), _unuser(std::move(that._unuser)) {
+          that._list = nullptr;
+        }
+
+        Section (Section const&) = delete;
+        Section& operator= (Section const&) = delete;
+        Section& operator= (Section&&) = delete;
+
+        ~Section () {
+          if (_list != nullptr) {
+            _unuser.reset();
+            _list->help();
+          }
+        }
+    };
+
+    // Readers which help delete at most maxFree objects each time and
+    // look at most at slotsPerStep slots of the protector. A helpEvery
+    // of 0 means that readers never help, someone must call poll():
+    explicit RetireList (size_t maxFree = 16, unsigned helpEvery = 64,
+                         int slotsPerStep = 16)
+      : _openSize(0), _openSince(0), _maxDelay(0), _maxBatch(0),
+        _nextFree(0), _pending(0), _gracePeriods(0), _freed(0),
+        _slotsPerStep(slotsPerStep), _maxFree(maxFree),
+        _helpEvery(helpEvery) {
+    }
+
+    // No reader may be active any more:
+    ~RetireList () {
+      _prot.scan();
+      deleteAll(_open);
+      deleteAll(_waiting);
+      _free.erase(_free.begin(), _free.begin() + _nextFree);
+      deleteAll(_free);
+    }
+
+    Protector& protector () {
+      return _prot;
+    }
+
+    // Collects retired objects for at most maxDelay or until there are
+    // maxBatch of them (0 for no limit) before their grace period is
+    // started. A maxDelay of 0 with a maxBatch means DefaultMaxDelay,
+    // both 0 turn batching off. Call this before the list is used:
+    void setWindow (std::chrono::microseconds maxDelay, size_t maxBatch) {
+      if (maxDelay.count() == 0 && maxBatch > 0) {
+        maxDelay = DefaultMaxDelay;
+      }
+      _maxDelay = maxDelay;
+      _maxBatch = maxBatch;
+    }
+
+    // Like protector().use(), but helps with reclamation afterwards:
+    Section use () {
+      return Section(this, _prot.use());
+    }
+
+    // Deletes p after a grace period, p must not be reachable for new
+    // readers any more:
+    template<typename T>
+    void retire (T const* p) {
+      Retired r{const_cast<T*>(p), [] (void* q) -> void {
+        delete static_cast<T*>(q);
+      }};
+      std::lock_guard<SpinLock> locker(_lock);
+      if (_open.empty() && _maxDelay.count() > 0) {
+        _openSince.store(
+          std::chrono::steady_clock::now().time_since_epoch().count(),
+          std::memory_order_relaxed);
+      }
+      _open.push_back(r);
+      _openSize.store(_open.size(), std::memory_order_relaxed);
+      _pending++;
+    }
+
+    // Does a bounded amount of reclamation work without waiting,
+    // returns the number of objects deleted:
+    size_t poll (size_t maxFree) {
+      return poll(maxFree, false);
+    }
+
+    // Deletes everything retired so far, for writers that want to wait,
+    // must not be called inside a read section:
+    void reclaim () {
+      while (_pending > 0) {
+        if (poll(static_cast<size_t>(-1), true) == 0) {
+          usleep(1);
+        }
+      }
+    }
+
+    // Statistics:
+    size_t pending () const {
+      return _pending;
+    }
+
+    uint64_t gracePeriods () const {
+      return _gracePeriods;
+    }
+
+    uint64_t freed () const {
+      return _freed;
+    }
+
+  private:
+
+    // With force the batching window is ignored:
+    size_t poll (size_t maxFree, bool force) {
+      if (_pending.load(std::memory_order_relaxed) == 0) {
+        return 0;
+      }
+      std::unique_lock<std::mutex> locker(_reclaim, std::try_to_lock);
+      if (! locker.owns_lock()) {
+        return 0;
+      }
+      if (_grace && _grace->step(_slotsPerStep,
+                                 std::chrono::nanoseconds(0))) {
+        _grace.reset();
+        _gracePeriods++;
+        if (_nextFree == _free.size()) {
+          _free.clear();
+          _nextFree = 0;
+        }
+        _free.insert(_free.end(), _waiting.begin(), _waiting.end());
+        _waiting.clear();
+      }
+      if (! _grace && (force || windowClosed())) {
+        {
+          std::lock_guard<SpinLock> guard(_lock);
+          _waiting.swap(_open);
+          _openSize.store(0, std::memory_order_relaxed);
+        }
+        if (! _waiting.empty()) {
+          _grace.emplace(_prot.startGracePeriod());
+        }
+      }
+      size_t n = 0;
+      while (n < maxFree && _nextFree < _free.size()) {
+        Retired& r = _free[_nextFree++];
+        r.deleter(r.ptr);
+        n++;
+      }
+      if (n > 0) {
+        _pending -= n;
+        _freed += n;
+      }
+      return n;
+    }
+
+    bool windowClosed () const {
+      if (_maxDelay.count() == 0 && _maxBatch == 0) {
+        return true;
+      }
+      size_t size = _openSize.load(std::memory_order_relaxed);
+      if (size == 0) {
+        return false;   // nothing to do
+      }
+      if (_maxBatch > 0 && size >= _maxBatch) {
+        return true;
+      }
+      std::chrono::steady_clock::duration age
+        = std::chrono::steady_clock::now().time_since_epoch()
+          - std::chrono::steady_clock::duration(
+              _openSince.load(std::memory_order_relaxed));
+      return _maxDelay.count() > 0 && age >= _maxDelay;
+    }
+
+    void help () {
+      if (_helpEvery == 0) {
+        return;
+      }
+      if (--_countdown == 0) {
+        _countdown = _helpEvery;
+        poll(_maxFree);
+      }
+    }
+
+    static void deleteAll (std::vector<Retired>& v) {
+      for (Retired& r : v) {
+        r.deleter(r.ptr);
+      }
+      v.clear();
+    }
+};
+
+template<typename Protector>
+thread_local unsigned RetireList<Protector>::_countdown = 1;
+
+#endif
@@ -0,0 +1,230 @@
+#include "DataProtector.h"
+#include "RetireList.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// A writer publishes new versions with a short pause in between while
+// readers read the current one. We compare three ways to reclaim the
+// old versions: the writer runs scan() and deletes (blocking), a
+// dedicated reclaimer thread polls a RetireList, and the readers poll
+// the RetireList themselves when they leave a read section
+// (cooperative). We report read and publication rates, grace periods,
+// and the average and largest number of retired objects not yet
+// deleted. The RetireList runs are repeated for every batching window
+// given with -w, to show how the window trades memory held for grace
+// periods.
+
+using namespace std;
+
+typedef chrono::steady_clock Clock;
+
+struct Data {
+  explicit Data (uint64_t v) : version(v), isValid(true) {
+  }
+  ~Data () {
+    isValid = false;
+  }
+  uint64_t version;
+  bool isValid;
+};
+
+// Settings, see usage() below:
+int seconds = 2;
+int pauseMicros = 10;
+unsigned helpEvery = 64;
+size_t maxFree = 16;
+vector<int> windows;   // in microseconds
+size_t maxBatch = 0;
+
+atomic<Data*> pointerToData;
+atomic<bool> stop;
+atomic<uint64_t> alarmsSeen;
+mutex mut;
+uint64_t totalReads = 0;
+
+void check (Data const* d) {
+  if (! d->isValid) {
+    alarmsSeen++;
+  }
+}
+
+// The writer calls publish(v) in a loop, which returns the number of
+// objects retired but not yet deleted, and reports the grace periods
+// with gracePeriods():
+template<typename Read, typename Publish, typename GracePeriods>
+void run (char const* scheme, int N, int window, Read const& read,
+          Publish const& publish, GracePeriods const& gracePeriods) {
+  stop = false;
+  totalReads = 0;
+  vector<thread> threads;
+  for (int i = 0; i < N; i++) {
+    threads.emplace_back([&read] () -> void {
+      uint64_t count = 0;
+      while (! stop) {
+        for (int j = 0; j < 1000; j++) {
+          read();
+          count++;
+        }
+      }
+      lock_guard<mutex> locker(mut);
+      totalReads += count;
+    });
+  }
+  uint64_t publications = 0;
+  size_t maxPending = 0;
+  uint64_t sumPending = 0;
+  Clock::time_point start = Clock::now();
+  Clock::time_point end = start + chrono::seconds(seconds);
+  while (Clock::now() < end) {
+    size_t pending = publish(++publications);
+    maxPending = max(maxPending, pending);
+    sumPending += pending;
+    usleep(pauseMicros);
+  }
+  stop = true;
+  for (thread& t : threads) {
+    t.join();
+  }
+  double elapsed = chrono::duration_cast<chrono::nanoseconds>(
+                     Clock::now() - start).count() / 1e9;
+  double avgPending = static_cast<double>(sumPending) / publications;
+  cout << scheme << "\t" << N << "\t" << window << "\t"
+       << totalReads / 1e6 / elapsed << "\t" << publications / elapsed
+       << "\t" << gracePeriods() / elapsed << "\t" << avgPending << "\t"
+       << maxPending << "\t" << avgPending * sizeof(Data) / 1024 << endl;
+}
+
+void runScan (int N) {
+  DataProtector<64> prot;
+  pointerToData = new Data(0);
+  uint64_t scans = 0;
+  run("writer scan", N, 0, [&prot] () -> void {
+    auto unuser(prot.use());
+    check(pointerToData.load());
+  }, [&prot, &scans] (uint64_t v) -> size_t {
+    Data* old = pointerToData.exchange(new Data(v));
+    prot.scan();
+    scans++;
+    delete old;
+    return 0;
+  }, [&scans] () -> uint64_t {
+    return scans;
+  });
+  delete pointerToData.exchange(nullptr);
+}
+
+void runReclaimer (int N, int window) {
+  RetireList<> list(maxFree, helpEvery);
+  list.setWindow(chrono::microseconds(window), maxBatch);
+  pointerToData = new Data(0);
+  atomic<bool> done(false);
+  thread reclaimer([&list, &done] () -> void {
+    while (! done) {
+      if (list.poll(static_cast<size_t>(-1)) == 0) {
+        usleep(pauseMicros);
+      }
+    }
+  });
+  run("reclaimer", N, window, [&list] () -> void {
+    auto unuser(list.protector().use());
+    check(pointerToData.load());
+  }, [&list] (uint64_t v) -> size_t {
+    list.retire(pointerToData.exchange(new Data(v)));
+    return list.pending();
+  }, [&list] () -> uint64_t {
+    return list.gracePeriods();
+  });
+  done = true;
+  reclaimer.join();
+  list.retire(pointerToData.exchange(nullptr));
+}
+
+void runCooperative (int N, int window) {
+  RetireList<> list(maxFree, helpEvery);
+  list.setWindow(chrono::microseconds(window), maxBatch);
+  pointerToData = new Data(0);
+  run("cooperative", N, window, [&list] () -> void {
+    auto section(list.use());
+    check(pointerToData.load());
+  }, [&list] (uint64_t v) -> size_t {
+    list.retire(pointerToData.exchange(new Data(v)));
+    return list.pending();
+  }, [&list] () -> uint64_t {
+    return list.gracePeriods();
+  });
+  list.retire(pointerToData.exchange(nullptr));
+}
+
+void usage () {
+  cout << "Usage: RetireTest [-t SECONDS] [-p PAUSEMICROS] [-e HELPEVERY] "
+       << "[-f MAXFREE]\n"
+       << "                  [-w WINDOWMICROS,...] [-b MAXBATCH] THREADS...\n"
+       << "  defaults: -t " << seconds << " -p " << pauseMicros << " -e "
+       << helpEvery << " -f " << maxFree << " -w 0 -b " << maxBatch
+       << endl;
+}
+
+int main (int argc, char* argv[]) {
+  vector<int> threadCounts;
+  for (int i = 1; i < argc; i++) {
+    if (argv[i][0] == '-' && i + 1 < argc) {
+      switch (argv[i][1]) {
+        case 't': seconds = atoi(argv[++i]); continue;
+        case 'p': pauseMicros = atoi(argv[++i]); continue;
+        case 'e': helpEvery = atoi(argv[++i]); continue;
+        case 'f': maxFree = strtoull(argv[++i], nullptr, 10); continue;
+        case 'b': maxBatch = strtoull(argv[++i], nullptr, 10); continue;
+        case 'w': {
+          istringstream list(argv[++i]);
+          string w;
+          while (getline(list, w, ',')) {
+            windows.push_back(atoi(w.c_str()));
+          }
+          continue;
+        }
+      }
+      usage();
+      return 1;
+    }
+    int n = atoi(argv[i]);
+    if (n <= 0) {
+      usage();
+      return 1;
+    }
+    threadCounts.push_back(n);
+  }
+  if (threadCounts.empty() || seconds <= 0 || helpEvery == 0 ||
+      maxFree == 0) {
+    usage();
+    return 1;
+  }
+  if (windows.empty()) {
+    windows.push_back(0);
+  }
+
+  alarmsSeen = 0;
+  cout << "Reads in M/s, publications and grace periods per second, "
+       << "average and largest backlog, KB held on average:" << endl;
+  cout << "scheme\tthreads\twindow\tM/s\tpubl/s\tgrace/s\tavg\tmax\tKB"
+       << endl;
+  for (int N : threadCounts) {
+    runScan(N);
+    for (int w : windows) {
+      runReclaimer(N, w);
+      runCooperative(N, w);
+    }
+  }
+  cout << "alarms seen: " << alarmsSeen << endl;
+  return 0;
+}
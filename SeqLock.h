@@ -0,0 +1,85 @@
+#ifndef SEQ_LOCK_H
+#define SEQ_LOCK_H 1
+
+#include <atomic>
+#include <stdint.h>
+#include <string.h>
+#include <type_traits>
+
+#include "SpinLock.h"
+
+// A sequence lock protecting a small value of type T, which is stored
+// by value and not behind a pointer. The writer makes the sequence
+// number odd, changes the value and makes it even again. Readers copy
+// the value and retry if the sequence number was odd or has changed in
+// the meantime. Readers never write to shared memory, but they can
+// starve while a writer is busy, and the value must be copied on every
+// read, so this is only an option for small trivially copyable values.
+//
+// To avoid a data race in the sense of the C++ memory model, the value
+// is stored in relaxed atomic words, which compiles to plain loads and
+// stores on all relevant platforms. There must only be one writer at a
+// time, use a mutex if necessary.
+
+template<typename T>
+class SeqLock {
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "SeqLock can only protect trivially copyable values");
+
+    static size_t const Words = (sizeof(T) + sizeof(uint64_t) - 1)
+                                / sizeof(uint64_t);
+
+    std::atomic<uint64_t> _seq;
+    std::atomic<uint64_t> _data[Words];
+
+  public:
+    explicit SeqLock (T const& initial) : _seq(0) {
+      store(initial);
+    }
+
+    SeqLock (SeqLock const&) = delete;
+    SeqLock& operator= (SeqLock const&) = delete;
+
+    T read () const {
+      uint64_t buffer[Words];
+      while (true) {
+        uint64_t s = _seq.load(std::memory_order_acquire);
+        if ((s & 1) == 0) {
+          for (size_t i = 0; i < Words; i++) {
+            buffer[i] = _data[i].load(std::memory_order_relaxed);
+          }
+          // Orders the loads of the data before the second load of the
+          // sequence number:
+          std::atomic_thread_fence(std::memory_order_acquire);
+          if (_seq.load(std::memory_order_relaxed) == s) {
+            break;
+          }
+        }
+        cpuRelax();
+      }
+      T result;
+      memcpy(&result, buffer, sizeof(T));
+      return result;
+    }
+
+    void write (T const& value) {
+      uint64_t s = _seq.load(std::memory_order_relaxed);
+      _seq.store(s + 1, std::memory_order_relaxed);
+      // Orders the odd sequence number before the stores of the data:
+      std::atomic_thread_fence(std::memory_order_release);
+      store(value);
+      _seq.store(s + 2, std::memory_order_release);
+    }
+
+  private:
+
+    void store (T const& value) {
+      uint64_t buffer[Words] = {};
+      memcpy(buffer, &value, sizeof(T));
+      for (size_t i = 0; i < Words; i++) {
+        _data[i].store(buffer[i], std::memory_order_relaxed);
+      }
+    }
+};
+
+#endif
@@ -0,0 +1,264 @@
+#include "DataGuardian.h"
+#include "DataProtector.h"
+#include "ReclamationService.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// Many instances (-k) of DataProtector or DataGuardian, each protecting
+// its own pointer. Readers read random instances, a writer updates
+// random instances with a short pause in between. We compare the
+// writer waiting itself (scan() or exchange()) with handing the old
+// versions to the process-wide ReclamationService, and report the read
+// and update rates, and how many grace periods and rounds the service
+// needed for them.
+
+using namespace std;
+
+typedef chrono::steady_clock Clock;
+
+struct Data {
+  explicit Data (uint64_t v) : version(v), isValid(true) {
+  }
+  ~Data () {
+    isValid = false;
+  }
+  uint64_t version;
+  bool isValid;
+};
+
+int const maxThreads = 64;
+
+struct ProtectedInstance {
+  DataProtector<64> prot;
+  atomic<Data*> ptr;
+};
+
+typedef DataGuardian<Data, maxThreads> Guardian;
+
+// Settings, see usage() below:
+int seconds = 2;
+int nrInstances = 100;
+int pauseMicros = 10;
+ReclamationService::Options options;
+
+atomic<bool> stop;
+atomic<uint64_t> alarmsSeen;
+mutex mut;
+uint64_t totalReads = 0;
+
+void check (Data const* d) {
+  if (! d->isValid) {
+    alarmsSeen++;
+  }
+}
+
+uint64_t nextRandom (uint64_t& x) {
+  x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+  return x >> 33;
+}
+
+template<typename Read, typename Update>
+void run (char const* scheme, int N, Read const& read,
+          Update const& update) {
+  ReclamationService& service = ReclamationService::instance();
+  uint64_t gracePeriods = service.gracePeriods();
+  uint64_t rounds = service.rounds();
+  stop = false;
+  totalReads = 0;
+  vector<thread> threads;
+  for (int i = 0; i < N; i++) {
+    threads.emplace_back([&read, i] () -> void {
+      uint64_t x = i + 1;
+      uint64_t count = 0;
+      while (! stop) {
+        for (int j = 0; j < 1000; j++) {
+          read(i, nextRandom(x) % nrInstances);
+          count++;
+        }
+      }
+      lock_guard<mutex> locker(mut);
+      totalReads += count;
+    });
+  }
+  uint64_t x = 4711;
+  uint64_t updates = 0;
+  Clock::time_point start = Clock::now();
+  Clock::time_point end = start + chrono::seconds(seconds);
+  while (Clock::now() < end) {
+    update(nextRandom(x) % nrInstances, ++updates);
+    usleep(pauseMicros);
+  }
+  stop = true;
+  for (thread& t : threads) {
+    t.join();
+  }
+  service.flush();
+  double elapsed = chrono::duration_cast<chrono::nanoseconds>(
+                     Clock::now() - start).count() / 1e9;
+  cout << scheme << "\t" << N << "\t" << totalReads / 1e6 / elapsed << "\t"
+       << updates / elapsed << "\t"
+       << service.gracePeriods() - gracePeriods << "\t"
+       << service.rounds() - rounds << endl;
+}
+
+void runProtectors (int N, bool useService) {
+  vector<unique_ptr<ProtectedInstance>> instances;
+  for (int k = 0; k < nrInstances; k++) {
+    instances.emplace_back(new ProtectedInstance());
+    instances.back()->ptr = new Data(0);
+  }
+  ReclamationService& service = ReclamationService::instance();
+  run(useService ? "protector service" : "protector scan", N,
+      [&instances] (int, uint64_t k) -> void {
+    ProtectedInstance& inst = *instances[k];
+    auto unuser(inst.prot.use());
+    check(inst.ptr.load());
+  }, [&instances, &service, useService] (uint64_t k, uint64_t v) -> void {
+    ProtectedInstance& inst = *instances[k];
+    Data* old = inst.ptr.exchange(new Data(v));
+    if (useService) {
+      service.retire(inst.prot, old);
+    }
+    else {
+      inst.prot.scan();
+      delete old;
+    }
+  });
+  for (auto& inst : instances) {
+    delete inst->ptr.exchange(nullptr);
+  }
+}
+
+void runGuardians (int N, bool useService) {
+  vector<unique_ptr<Guardian>> instances;
+  for (int k = 0; k < nrInstances; k++) {
+    instances.emplace_back(new Guardian());
+    instances.back()->exchange(new Data(0));
+  }
+  ReclamationService& service = ReclamationService::instance();
+  run(useService ? "guardian service" : "guardian exchange", N,
+      [&instances] (int id, uint64_t k) -> void {
+    Guardian& g = *instances[k];
+    check(g.lease(id));
+    g.unlease(id);
+  }, [&instances, &service, useService] (uint64_t k, uint64_t v) -> void {
+    Guardian& g = *instances[k];
+    if (useService) {
+      service.retire(g, g.publish(new Data(v)));
+    }
+    else {
+      g.exchange(new Data(v));
+    }
+  });
+}
+
+// flush() must wait for an object whose reader is slow, even when many
+// objects of other instances, retired after flush() started, have been
+// deleted meanwhile:
+bool flushWaitsForSlowReader () {
+  ReclamationService& service = ReclamationService::instance();
+  ProtectedInstance slow;
+  ProtectedInstance fast;
+  atomic<bool> flushed(false);
+  atomic<bool> stopRetiring(false);
+  thread flusher;
+  thread retirer;
+  {
+    auto unuser(slow.prot.use());
+    service.retire(slow.prot, new Data(1));
+    flusher = thread([&service, &flushed] () -> void {
+      service.flush();
+      flushed = true;
+    });
+    retirer = thread([&service, &fast, &stopRetiring] () -> void {
+      while (! stopRetiring) {
+        service.retire(fast.prot, new Data(2));
+        usleep(10);
+      }
+    });
+    usleep(100000);
+    if (flushed) {
+      cout << "flush() returned while an object was still in use" << endl;
+      alarmsSeen++;
+    }
+  }
+  stopRetiring = true;
+  retirer.join();
+  flusher.join();
+  service.flush();
+  return alarmsSeen == 0;
+}
+
+void usage () {
+  cout << "Usage: ServiceTest [-t SECONDS] [-k INSTANCES] [-p PAUSEMICROS] "
+       << "[-w WORKERS] [-c CPU,...] [-n NICE] THREADS...\n"
+       << "  defaults: -t " << seconds << " -k " << nrInstances << " -p "
+       << pauseMicros << " -w " << options.threads << " -n "
+       << options.nice << endl;
+}
+
+int main (int argc, char* argv[]) {
+  vector<int> threadCounts;
+  for (int i = 1; i < argc; i++) {
+    if (argv[i][0] == '-' && i + 1 < argc) {
+      switch (argv[i][1]) {
+        case 't': seconds = atoi(argv[++i]); continue;
+        case 'k': nrInstances = atoi(argv[++i]); continue;
+        case 'p': pauseMicros = atoi(argv[++i]); continue;
+        case 'w': options.threads = atoi(argv[++i]); continue;
+        case 'n': options.nice = atoi(argv[++i]); continue;
+        case 'c': {
+          istringstream cpus(argv[++i]);
+          string cpu;
+          while (getline(cpus, cpu, ',')) {
+            options.cpus.push_back(atoi(cpu.c_str()));
+          }
+          continue;
+        }
+      }
+      usage();
+      return 1;
+    }
+    int n = atoi(argv[i]);
+    if (n <= 0 || n > maxThreads) {
+      usage();
+      return 1;
+    }
+    threadCounts.push_back(n);
+  }
+  if (threadCounts.empty() || seconds <= 0 || nrInstances <= 0 ||
+      options.threads <= 0) {
+    usage();
+    return 1;
+  }
+
+  ReclamationService::instance().configure(options);
+  alarmsSeen = 0;
+  if (! flushWaitsForSlowReader()) {
+    cout << "alarms seen: " << alarmsSeen << endl;
+    return 1;
+  }
+  cout << "Reads in M/s, updates per second, grace periods and rounds of "
+       << "the service:" << endl;
+  cout << "scheme\t\tthreads\tM/s\tupd/s\tgrace\trounds" << endl;
+  for (int N : threadCounts) {
+    runProtectors(N, false);
+    runProtectors(N, true);
+    runGuardians(N, false);
+    runGuardians(N, true);
+  }
+  cout << "alarms seen: " << alarmsSeen << endl;
+  return 0;
+}
@@ -0,0 +1,468 @@
+#ifndef SHARED_MEMORY_PROTECTOR_H
+#define SHARED_MEMORY_PROTECTOR_H 1
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "EventTrace.h"
+#include "ThreadExit.h"
+#include "WaitStrategy.h"
+
+// A DataProtector for several processes on one host. The slot counters,
+// the offset of the published snapshot, its version and the snapshot
+// data itself all live in one POSIX shared memory region, so a large
+// snapshot is held only once in memory for all processes.
+//
+// One process creates the region with a size and is the writer: it
+// allocates space for a new snapshot in the arena of the region, fills
+// it, and publishes it. publish() runs a grace period over the slots of
+// all processes and then frees the previous snapshot. The writer holds
+// an exclusive flock() on the region while it has it open, so opening
+// it as a second writer fails. The lock goes away with the writer, but
+// children forked by the writer share it until they close the region
+// too. Any number of processes open the region by name and read:
+//
+//   auto unuser(shm.use());
+//   Snapshot const* s = static_cast<Snapshot const*>(shm.current());
+//
+// The region is mapped at different addresses in different processes,
+// therefore the snapshot must not contain pointers, only offsets
+// relative to its own start.
+//
+// Every process claims one slot at its first use() and all its threads
+// share it. A process that crashes inside a read section leaves its
+// counter raised. The writer therefore checks, while it waits for a
+// slot, whether the owning process still exists (kill(pid, 0) fails
+// with ESRCH), and if not, resets the slot and makes it free again.
+// Processes that terminate normally also leave their slot behind, it
+// is recovered in the same way when the slots run out, or given back
+// by close(). A pid that is reused by a new process before its slot was
+// recovered keeps the slot busy until that process terminates as well.
+// At most Nr processes can read at the same time.
+//
+// This recovery has two limits. A process that has died but has not yet
+// been reaped by its parent (a zombie) still exists for kill(), so its
+// slot is only recovered once it is reaped. And pids are only unique
+// within a pid namespace: all processes sharing a region must be in the
+// same one, otherwise the writer can take a live reader in another
+// namespace for dead and recover its slot under it.
+//
+// A region can only be opened once per process and must be opened again
+// after fork(). open() and close() must not run concurrently with other
+// methods in other threads of the process, in particular close() gives
+// back the slot of the process, which a sibling thread in use() would
+// still increment. All methods that can fail return false or nullptr.
+
+template<int Nr = 64>
+class SharedMemoryProtector {
+
+    static int const MaxBlocks = 64;
+    static int32_t const Recovering = -1;
+
+    struct alignas(64) Slot {
+      std::atomic<int64_t> count;
+      std::atomic<int32_t> pid;    // 0 if free
+    };
+
+    // An allocated piece of the arena, only used by the writer:
+    struct Block {
+      uint64_t offset;   // from the start of the region
+      uint64_t size;     // 0 if this entry is unused
+    };
+
+    // Every block starts with this, the caller gets the memory after it:
+    struct BlockHeader {
+      uint64_t size;
+      uint64_t padding;
+    };
+
+    struct Region {
+      char magic[8];
+      uint64_t regionSize;
+      uint64_t arenaOffset;
+      std::atomic<uint64_t> published;   // offset of a block, 0 if none
+      std::atomic<uint64_t> version;
+      std::atomic<uint64_t> recovered;   // slots of dead processes
+      Block blocks[MaxBlocks];
+      Slot slots[Nr];
+    };
+
+    static constexpr char const* Magic = "DPSHM01";
+
+    Region* _region;
+    size_t _mappedSize;
+    int _fd;
+    bool _writer;
+    std::atomic<int> _mySlot;
+    std::mutex _registerMutex;
+
+  public:
+
+    // A class to automatically unuse the SharedMemoryProtector:
+    class UnUser {
+        SharedMemoryProtector* _prot;
+        int _id;
+        ThreadExit::Token _token;
+
+      public:
+        UnUser (SharedMemoryProtector* p, int i, ThreadExit::Token t)
+          : _prot(p), _id(i), _token(t) {
+        }
+
+        ~UnUser () {
+          if (_prot != nullptr) {
+            _prot->unUse(_id, _token);
+          }
+        }
+
+        UnUser (UnUser&& that)
+          : _prot(that._prot), _id(that._id), _token(that._token) {
+          that._prot = nullptr;
+        }
+
+        UnUser (UnUser const& that) = delete;
+        UnUser& operator= (UnUser const& that) = delete;
+        UnUser& operator= (UnUser&& that) = delete;
+        UnUser () = delete;
+    };
+
+    SharedMemoryProtector ()
+      : _region(nullptr), _mappedSize(0), _fd(-1), _writer(false),
+        _mySlot(-1) {
+    }
+
+    ~SharedMemoryProtector () {
+      close();
+    }
+
+    // Creates the region (if it does not exist) with room for arenaSize
+    // bytes of snapshots and opens it as the writer, or opens an
+    // existing region as a reader if arenaSize is 0. Fails if the region
+    // already has a writer and arenaSize is not 0:
+    bool open (std::string const& name, size_t arenaSize) {
+      if (_region != nullptr) {
+        return false;
+      }
+      _writer = arenaSize > 0;
+      int fd = shm_open(name.c_str(), _writer ? O_RDWR | O_CREAT : O_RDWR,
+                        0600);
+      if (fd < 0) {
+        return false;
+      }
+      // Before the size is looked at, so that only one writer creates:
+      if (_writer && flock(fd, LOCK_EX | LOCK_NB) != 0) {
+        ::close(fd);
+        return false;
+      }
+      struct stat st;
+      if (fstat(fd, &st) != 0) {
+        ::close(fd);
+        return false;
+      }
+      size_t size = st.st_size;
+      bool fresh = false;
+      if (_writer && size == 0) {
+        size = arenaOffset() + roundUp(arenaSize);
+        if (ftruncate(fd, size) != 0) {
+          ::close(fd);
+          return false;
+        }
+        fresh = true;
+      }
+      if (size < sizeof(Region)) {
+        ::close(fd);
+        return false;
+      }
+      void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+                     0);
+      if (p == MAP_FAILED) {
+        ::close(fd);
+        return false;
+      }
+      Region* r = static_cast<Region*>(p);
+      if (fresh) {
+        // ftruncate has zeroed everything, which is a valid state for
+        // all atomics, the magic is written last:
+        r->regionSize = size;
+        r->arenaOffset = arenaOffset();
+        memcpy(r->magic, Magic, 8);
+      }
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (memcmp(r->magic, Magic, 8) != 0 || r->regionSize != size) {
+        munmap(p, size);
+        ::close(fd);
+        return false;
+      }
+      _region = r;
+      _mappedSize = size;
+      _fd = fd;
+      _mySlot = -1;
+      return true;
+    }
+
+    void close () {
+      if (_region != nullptr) {
+        int id = _mySlot;
+        int32_t me = static_cast<int32_t>(getpid());
+        if (id >= 0 && _region->slots[id].count.load() == 0) {
+          _region->slots[id].pid.compare_exchange_strong(me, 0);
+        }
+        munmap(_region, _mappedSize);
+        ::close(_fd);
+        _region = nullptr;
+        _mySlot = -1;
+      }
+    }
+
+    // Removes the name, processes which have the region open keep it:
+    static bool remove (std::string const& name) {
+      return shm_unlink(name.c_str()) == 0;
+    }
+
+    bool isOpen () const {
+      return _region != nullptr;
+    }
+
+    UnUser use () {
+      int id = _mySlot.load(std::memory_order_relaxed);
+      if (id < 0) {
+        id = registerProcess();
+      }
+      _region->slots[id].count.fetch_add(1, std::memory_order_seq_cst);
+      ThreadExit::Token token = ThreadExit::enter(this, &repair, id);
+      DP_TRACE(Use, id);
+      return UnUser(this, id, token);  // return value optimization!
+    }
+
+    // The published snapshot, only valid inside a read section, nullptr
+    // if nothing has been published yet:
+    void const* current (size_t* size = nullptr) const {
+      uint64_t off = _region->published.load();
+      if (off == 0) {
+        if (size != nullptr) {
+          *size = 0;
+        }
+        return nullptr;
+      }
+      BlockHeader const* h = reinterpret_cast<BlockHeader const*>(
+                               base() + off);
+      if (size != nullptr) {
+        *size = h->size;
+      }
+      return h + 1;
+    }
+
+    uint64_t version () const {
+      return _region->version.load();
+    }
+
+    // The number of slots of dead processes that have been recovered:
+    uint64_t recovered () const {
+      return _region->recovered.load();
+    }
+
+    // Writer only: space for a snapshot of the given size in the arena,
+    // nullptr if there is not enough contiguous space left:
+    void* allocate (size_t size) {
+      if (! _writer) {
+        return nullptr;
+      }
+      uint64_t need = roundUp(sizeof(BlockHeader) + size);
+      Block* entry = nullptr;
+      for (int i = 0; i < MaxBlocks && entry == nullptr; i++) {
+        if (_region->blocks[i].size == 0) {
+          entry = &_region->blocks[i];
+        }
+      }
+      if (entry == nullptr) {
+        return nullptr;
+      }
+      // First fit: a block can start at the beginning of the arena or
+      // right after another block.
+      uint64_t best = UINT64_MAX;
+      for (int i = -1; i < MaxBlocks; i++) {
+        uint64_t start;
+        if (i < 0) {
+          start = _region->arenaOffset;
+        }
+        else if (_region->blocks[i].size != 0) {
+          start = _region->blocks[i].offset + _region->blocks[i].size;
+        }
+        else {
+          continue;
+        }
+        if (start < best && start + need <= _region->regionSize &&
+            isFree(start, need)) {
+          best = start;
+        }
+      }
+      if (best == UINT64_MAX) {
+        return nullptr;
+      }
+      entry->offset = best;
+      entry->size = need;
+      BlockHeader* h = reinterpret_cast<BlockHeader*>(base() + best);
+      h->size = size;
+      return h + 1;
+    }
+
+    // Writer only: gives back space which has never been published:
+    void deallocate (void* p) {
+      if (p != nullptr) {
+        freeBlock(offsetOf(p));
+      }
+    }
+
+    // Writer only: publishes a snapshot from allocate(), waits until no
+    // reader in any process can still see the previous one and frees it.
+    // There is no way to publish nullptr:
+    bool publish (void* p) {
+      if (! _writer || p == nullptr) {
+        return false;
+      }
+      uint64_t old = _region->published.exchange(offsetOf(p));
+      _region->version++;
+      scan();
+      if (old != 0) {
+        DP_TRACE(Reclaim, old);
+        freeBlock(old);
+      }
+      return true;
+    }
+
+    // Waits until every reader which has called use() before has left
+    // its read section, in every process:
+    void scan () {
+      DP_TRACE(ScanStart, 0);
+      for (int i = 0; i < Nr; i++) {
+        Slot& s = _region->slots[i];
+        for (int round = 0; s.count.load() > 0; round++) {
+          // A system call per round would be too much while spinning:
+          if (round % 64 == 63 && recoverIfDead(s)) {
+            break;
+          }
+          if (! waitBriefly(round, 100, 10)) {
+            DP_TRACE(SleepStart, i);
+            usleep(250);
+            DP_TRACE(SleepEnd, i);
+          }
+        }
+      }
+      DP_TRACE(ScanEnd, 0);
+    }
+
+  private:
+
+    void unUse (int id, ThreadExit::Token token) {
+      DP_TRACE(Unuse, id);
+      if (ThreadExit::leave(this, id, token)) {
+        _region->slots[id].count.fetch_sub(1, std::memory_order_seq_cst);
+      }
+    }
+
+    // Called at thread exit for read sections the thread never left:
+    static void repair (void* prot, int id, int count) {
+      SharedMemoryProtector* p = static_cast<SharedMemoryProtector*>(prot);
+      if (p->_region != nullptr) {
+        p->_region->slots[id].count.fetch_sub(count);
+      }
+    }
+
+    // Claims a free slot for this process, or one of a dead process.
+    // A slot is never shared between processes, since recovering it
+    // after the death of one would break the read sections of the
+    // other. Therefore, if all slots belong to live processes, we wait
+    // until one of them goes away.
+    int registerProcess () {
+      std::lock_guard<std::mutex> locker(_registerMutex);
+      int id = _mySlot;
+      if (id >= 0) {
+        return id;
+      }
+      int32_t me = static_cast<int32_t>(getpid());
+      for (int round = 0; id < 0; round++) {
+        for (int i = 0; i < Nr && id < 0; i++) {
+          Slot& s = _region->slots[i];
+          if (round > 0) {
+            recoverIfDead(s);
+          }
+          int32_t expected = 0;
+          if (s.pid.compare_exchange_strong(expected, me)) {
+            id = i;
+          }
+        }
+        if (id < 0 && round > 0) {
+          usleep(1000);
+        }
+      }
+      _mySlot = id;
+      return id;
+    }
+
+    // If the owner of the slot does not exist any more, resets the slot
+    // and returns true. Only the thread that wins the compare-and-swap
+    // of the pid touches the counter.
+    bool recoverIfDead (Slot& s) {
+      int32_t pid = s.pid.load();
+      if (pid <= 0 || kill(pid, 0) == 0 || errno != ESRCH) {
+        return false;
+      }
+      if (! s.pid.compare_exchange_strong(pid, Recovering)) {
+        return false;
+      }
+      if (s.count.exchange(0) != 0) {
+        _region->recovered++;
+      }
+      s.pid = 0;
+      return true;
+    }
+
+    bool isFree (uint64_t start, uint64_t size) const {
+      for (int i = 0; i < MaxBlocks; i++) {
+        Block const& b = _region->blocks[i];
+        if (b.size != 0 && b.offset < start + size &&
+            start < b.offset + b.size) {
+          return false;
+        }
+      }
+      return true;
+    }
+
+    void freeBlock (uint64_t offset) {
+      for (int i = 0; i < MaxBlocks; i++) {
+        if (_region->blocks[i].size != 0 &&
+            _region->blocks[i].offset == offset) {
+          _region->blocks[i].size = 0;
+          return;
+        }
+      }
+    }
+
+    uint64_t offsetOf (void* p) const {
+      return static_cast<char*>(p) - sizeof(BlockHeader) - base();
+    }
+
+    char* base () const {
+      return reinterpret_cast<char*>(_region);
+    }
+
+    static uint64_t roundUp (uint64_t n) {
+      return (n + 63) & ~static_cast<uint64_t>(63);
+    }
+
+    static uint64_t arenaOffset () {
+      return roundUp(sizeof(Region));
+    }
+};
+
+#endif
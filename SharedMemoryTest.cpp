@@ -0,0 +1,222 @@
+#include "SharedMemoryProtector.h"
+
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Cross-process test for the SharedMemoryProtector: a writer process
+// publishes snapshots into a shared memory region, which is reused
+// right after every grace period, and forked reader processes check
+// that the snapshot they see is never overwritten while they read it.
+// With -k, an additional process is killed with SIGKILL inside a read
+// section, and the writer has to recover its slot to make progress.
+
+using namespace std;
+
+typedef chrono::steady_clock Clock;
+
+// The snapshot is position independent: no pointers, only values.
+struct Snapshot {
+  uint64_t version;
+  uint64_t n;
+  uint64_t values[1];   // n of them, values[i] == version ^ i
+};
+
+// Settings, see usage() below:
+int seconds = 3;
+int processes = 4;
+size_t snapshotBytes = 1 << 20;
+int pauseMicros = 10000;
+bool killOne = false;
+
+size_t snapshotSize (uint64_t n) {
+  return sizeof(Snapshot) + (n - 1) * sizeof(uint64_t);
+}
+
+bool check (Snapshot const* s, uint64_t i) {
+  return s->values[i] == (s->version ^ i);
+}
+
+// Runs in a forked process, sends the number of reads and of alarms
+// through the pipe:
+void reader (string const& name, int fd, int seed) {
+  SharedMemoryProtector<> shm;
+  if (! shm.open(name, 0)) {
+    cout << "Reader cannot open " << name << endl;
+    _exit(1);
+  }
+  uint64_t counts[2] = {0, 0};
+  uint64_t x = seed;
+  Clock::time_point end = Clock::now() + chrono::seconds(seconds);
+  while (Clock::now() < end) {
+    for (int j = 0; j < 1000; j++) {
+      auto unuser(shm.use());
+      Snapshot const* s = static_cast<Snapshot const*>(shm.current());
+      counts[0]++;
+      if (s == nullptr) {
+        continue;
+      }
+      x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+      if (! check(s, 0) || ! check(s, (x >> 33) % s->n) ||
+          ! check(s, s->n - 1)) {
+        counts[1]++;
+      }
+    }
+  }
+  shm.close();
+  if (write(fd, counts, sizeof(counts)) != sizeof(counts)) {
+    _exit(1);
+  }
+  _exit(0);
+}
+
+// Enters a read section and dies in it:
+void victim (string const& name) {
+  SharedMemoryProtector<> shm;
+  if (! shm.open(name, 0)) {
+    _exit(1);
+  }
+  new SharedMemoryProtector<>::UnUser(shm.use());
+  raise(SIGKILL);
+}
+
+bool publish (SharedMemoryProtector<>& shm, uint64_t version) {
+  uint64_t n = snapshotBytes / sizeof(uint64_t);
+  void* p = shm.allocate(snapshotSize(n));
+  if (p == nullptr) {
+    return false;
+  }
+  Snapshot* s = static_cast<Snapshot*>(p);
+  s->version = version;
+  s->n = n;
+  for (uint64_t i = 0; i < n; i++) {
+    s->values[i] = version ^ i;
+  }
+  return shm.publish(p);
+}
+
+void usage () {
+  cout << "Usage: SharedMemoryTest [-t SECONDS] [-p PROCESSES] "
+       << "[-s SNAPSHOTBYTES] [-w PAUSEMICROS] [-k]\n"
+       << "  defaults: -t " << seconds << " -p " << processes << " -s "
+       << snapshotBytes << " -w " << pauseMicros << endl;
+}
+
+int main (int argc, char* argv[]) {
+  for (int i = 1; i < argc; i++) {
+    if (string(argv[i]) == "-k") {
+      killOne = true;
+      continue;
+    }
+    if (argv[i][0] == '-' && i + 1 < argc) {
+      switch (argv[i][1]) {
+        case 't': seconds = atoi(argv[++i]); continue;
+        case 'p': processes = atoi(argv[++i]); continue;
+        case 's': snapshotBytes = strtoull(argv[++i], nullptr, 10); continue;
+        case 'w': pauseMicros = atoi(argv[++i]); continue;
+      }
+    }
+    usage();
+    return 1;
+  }
+  if (seconds <= 0 || processes <= 0 || processes >= 64 ||
+      snapshotBytes < sizeof(Snapshot)) {
+    usage();
+    return 1;
+  }
+
+  string name = "/DataProtectorTest-" + to_string(getpid());
+  SharedMemoryProtector<> shm;
+  // Room for two snapshots, the old one is freed before the next one
+  // is allocated:
+  if (! shm.open(name, 2 * (snapshotBytes + 4096))) {
+    cout << "Cannot create " << name << endl;
+    return 1;
+  }
+  if (! publish(shm, 1)) {
+    cout << "Arena too small" << endl;
+    return 1;
+  }
+  uint64_t alarms = 0;
+  {
+    SharedMemoryProtector<> second;
+    if (second.open(name, snapshotBytes)) {
+      cout << "ALARM: a second writer could open " << name << endl;
+      alarms++;
+    }
+  }
+  if (shm.publish(nullptr)) {
+    cout << "ALARM: nullptr was published" << endl;
+    alarms++;
+  }
+
+  int fds[2];
+  if (pipe(fds) != 0) {
+    return 1;
+  }
+  vector<pid_t> children;
+  for (int i = 0; i < processes; i++) {
+    pid_t pid = fork();
+    if (pid == 0) {
+      ::close(fds[0]);
+      reader(name, fds[1], i + 1);
+    }
+    children.push_back(pid);
+  }
+  if (killOne) {
+    pid_t pid = fork();
+    if (pid == 0) {
+      victim(name);
+    }
+    waitpid(pid, nullptr, 0);
+    cout << "Killed process " << pid << " inside a read section" << endl;
+  }
+  ::close(fds[1]);
+
+  uint64_t publications = 0;
+  uint64_t publishNanos = 0;
+  Clock::time_point start = Clock::now();
+  Clock::time_point end = start + chrono::seconds(seconds);
+  while (Clock::now() < end) {
+    Clock::time_point t = Clock::now();
+    if (! publish(shm, publications + 2)) {
+      cout << "Publishing failed" << endl;
+      break;
+    }
+    publishNanos += chrono::duration_cast<chrono::nanoseconds>(
+                      Clock::now() - t).count();
+    publications++;
+    usleep(pauseMicros);
+  }
+
+  uint64_t reads = 0;
+  uint64_t counts[2];
+  while (read(fds[0], counts, sizeof(counts)) == sizeof(counts)) {
+    reads += counts[0];
+    alarms += counts[1];
+  }
+  for (pid_t pid : children) {
+    waitpid(pid, nullptr, 0);
+  }
+  double elapsed = chrono::duration_cast<chrono::nanoseconds>(
+                     Clock::now() - start).count() / 1e9;
+
+  cout << "Processes: " << processes << ", snapshot: " << snapshotBytes
+       << " bytes" << endl;
+  cout << "Reads: " << reads / 1e6 / elapsed << "M/s, per process: "
+       << reads / 1e6 / elapsed / processes << "M/s" << endl;
+  cout << "Publications: " << publications << ", mean "
+       << (publications > 0 ? publishNanos / publications / 1000.0 : 0.0)
+       << "us including the fill" << endl;
+  cout << "Slots of dead processes recovered: " << shm.recovered() << endl;
+  cout << "alarms seen: " << alarms << endl;
+  shm.close();
+  SharedMemoryProtector<>::remove(name);
+  return alarms == 0 ? 0 : 1;
+}
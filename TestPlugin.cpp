@@ -0,0 +1,15 @@
+#include "TestPlugin.h"
+
+#ifndef PLUGIN_VERSION
+#define PLUGIN_VERSION 1
+#endif
+
+static uint64_t handle (uint64_t request) {
+  return request + PLUGIN_VERSION;
+}
+
+static TestPluginApi const api = {PLUGIN_VERSION, &handle};
+
+extern "C" TestPluginApi const* testPluginApi () {
+  return &api;
+}
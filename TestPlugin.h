@@ -0,0 +1,14 @@
+#ifndef TEST_PLUGIN_H
+#define TEST_PLUGIN_H 1
+
+#include <stdint.h>
+
+// The interface of the test plugin for ModuleTest.cpp, which is built
+// twice from TestPlugin.cpp with different values of PLUGIN_VERSION.
+
+struct TestPluginApi {
+  uint64_t version;
+  uint64_t (*handle) (uint64_t request);   // returns request + version
+};
+
+#endif
@@ -0,0 +1,564 @@
+#include "DataGuardian.h"
+#include "DataProtector.h"
+#include "DynamicDataGuardian.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// Thread churn benchmark: a spawner thread continuously creates and
+// joins short-lived reader threads at a fixed rate, while a writer keeps
+// publishing new versions. We measure the cost of the first use() in a
+// fresh thread (which includes the slot registration in getMyId()), the
+// steady state cost of a read, and how the threads are distributed over
+// the slots of the DataProtector. At the end we check that no slot or
+// hazard pointer was leaked, by running a final grace period with a
+// watchdog. A percentage of the threads can be made to terminate inside
+// a read section on purpose, which ThreadExit.h has to repair. For the
+// DynamicDataGuardian we report how many hazard records were allocated,
+// which should stay at the number of live threads.
+
+#define maxN 64
+
+using namespace std;
+
+typedef chrono::steady_clock Clock;
+
+struct DataToBeProtected {
+  DataToBeProtected(int i) : nr(i), isValid(true) {
+  }
+  ~DataToBeProtected() {
+    isValid = false;
+  }
+  int nr;
+  bool isValid;
+};
+
+DataGuardian<DataToBeProtected, maxN> guardian;
+DynamicDataGuardian<DataToBeProtected> dynamicGuardian;
+
+atomic<DataToBeProtected*> pointerToData(nullptr);
+
+DataProtector<64> protector;
+
+// Settings, see usage() below:
+int seconds = 5;
+int spawnRate = 1000;    // threads per second
+int maxLive = 16;        // concurrently running reader threads
+int readsPerThread = 10000;
+int leakPercent = 0;     // threads which exit inside a read section
+
+atomic<bool> stopWriter;
+atomic<int> threadsStarted;
+atomic<uint64_t> nullptrsSeen;
+atomic<uint64_t> alarmsSeen;
+
+// Statistics, protected by mut:
+mutex mut;
+vector<uint64_t> firstUseNanos;
+uint64_t steadyNanos = 0;
+uint64_t steadyReads = 0;
+uint64_t threadsPerSlot[maxN];
+
+// Number of threads currently running per slot, and the maximum we
+// have ever seen at the same time on a single slot:
+atomic<int> livePerSlot[maxN];
+atomic<int> liveThreads;
+atomic<int> maxLivePerSlot;
+atomic<int> maxLiveThreads;
+
+// DataGuardian needs fixed ids, so we hand them out from a pool:
+mutex idMutex;
+vector<int> freeIds;
+
+int acquireGuardianId () {
+  lock_guard<mutex> locker(idMutex);
+  if (freeIds.empty()) {
+    return -1;
+  }
+  int id = freeIds.back();
+  freeIds.pop_back();
+  return id;
+}
+
+void releaseGuardianId (int id) {
+  lock_guard<mutex> locker(idMutex);
+  freeIds.push_back(id);
+}
+
+// Exit action for a thread that leaks its lease, runs after the lease
+// has been repaired:
+void releaseLeakedGuardianId (void*, int id) {
+  releaseGuardianId(id);
+}
+
+// Threads which found no free guardian id and did not read at all:
+atomic<uint64_t> threadsWithoutId;
+
+void raiseTo (atomic<int>& maximum, int value) {
+  int old = maximum;
+  while (value > old && ! maximum.compare_exchange_weak(old, value)) {
+  }
+}
+
+void check (DataToBeProtected const* p) {
+  if (p == nullptr) {
+    nullptrsSeen++;
+  }
+  else if (! p->isValid) {
+    alarmsSeen++;
+  }
+}
+
+void recordThread (uint64_t firstUse, uint64_t steady, uint64_t reads,
+                   int slot) {
+  lock_guard<mutex> locker(mut);
+  firstUseNanos.push_back(firstUse);
+  steadyNanos += steady;
+  steadyReads += reads;
+  if (slot >= 0) {
+    threadsPerSlot[slot]++;
+  }
+}
+
+uint64_t nanosSince (Clock::time_point start) {
+  return chrono::duration_cast<chrono::nanoseconds>(Clock::now() - start)
+         .count();
+}
+
+void reader_protector () {
+  int live = ++liveThreads;
+  raiseTo(maxLiveThreads, live);
+
+  // The very first use() in this thread registers a slot:
+  Clock::time_point start = Clock::now();
+  int slot;
+  {
+    auto unuser(protector.use());
+    slot = unuser.id();
+    check(pointerToData);
+  }
+  uint64_t firstUse = nanosSince(start);
+
+  raiseTo(maxLivePerSlot, ++livePerSlot[slot]);
+
+  start = Clock::now();
+  for (int i = 1; i < readsPerThread; i++) {
+    auto unuser(protector.use());
+    check(pointerToData);
+  }
+  uint64_t steady = nanosSince(start);
+
+  livePerSlot[slot]--;
+  liveThreads--;
+  recordThread(firstUse, steady, readsPerThread - 1, slot);
+
+  if (threadsStarted++ % 100 < leakPercent) {
+    // Terminate inside a read section, the UnUser is never destroyed:
+    new DataProtector<64>::UnUser(protector.use());
+  }
+}
+
+void reader_guardian () {
+  int live = ++liveThreads;
+  raiseTo(maxLiveThreads, live);
+
+  // Here, registration is getting an id from the pool:
+  Clock::time_point start = Clock::now();
+  int id = acquireGuardianId();
+  if (id < 0) {
+    threadsWithoutId++;
+    liveThreads--;
+    return;
+  }
+  check(guardian.lease(id));
+  guardian.unlease(id);
+  uint64_t firstUse = nanosSince(start);
+
+  start = Clock::now();
+  for (int i = 1; i < readsPerThread; i++) {
+    check(guardian.lease(id));
+    guardian.unlease(id);
+  }
+  uint64_t steady = nanosSince(start);
+
+  if (threadsStarted++ % 100 < leakPercent) {
+    // Terminate with a lease that is never given back. The id may only
+    // be used again after the lease has been repaired, so it goes back
+    // to the pool in an exit action, which runs after the repair:
+    check(guardian.lease(id));
+    ThreadExit::onExit(&releaseLeakedGuardianId, nullptr, id);
+  }
+  else {
+    releaseGuardianId(id);
+  }
+  liveThreads--;
+  recordThread(firstUse, steady, readsPerThread - 1, -1);
+}
+
+void reader_dynamic_guardian () {
+  int live = ++liveThreads;
+  raiseTo(maxLiveThreads, live);
+
+  // The very first lease() in this thread acquires a hazard record:
+  Clock::time_point start = Clock::now();
+  check(dynamicGuardian.lease());
+  dynamicGuardian.unlease();
+  uint64_t firstUse = nanosSince(start);
+
+  start = Clock::now();
+  for (int i = 1; i < readsPerThread; i++) {
+    check(dynamicGuardian.lease());
+    dynamicGuardian.unlease();
+  }
+  uint64_t steady = nanosSince(start);
+
+  liveThreads--;
+  recordThread(firstUse, steady, readsPerThread - 1, -1);
+
+  if (threadsStarted++ % 100 < leakPercent) {
+    // Terminate with a lease that is never given back:
+    check(dynamicGuardian.lease());
+  }
+}
+
+void writer_protector () {
+  int i = 0;
+  while (! stopWriter) {
+    DataToBeProtected* p = new DataToBeProtected(i++);
+    DataToBeProtected* q = pointerToData;
+    pointerToData = p;
+    protector.scan();
+    delete q;
+    usleep(10000);
+  }
+}
+
+void writer_guardian () {
+  int i = 0;
+  while (! stopWriter) {
+    guardian.exchange(new DataToBeProtected(i++));
+    usleep(10000);
+  }
+}
+
+void writer_dynamic_guardian () {
+  int i = 0;
+  while (! stopWriter) {
+    dynamicGuardian.exchange(new DataToBeProtected(i++));
+    usleep(10000);
+  }
+}
+
+// Runs a final grace period in a separate thread and waits at most
+// two seconds for it. If it does not finish, some slot count or hazard
+// pointer was leaked by an exiting thread.
+bool finalGracePeriodCompletes (int mode) {
+  atomic<bool> done(false);
+  thread t([&done, mode] () -> void {
+    if (mode == 0) {
+      DataToBeProtected* q = pointerToData;
+      pointerToData = nullptr;
+      protector.scan();
+      delete q;
+    }
+    else if (mode == 1) {
+      guardian.exchange(nullptr);
+    }
+    else {
+      dynamicGuardian.exchange(nullptr);
+    }
+    done = true;
+  });
+  for (int i = 0; i < 2000 && ! done; i++) {
+    usleep(1000);
+  }
+  if (! done) {
+    t.detach();
+    return false;
+  }
+  t.join();
+  return true;
+}
+
+// Runs a grace period of prot in a separate thread and waits at most
+// two seconds for it:
+bool scanCompletes (DataProtector<64>& prot) {
+  atomic<bool> done(false);
+  thread t([&done, &prot] () -> void {
+    prot.scan();
+    done = true;
+  });
+  for (int i = 0; i < 2000 && ! done; i++) {
+    usleep(1000);
+  }
+  if (! done) {
+    t.detach();
+    return false;
+  }
+  t.join();
+  return true;
+}
+
+int slotCount (DataProtector<64>& prot, int slot) {
+  vector<int> counts;
+  prot.slotCounts(counts);
+  return counts[slot];
+}
+
+// Enters a read section of late when a thread_local object or thread
+// specific data is destroyed, that is, while the thread terminates,
+// and never leaves it:
+DataProtector<64>* late = nullptr;
+
+struct LateReader {
+  bool armed = false;
+  ~LateReader () {
+    if (armed) {
+      new DataProtector<64>::UnUser(late->use());
+    }
+  }
+};
+
+void lateRead (void*) {
+  new DataProtector<64>::UnUser(late->use());
+}
+
+// Read sections which are not left by their own thread in the usual
+// way: one left by another thread must be released at once and not
+// again when the entering thread terminates, and sections entered
+// while the thread terminates, after its exit cleanup has run, must be
+// repaired as well.
+bool unusualSectionsWork () {
+  DataProtector<64> prot;
+  bool ok = true;
+
+  // Left by another thread while the entering thread lives on:
+  mutex m;
+  condition_variable cond;
+  DataProtector<64>::UnUser* moved = nullptr;
+  bool finish = false;
+  int slot = -1;
+  thread entering([&] () -> void {
+    DataProtector<64>::UnUser* u
+      = new DataProtector<64>::UnUser(prot.use());
+    unique_lock<mutex> locker(m);
+    slot = u->id();
+    moved = u;
+    cond.notify_all();
+    cond.wait(locker, [&finish] () -> bool { return finish; });
+  });
+  {
+    unique_lock<mutex> locker(m);
+    cond.wait(locker, [&moved] () -> bool { return moved != nullptr; });
+  }
+  delete moved;
+  ok &= scanCompletes(prot);
+  {
+    lock_guard<mutex> locker(m);
+    finish = true;
+    cond.notify_all();
+  }
+  entering.join();
+  ok &= slotCount(prot, slot) == 0;
+
+  // Entered by a thread_local destructor and by a thread specific data
+  // destructor, which runs after the one of ThreadExit.h:
+  late = &prot;
+  pthread_key_t key;
+  pthread_key_create(&key, &lateRead);
+  uint64_t repairedBefore = ThreadExit::repaired();
+  thread terminating([key] () -> void {
+    static thread_local LateReader reader;
+    reader.armed = true;
+    pthread_setspecific(key, &reader);
+    auto unuser(late->use());
+  });
+  terminating.join();
+  pthread_key_delete(key);
+  ok &= ThreadExit::repaired() - repairedBefore == 2;
+  ok &= scanCompletes(prot);
+  return ok;
+}
+
+struct Mode {
+  char const* name;
+  void (*writer)();
+  void (*reader)();
+};
+
+Mode modes[] = {
+  {"protector", writer_protector, reader_protector},
+  {"guardian", writer_guardian, reader_guardian},
+  {"dynamic-guardian", writer_dynamic_guardian, reader_dynamic_guardian}
+};
+
+void usage () {
+  cout << "Usage: ThreadChurnTest [SECONDS [THREADS/S [MAXLIVE [READS "
+       << "[LEAKPERCENT]]]]]\n"
+       << "  defaults: " << seconds << " " << spawnRate << " " << maxLive
+       << " " << readsPerThread << " " << leakPercent << endl;
+}
+
+int main (int argc, char* argv[]) {
+  if (argc > 1 && argv[1][0] == '-') {
+    usage();
+    return 0;
+  }
+  if (argc > 1) seconds = atoi(argv[1]);
+  if (argc > 2) spawnRate = atoi(argv[2]);
+  if (argc > 3) maxLive = atoi(argv[3]);
+  if (argc > 4) readsPerThread = atoi(argv[4]);
+  if (argc > 5) leakPercent = atoi(argv[5]);
+  if (seconds <= 0 || spawnRate <= 0 || maxLive <= 0 || maxLive > maxN ||
+      readsPerThread <= 0 || leakPercent < 0 || leakPercent > 100) {
+    usage();
+    return 1;
+  }
+#ifdef DATAPROTECTOR_NO_THREAD_EXIT_CLEANUP
+  if (leakPercent > 0) {
+    cout << "Leaking read sections needs the thread exit cleanup, which "
+         << "DATAPROTECTOR_NO_THREAD_EXIT_CLEANUP turns off" << endl;
+    return 1;
+  }
+#else
+  if (! unusualSectionsWork()) {
+    cout << "ALARM: read sections left by another thread or entered at "
+         << "thread exit are not released exactly once" << endl;
+    return 1;
+  }
+#endif
+
+  for (int mode = 0; mode < 3; mode++) {
+    nullptrsSeen = 0;
+    alarmsSeen = 0;
+    stopWriter = false;
+    firstUseNanos.clear();
+    steadyNanos = 0;
+    steadyReads = 0;
+    for (int i = 0; i < maxN; i++) {
+      threadsPerSlot[i] = 0;
+      livePerSlot[i] = 0;
+    }
+    liveThreads = 0;
+    threadsStarted = 0;
+    threadsWithoutId = 0;
+    ThreadExit::repaired() = 0;
+    maxLivePerSlot = 0;
+    maxLiveThreads = 0;
+    freeIds.clear();
+    for (int i = maxN - 1; i >= 0; i--) {
+      freeIds.push_back(i);
+    }
+
+    cout << "Mode: " << modes[mode].name << endl;
+    cout << "Spawning " << spawnRate << " threads/s for " << seconds
+         << "s, at most " << maxLive << " live, " << readsPerThread
+         << " reads each" << endl;
+
+    thread writerThread(modes[mode].writer);
+
+    // The spawner: keep at most maxLive threads, join the oldest one
+    // before starting a new one, and pace the creation to spawnRate.
+    deque<thread> readers;
+    uint64_t spawned = 0;
+    Clock::time_point start = Clock::now();
+    Clock::time_point end = start + chrono::seconds(seconds);
+    chrono::nanoseconds interval(1000000000LL / spawnRate);
+    Clock::time_point next = start;
+    while (Clock::now() < end) {
+      if (readers.size() >= static_cast<size_t>(maxLive)) {
+        readers.front().join();
+        readers.pop_front();
+      }
+      readers.emplace_back(modes[mode].reader);
+      spawned++;
+      next += interval;
+      Clock::time_point now = Clock::now();
+      if (next > now) {
+        this_thread::sleep_for(next - now);
+      }
+    }
+    double elapsed = nanosSince(start) / 1e9;
+    while (! readers.empty()) {
+      readers.front().join();
+      readers.pop_front();
+    }
+    stopWriter = true;
+    writerThread.join();
+
+    bool ok = finalGracePeriodCompletes(mode);
+
+    sort(firstUseNanos.begin(), firstUseNanos.end());
+    uint64_t sum = 0;
+    for (uint64_t n : firstUseNanos) {
+      sum += n;
+    }
+    size_t nr = firstUseNanos.size();
+    cout << "Threads: " << spawned << " (" << spawned / elapsed << "/s), "
+         << "max live: " << maxLiveThreads << endl;
+    if (threadsWithoutId > 0) {
+      cout << "Threads without a guardian id, which did not read: "
+           << threadsWithoutId << endl;
+    }
+    if (nr > 0) {
+      cout << "First use: mean " << sum / nr << "ns, median "
+           << firstUseNanos[nr / 2] << "ns, p99 "
+           << firstUseNanos[(nr * 99) / 100] << "ns" << endl;
+    }
+    if (steadyReads > 0) {
+      cout << "Steady: " << static_cast<double>(steadyNanos) / steadyReads
+           << "ns/read" << endl;
+    }
+
+    if (mode == 0) {
+      // Slot distribution: how many threads ever used each slot, and
+      // how many shared a slot at the same time compared to the ideal
+      // of spreading the live threads evenly.
+      uint64_t lo = threadsPerSlot[0];
+      uint64_t hi = threadsPerSlot[0];
+      double mean = 0;
+      for (int i = 0; i < maxN; i++) {
+        lo = min(lo, threadsPerSlot[i]);
+        hi = max(hi, threadsPerSlot[i]);
+        mean += threadsPerSlot[i];
+      }
+      mean /= maxN;
+      double var = 0;
+      for (int i = 0; i < maxN; i++) {
+        var += (threadsPerSlot[i] - mean) * (threadsPerSlot[i] - mean);
+      }
+      int ideal = (maxLiveThreads + maxN - 1) / maxN;
+      cout << "Threads per slot: min " << lo << ", max " << hi
+           << ", stddev " << sqrt(var / maxN) << endl;
+      cout << "Max threads sharing a slot at once: " << maxLivePerSlot
+           << " (ideal " << ideal << ")"
+           << (maxLivePerSlot > ideal ? " SKEWED" : "") << endl;
+    }
+    if (mode == 2) {
+      cout << "Hazard records allocated: "
+           << DynamicDataGuardian<DataToBeProtected>::records() << endl;
+    }
+    cout << "nullptr values seen: " << nullptrsSeen
+         << ", alarms seen: " << alarmsSeen << endl;
+    cout << "Read sections repaired at thread exit: "
+         << ThreadExit::repaired() << endl;
+    cout << "Final grace period: " << (ok ? "ok" : "BLOCKED, leak detected")
+         << endl << endl;
+    if (! ok) {
+      // A thread is still stuck in scan(), we cannot clean up properly:
+      cout.flush();
+      _exit(1);
+    }
+  }
+  return 0;
+}
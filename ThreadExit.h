@@ -0,0 +1,340 @@
+#ifndef THREAD_EXIT_H
+#define THREAD_EXIT_H 1
+
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <tuple>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Thread exit cleanup for the DataProtector and the DataGuardian. A
+// thread that terminates while it is still inside a read section (for
+// example, because it leaked its UnUser or left through longjmp) would
+// otherwise leave its counter raised or its hazard pointer set forever,
+// and every later grace period would hang.
+//
+// Every thread keeps a small stack of the read sections it currently
+// holds in a plain thread-local structure. When the thread terminates,
+// a POSIX thread-specific data destructor, which is registered lazily
+// with the first read section, repairs all sections still held and
+// reports them on stderr. It runs after the destructors of all
+// thread_local objects, so sections those enter are repaired as well,
+// and a section entered even later, from another thread-specific data
+// destructor, registers it again. Every read section is pushed onto
+// the stack when it is entered and searched for when it is left, from
+// the top, which costs no shared memory traffic, but makes a read some
+// 15-20% slower. Compiled with DATAPROTECTOR_NO_THREAD_EXIT_CLEANUP,
+// enter() and leave() are empty, and a thread that dies inside a read
+// section blocks every later grace period, as in the original
+// DataProtector.
+//
+// The exit actions registered with onExit() always run, the
+// DataProtector uses them to release the thread's slot and the
+// DynamicDataGuardian to release the thread's hazard records. The
+// first MaxHeld sections and MaxActions actions live in the
+// thread-local structure, beyond that the tables grow on the heap.
+// Threads which never enter a read section or register an action pay
+// nothing at exit. The main thread's actions do not run when the
+// process exits.
+//
+// enter() returns a token for the entering thread, which the caller
+// keeps with the section and hands to leave(). If another thread leaves
+// the section, for example by destroying an UnUser that was moved to
+// it, leave() lets it release the section at once and notes this under
+// a mutex, counted in foreignLeaves(). The entering thread drops the
+// section from its stack the next time it enters one, or at its exit,
+// so it is never released twice. If the entering thread has already
+// terminated and repaired the section, leave() returns false instead.
+// Therefore a few bytes are kept for every section repaired at thread
+// exit, in case it is still left later.
+//
+// The repair writes into the protector or guardian the section belongs
+// to. Therefore a protector or guardian must outlive every thread that
+// may terminate inside one of its read sections, which is no new
+// restriction, since destroying it with a reader inside is an error
+// anyway.
+
+class ThreadExit {
+
+  public:
+
+    typedef void (*RepairFunc)(void* owner, int key, int count);
+    typedef void (*ActionFunc)(void* owner, int arg);
+    typedef uint64_t Token;   // the number of the entering thread
+
+    static int const MaxHeld = 16;
+    static int const MaxActions = 16;
+
+  private:
+
+    struct Held {
+      void* owner;
+      RepairFunc repair;
+      int key;
+      int count;
+    };
+
+    struct Action {
+      ActionFunc func;
+      void* owner;
+      int arg;
+    };
+
+    // Zero initialized and without constructor or destructor, such that
+    // access to it is a plain thread-local access. The tables are the
+    // inline arrays as long as the heap pointers are nullptr:
+    struct State {
+      Held inlineHeld[MaxHeld];
+      Held* heapHeld;
+      int capHeld;       // capacity of heapHeld
+      int nrHeld;
+      Action inlineActions[MaxActions];
+      Action* heapActions;
+      int capActions;    // capacity of heapActions
+      int nrActions;
+      Token number;      // of this thread, 0 until the first section
+      uint64_t settled;  // value of foreignLeaves() last settled
+      bool hooked;       // the exit destructor is registered
+    };
+
+    static State& state () {
+      static thread_local State s;
+      return s;
+    }
+
+    // Sections left by another thread (positive) or repaired at the
+    // exit of the entering thread (negative), by entering thread, owner
+    // and key:
+    typedef std::tuple<Token, void*, int> Section;
+
+    static std::mutex& ledgerMutex () {
+      static std::mutex m;
+      return m;
+    }
+
+    static std::map<Section, int>& ledger () {
+      static std::map<Section, int>* l = new std::map<Section, int>();
+      return *l;   // never destroyed, threads may exit after main()
+    }
+
+    static Held* held (State& s) {
+      return s.heapHeld != nullptr ? s.heapHeld : s.inlineHeld;
+    }
+
+    static Action* actions (State& s) {
+      return s.heapActions != nullptr ? s.heapActions : s.inlineActions;
+    }
+
+    // Doubles the capacity of a table, which is the inline array if heap
+    // is nullptr, and fails visibly if there is no memory:
+    template<typename E>
+    static void grow (E*& heap, int& cap, E* inlineArray, int inlineCap,
+                      int used) {
+      int newCap = (heap != nullptr ? cap : inlineCap) * 2;
+      E* n = static_cast<E*>(malloc(sizeof(E) * newCap));
+      if (n == nullptr) {
+        fprintf(stderr, "ThreadExit: out of memory for %d entries\n",
+                newCap);
+        abort();
+      }
+      memcpy(n, heap != nullptr ? heap : inlineArray, sizeof(E) * used);
+      free(heap);
+      heap = n;
+      cap = newCap;
+    }
+
+    static pthread_key_t exitKey () {
+      static pthread_key_t key = [] () -> pthread_key_t {
+        pthread_key_t k;
+        if (pthread_key_create(&k, &runExit) != 0) {
+          fprintf(stderr, "ThreadExit: cannot create a key\n");
+          abort();
+        }
+        return k;
+      }();
+      return key;
+    }
+
+    static void hook (State& s) {
+      if (! s.hooked) {
+        s.hooked = true;
+        pthread_setspecific(exitKey(), &s);
+      }
+    }
+
+  public:
+
+    // The number of read sections repaired at thread exit so far:
+    static std::atomic<uint64_t>& repaired () {
+      static std::atomic<uint64_t> count(0);
+      return count;
+    }
+
+    // The number of read sections left by a thread which did not enter
+    // them, see above:
+    static std::atomic<uint64_t>& foreignLeaves () {
+      static std::atomic<uint64_t> count(0);
+      return count;
+    }
+
+#ifndef DATAPROTECTOR_NO_THREAD_EXIT_CLEANUP
+
+    static Token enter (void* owner, RepairFunc repair, int key) {
+      State& s = state();
+      Held* h = held(s);
+      if (s.nrHeld > 0) {
+        Held& top = h[s.nrHeld - 1];
+        if (top.owner == owner && top.key == key) {
+          top.count++;
+          return s.number;
+        }
+      }
+      else {
+        hook(s);
+      }
+      if (s.number == 0) {
+        s.number = nextNumber()++;
+      }
+      if (foreignLeaves().load(std::memory_order_relaxed) != s.settled) {
+        settle(s);
+        h = held(s);
+      }
+      if (s.nrHeld == (s.heapHeld != nullptr ? s.capHeld : MaxHeld)) {
+        grow(s.heapHeld, s.capHeld, s.inlineHeld, MaxHeld, s.nrHeld);
+        h = s.heapHeld;
+      }
+      h[s.nrHeld++] = Held{owner, repair, key, 1};
+      return s.number;
+    }
+
+    // Returns false if the section must not be released by the caller,
+    // because it has already been repaired at the exit of the thread
+    // that entered it:
+    static bool leave (void* owner, int key, Token token) {
+      State& s = state();
+      if (token == s.number) {
+        Held* h = held(s);
+        for (int i = s.nrHeld - 1; i >= 0; i--) {
+          if (h[i].owner == owner && h[i].key == key) {
+            if (--h[i].count == 0) {
+              for (int j = i + 1; j < s.nrHeld; j++) {
+                h[j - 1] = h[j];
+              }
+              s.nrHeld--;
+            }
+            return true;
+          }
+        }
+      }
+      std::lock_guard<std::mutex> locker(ledgerMutex());
+      auto it = ledger().find(Section(token, owner, key));
+      if (it != ledger().end() && it->second < 0) {
+        if (++it->second == 0) {
+          ledger().erase(it);
+        }
+        return false;
+      }
+      if (token == s.number) {
+        fprintf(stderr, "ThreadExit: read section of %p (slot %d) left "
+                "twice\n", owner, key);
+        return false;
+      }
+      ledger()[Section(token, owner, key)]++;
+      foreignLeaves()++;
+      return true;
+    }
+
+#else
+
+    static Token enter (void*, RepairFunc, int) {
+      return 0;
+    }
+
+    static bool leave (void*, int, Token) {
+      return true;
+    }
+
+#endif
+
+    // Registers an action to run when this thread terminates, even if it
+    // never holds a read section:
+    static void onExit (ActionFunc func, void* owner, int arg) {
+      State& s = state();
+      hook(s);
+      if (s.nrActions ==
+          (s.heapActions != nullptr ? s.capActions : MaxActions)) {
+        grow(s.heapActions, s.capActions, s.inlineActions, MaxActions,
+             s.nrActions);
+      }
+      actions(s)[s.nrActions++] = Action{func, owner, arg};
+    }
+
+  private:
+
+    static std::atomic<Token>& nextNumber () {
+      static std::atomic<Token> n(1);
+      return n;
+    }
+
+    // Drops the sections of this thread which other threads have left,
+    // called with the ledger mutex held:
+    static void settleLocked (State& s) {
+      s.settled = foreignLeaves().load();
+      Held* h = held(s);
+      int j = 0;
+      for (int i = 0; i < s.nrHeld; i++) {
+        auto it = ledger().find(Section(s.number, h[i].owner, h[i].key));
+        if (it != ledger().end() && it->second > 0) {
+          int n = it->second < h[i].count ? it->second : h[i].count;
+          h[i].count -= n;
+          if ((it->second -= n) == 0) {
+            ledger().erase(it);
+          }
+        }
+        if (h[i].count > 0) {
+          h[j++] = h[i];
+        }
+      }
+      s.nrHeld = j;
+    }
+
+    static void settle (State& s) {
+      std::lock_guard<std::mutex> locker(ledgerMutex());
+      settleLocked(s);
+    }
+
+    static void runExit (void*) {
+      State& s = state();
+      s.hooked = false;
+      if (s.nrHeld > 0) {
+        std::lock_guard<std::mutex> locker(ledgerMutex());
+        settleLocked(s);
+        for (int i = s.nrHeld - 1; i >= 0; i--) {
+          Held& h = held(s)[i];
+          fprintf(stderr, "ThreadExit: thread terminated inside %d read "
+                  "section(s) of %p (slot %d), repairing\n", h.count,
+                  h.owner, h.key);
+          h.repair(h.owner, h.key, h.count);
+          repaired() += h.count;
+          ledger()[Section(s.number, h.owner, h.key)] -= h.count;
+        }
+      }
+      s.nrHeld = 0;
+      free(s.heapHeld);
+      s.heapHeld = nullptr;
+      // An action may register further actions, which run as well:
+      for (int i = 0; i < s.nrActions; i++) {
+        Action a = actions(s)[i];
+        a.func(a.owner, a.arg);
+      }
+      s.nrActions = 0;
+      free(s.heapActions);
+      s.heapActions = nullptr;
+    }
+};
+
+#endif
@@ -0,0 +1,207 @@
+#ifndef TYPE_STABLE_POOL_H
+#define TYPE_STABLE_POOL_H 1
+
+#include <atomic>
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+#include <type_traits>
+#include <vector>
+
+#include "DataProtector.h"
+#include "SpinLock.h"
+
+// A type-stable pool of small objects with optimistic reads. Objects
+// live in chunks which are never freed, so an index into the pool
+// always refers to memory that holds an object of type T, even after
+// the object has been retired and reused. Every object carries a stamp
+// which works like the sequence number of a SeqLock (see SeqLock.h)
+// and the key it currently holds. A reader copies the object, checks
+// that the stamp has not changed and that the key is still the one it
+// looked for, and retries otherwise. Such a read does not write to
+// shared memory at all, in particular it touches no protector slot:
+//
+//   T value;
+//   while (! pool.read(directory[key], key, value)) {
+//   }
+//
+// The protector is only used on the writer side, to decide when a
+// retired object may be reused for a different key: retired objects
+// are collected and freed in batches after one grace period. Readers
+// that keep an index across several reads or follow indices stored in
+// the objects therefore enter a read section of protector(). Within it,
+// an index they have found stays bound to its key, so they only retry
+// for concurrent updates of the same object, never because it was
+// reused. The plain optimistic reader is correct without, since it
+// checks the key.
+//
+// The payload is stored in relaxed atomic words like in the SeqLock.
+// There must only be one writer at a time, use a mutex if necessary.
+
+template<typename T, typename Protector = DataProtector<64>>
+class TypeStablePool {
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "TypeStablePool can only hold trivially copyable values");
+
+    static size_t const Words = (sizeof(T) + sizeof(uint64_t) - 1)
+                                / sizeof(uint64_t);
+    static uint32_t const ChunkSize = 4096;
+    static uint32_t const MaxChunks = 4096;
+
+    struct Object {
+      std::atomic<uint64_t> stamp;   // odd while the writer changes it
+      std::atomic<uint64_t> key;
+      std::atomic<uint64_t> data[Words];
+    };
+
+    Protector _prot;
+    std::atomic<Object*> _chunks[MaxChunks];
+    uint32_t _nrObjects;
+    std::vector<uint32_t> _free;
+    std::vector<uint32_t> _retired;
+    size_t _retireBatch;
+    uint64_t _gracePeriods;
+
+  public:
+
+    typedef uint32_t Index;
+
+    // Returned by allocate() when the pool is full:
+    static Index const InvalidIndex = MaxChunks * ChunkSize;
+
+    // Retired objects are reused after a grace period that is run when
+    // retireBatch of them have come together:
+    explicit TypeStablePool (size_t retireBatch = 64)
+      : _nrObjects(0), _retireBatch(retireBatch), _gracePeriods(0) {
+      for (uint32_t i = 0; i < MaxChunks; i++) {
+        _chunks[i] = nullptr;
+      }
+    }
+
+    // No reader may be active any more:
+    ~TypeStablePool () {
+      for (uint32_t i = 0; i < MaxChunks; i++) {
+        delete[] _chunks[i].load();
+      }
+    }
+
+    TypeStablePool (TypeStablePool const&) = delete;
+    TypeStablePool& operator= (TypeStablePool const&) = delete;
+
+    Protector& protector () {
+      return _prot;
+    }
+
+    // Copies the object at index i into out if it holds key, returns
+    // false if it holds another key:
+    bool read (Index i, uint64_t key, T& out) const {
+      Object const& o = object(i);
+      uint64_t buffer[Words];
+      uint64_t k;
+      while (true) {
+        uint64_t s = o.stamp.load(std::memory_order_acquire);
+        if ((s & 1) == 0) {
+          k = o.key.load(std::memory_order_relaxed);
+          for (size_t w = 0; w < Words; w++) {
+            buffer[w] = o.data[w].load(std::memory_order_relaxed);
+          }
+          // Orders the loads of the data before the second load of the
+          // stamp:
+          std::atomic_thread_fence(std::memory_order_acquire);
+          if (o.stamp.load(std::memory_order_relaxed) == s) {
+            break;
+          }
+        }
+        cpuRelax();
+      }
+      if (k != key) {
+        return false;
+      }
+      memcpy(&out, buffer, sizeof(T));
+      return true;
+    }
+
+    // Writer only: an object holding key and value, reused or new.
+    // Returns InvalidIndex if the pool is full, the caller must check:
+    Index allocate (uint64_t key, T const& value) {
+      if (_free.empty() && _retired.size() >= _retireBatch) {
+        reclaim();
+      }
+      Index i;
+      if (! _free.empty()) {
+        i = _free.back();
+        _free.pop_back();
+      }
+      else {
+        if (_nrObjects == InvalidIndex) {
+          return InvalidIndex;
+        }
+        i = _nrObjects++;
+        if (i % ChunkSize == 0) {
+          Object* chunk = new Object[ChunkSize];
+          for (uint32_t j = 0; j < ChunkSize; j++) {
+            chunk[j].stamp.store(0, std::memory_order_relaxed);
+          }
+          _chunks[i / ChunkSize].store(chunk, std::memory_order_release);
+        }
+      }
+      update(i, key, value);
+      return i;
+    }
+
+    // Writer only: changes the object in place, readers see either the
+    // old or the new value:
+    void update (Index i, uint64_t key, T const& value) {
+      Object& o = object(i);
+      uint64_t buffer[Words] = {};
+      memcpy(buffer, &value, sizeof(T));
+      uint64_t s = o.stamp.load(std::memory_order_relaxed);
+      o.stamp.store(s + 1, std::memory_order_relaxed);
+      // Orders the odd stamp before the stores of the data:
+      std::atomic_thread_fence(std::memory_order_release);
+      o.key.store(key, std::memory_order_relaxed);
+      for (size_t w = 0; w < Words; w++) {
+        o.data[w].store(buffer[w], std::memory_order_relaxed);
+      }
+      o.stamp.store(s + 2, std::memory_order_release);
+    }
+
+    // Writer only: the object is no longer reachable for new readers,
+    // it will be reused after the next grace period:
+    void retire (Index i) {
+      _retired.push_back(i);
+    }
+
+    // Writer only: runs a grace period and makes all objects retired
+    // before it free for reuse:
+    void reclaim () {
+      if (_retired.empty()) {
+        return;
+      }
+      _prot.scan();
+      _gracePeriods++;
+      _free.insert(_free.end(), _retired.begin(), _retired.end());
+      _retired.clear();
+    }
+
+    // Statistics, writer only:
+    uint32_t objects () const {
+      return _nrObjects;
+    }
+
+    uint64_t gracePeriods () const {
+      return _gracePeriods;
+    }
+
+  private:
+
+    // i must have been returned by allocate():
+    Object& object (Index i) const {
+      assert(i < InvalidIndex);
+      Object* chunk = _chunks[i / ChunkSize].load(std::memory_order_acquire);
+      assert(chunk != nullptr);
+      return chunk[i % ChunkSize];
+    }
+};
+
+#endif
@@ -0,0 +1,173 @@
+#ifndef WAIT_STRATEGY_H
+#define WAIT_STRATEGY_H 1
+
+#include <atomic>
+#include <sched.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#endif
+
+#include "EventTrace.h"
+#include "SpinLock.h"
+
+// Wait strategies for the writer side of DataProtector::scan() and of
+// DataGuardian::exchange(). A strategy is a template parameter, which
+// is selected at compile time, and must provide two methods:
+//
+//   template<typename Done> void waitUntil (Done const& done, uint64_t arg)
+//
+// returns as soon as done() returns true (arg is only for tracing),
+// and
+//
+//   void notify ()
+//
+// which is called by every reader right after it has left its read
+// section. A strategy that does not block keeps notify() empty, such
+// that it vanishes completely from the reader's fast path.
+
+// Spins for the first rounds, then yields, returns false when the
+// caller should fall back to its slow way of waiting:
+inline bool waitBriefly (int round, int spins, int yields) {
+  if (round < spins) {
+    cpuRelax();
+    return true;
+  }
+  if (round < spins + yields) {
+    sched_yield();
+    return true;
+  }
+  return false;
+}
+
+// The original behaviour: check every 250 microseconds. Cheap in CPU,
+// but every grace period that has to wait at all takes at least this
+// long.
+class SleepWait {
+
+  public:
+
+    template<typename Done>
+    void waitUntil (Done const& done, uint64_t arg) {
+      while (! done()) {
+        DP_TRACE(SleepStart, arg);
+        usleep(250);
+        DP_TRACE(SleepEnd, arg);
+      }
+    }
+
+    void notify () {
+    }
+};
+
+// For latency-critical writers: spin with pause for Spins rounds, then
+// yield the CPU for Yields rounds, and only then sleep like SleepWait.
+template<int Spins = 1000, int Yields = 100>
+class SpinYieldSleepWait {
+
+  public:
+
+    template<typename Done>
+    void waitUntil (Done const& done, uint64_t arg) {
+      for (int round = 0; ! done(); round++) {
+        if (! waitBriefly(round, Spins, Yields)) {
+          DP_TRACE(SleepStart, arg);
+          usleep(250);
+          DP_TRACE(SleepEnd, arg);
+        }
+      }
+    }
+
+    void notify () {
+    }
+};
+
+// Blocks in the kernel until a reader leaves its read section, after
+// optionally spinning and yielding first. FutexWait<> blocks right away
+// and is meant for background writers that should not burn any CPU.
+//
+// The readers pay for this with one load of _waiters in notify(), which
+// is a cache line that is only written when a writer starts or stops
+// waiting. The argument why no wakeup is lost: the writer increments
+// _waiters, reads _event and then checks done() again before it
+// blocks, the reader changes its counter or hazard pointer and then
+// reads _waiters. The writer's operations are seq_cst, the reader's
+// change is not always, with ReleaseFenceOrder or AsymmetricOrder it
+// is only a release decrement, which could be reordered with the later
+// load of _waiters. Therefore notify() puts a seq_cst fence before that
+// load. If the reader's change comes after the writer's check in the
+// total order, then the reader also sees the incremented _waiters,
+// increments _event and wakes the writer. The futex system call only
+// blocks if _event still has the value read before the check, so the
+// wakeup cannot get lost between the check and the blocking either.
+// Otherwise, the writer's check sees the change. We block with a
+// timeout anyway, to be robust.
+template<int Spins = 0, int Yields = 0>
+class alignas(64) FutexWait {
+
+    std::atomic<int> _waiters;
+    char _padding[64 - sizeof(std::atomic<int>)];
+    std::atomic<int> _event;
+
+    static_assert(sizeof(std::atomic<int>) == sizeof(int),
+                  "futex needs a plain 32-bit word");
+
+  public:
+
+    FutexWait () : _waiters(0), _event(0) {
+    }
+
+    template<typename Done>
+    void waitUntil (Done const& done, uint64_t arg) {
+      for (int round = 0; ! done(); round++) {
+        if (waitBriefly(round, Spins, Yields)) {
+          continue;
+        }
+        _waiters++;
+        int seen = _event.load();
+        if (! done()) {
+          DP_TRACE(SleepStart, arg);
+          block(seen);
+          DP_TRACE(SleepEnd, arg);
+        }
+        _waiters--;
+      }
+    }
+
+    // The fence orders the reader's change before the load, see above:
+    void notify () {
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (_waiters.load() != 0) {
+        _event++;
+        wake();
+      }
+    }
+
+  private:
+
+#ifdef __linux__
+    void block (int seen) {
+      struct timespec timeout = {0, 10000000};   // 10ms
+      syscall(SYS_futex, reinterpret_cast<int*>(&_event), FUTEX_WAIT_PRIVATE,
+              seen, &timeout, nullptr, 0);
+    }
+
+    void wake () {
+      syscall(SYS_futex, reinterpret_cast<int*>(&_event), FUTEX_WAKE_PRIVATE,
+              INT32_MAX, nullptr, nullptr, 0);
+    }
+#else
+    void block (int) {
+      usleep(250);
+    }
+
+    void wake () {
+    }
+#endif
+};
+
+#endif
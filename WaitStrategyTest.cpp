@@ -0,0 +1,231 @@
+#include "DataGuardian.h"
+#include "DataProtector.h"
+#include "WaitStrategy.h"
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+// Compares the wait strategies from WaitStrategy.h. Reader threads hold
+// read sections of random length (exponentially distributed with a
+// configurable mean), a writer publishes new versions back to back and
+// measures for each grace period the elapsed time and the CPU time it
+// burned while waiting. We also report the reader throughput, since
+// the blocking strategies add a check to the reader's fast path.
+
+#define maxN 64
+
+using namespace std;
+
+typedef chrono::steady_clock Clock;
+
+struct DataToBeProtected {
+  DataToBeProtected(int i) : nr(i), isValid(true) {
+  }
+  ~DataToBeProtected() {
+    isValid = false;
+  }
+  int nr;
+  bool isValid;
+};
+
+// Settings, see usage() below:
+int seconds = 3;
+int holdMicros = 20;      // mean length of a read section
+int pauseMicros = 1000;   // writer pause between two publications
+
+atomic<bool> stop;
+atomic<uint64_t> alarmsSeen;
+mutex mut;
+uint64_t totalReads = 0;
+
+uint64_t threadCpuNanos () {
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Busy waits for the given time, to simulate work in a read section:
+void work (chrono::nanoseconds d) {
+  Clock::time_point end = Clock::now() + d;
+  while (Clock::now() < end) {
+  }
+}
+
+struct Result {
+  vector<uint64_t> latencies;   // ns per grace period
+  uint64_t cpu = 0;             // ns of writer CPU for all grace periods
+};
+
+void report (char const* scheme, char const* policy, Result& r, int N) {
+  sort(r.latencies.begin(), r.latencies.end());
+  size_t n = r.latencies.size();
+  uint64_t sum = 0;
+  for (uint64_t l : r.latencies) {
+    sum += l;
+  }
+  cout << scheme << "\t" << policy << "\t" << N << "\t" << n;
+  if (n > 0) {
+    cout << "\t" << sum / n / 1000.0 << "\t"
+         << r.latencies[n / 2] / 1000.0 << "\t"
+         << r.latencies[(n * 99) / 100] / 1000.0 << "\t"
+         << r.cpu / n / 1000.0;
+  }
+  cout << "\t" << totalReads / 1e6 / seconds << endl;
+}
+
+template<typename ReadOnce>
+void readerLoop (int seed, ReadOnce const& readOnce) {
+  mt19937 rng(seed);
+  exponential_distribution<double> hold(1.0 / max(holdMicros, 1));
+  uint64_t count = 0;
+  while (! stop) {
+    chrono::nanoseconds d(holdMicros > 0
+                          ? static_cast<int64_t>(hold(rng) * 1000) : 0);
+    readOnce(d);
+    count++;
+  }
+  lock_guard<mutex> locker(mut);
+  totalReads += count;
+}
+
+template<typename Wait>
+void runProtector (char const* policy, int N) {
+  DataProtector<64, Wait> protector;
+  atomic<DataToBeProtected*> pointerToData(new DataToBeProtected(0));
+  stop = false;
+  totalReads = 0;
+
+  vector<thread> readers;
+  for (int i = 0; i < N; i++) {
+    readers.emplace_back([&protector, &pointerToData, i] () -> void {
+      readerLoop(i + 1, [&] (chrono::nanoseconds d) -> void {
+        auto unuser(protector.use());
+        DataToBeProtected const* p = pointerToData;
+        if (! p->isValid) {
+          alarmsSeen++;
+        }
+        work(d);
+      });
+    });
+  }
+
+  Result r;
+  Clock::time_point end = Clock::now() + chrono::seconds(seconds);
+  for (int i = 1; Clock::now() < end; i++) {
+    DataToBeProtected* q = pointerToData;
+    pointerToData = new DataToBeProtected(i);
+    Clock::time_point t = Clock::now();
+    uint64_t c = threadCpuNanos();
+    protector.scan();
+    r.cpu += threadCpuNanos() - c;
+    r.latencies.push_back(chrono::duration_cast<chrono::nanoseconds>(
+                            Clock::now() - t).count());
+    delete q;
+    usleep(pauseMicros);
+  }
+  stop = true;
+  for (thread& t : readers) {
+    t.join();
+  }
+  delete pointerToData.load();
+  report("protector", policy, r, N);
+}
+
+template<typename Wait>
+void runGuardian (char const* policy, int N) {
+  DataGuardian<DataToBeProtected, maxN, Wait> guardian;
+  guardian.exchange(new DataToBeProtected(0));
+  stop = false;
+  totalReads = 0;
+
+  vector<thread> readers;
+  for (int i = 0; i < N; i++) {
+    readers.emplace_back([&guardian, i] () -> void {
+      readerLoop(i + 1, [&guardian, i] (chrono::nanoseconds d) -> void {
+        DataToBeProtected const* p = guardian.lease(i);
+        if (! p->isValid) {
+          alarmsSeen++;
+        }
+        work(d);
+        guardian.unlease(i);
+      });
+    });
+  }
+
+  Result r;
+  Clock::time_point end = Clock::now() + chrono::seconds(seconds);
+  for (int i = 1; Clock::now() < end; i++) {
+    DataToBeProtected* p = new DataToBeProtected(i);
+    Clock::time_point t = Clock::now();
+    uint64_t c = threadCpuNanos();
+    guardian.exchange(p);
+    r.cpu += threadCpuNanos() - c;
+    r.latencies.push_back(chrono::duration_cast<chrono::nanoseconds>(
+                            Clock::now() - t).count());
+    usleep(pauseMicros);
+  }
+  stop = true;
+  for (thread& t : readers) {
+    t.join();
+  }
+  guardian.exchange(nullptr);
+  report("guardian", policy, r, N);
+}
+
+void usage () {
+  cout << "Usage: WaitStrategyTest [-t SECONDS] [-h HOLDMICROS] "
+       << "[-p PAUSEMICROS] THREADS...\n"
+       << "  defaults: -t " << seconds << " -h " << holdMicros << " -p "
+       << pauseMicros << endl;
+}
+
+int main (int argc, char* argv[]) {
+  vector<int> threadCounts;
+  for (int i = 1; i < argc; i++) {
+    if (argv[i][0] == '-' && i + 1 < argc) {
+      switch (argv[i][1]) {
+        case 't': seconds = atoi(argv[++i]); continue;
+        case 'h': holdMicros = atoi(argv[++i]); continue;
+        case 'p': pauseMicros = atoi(argv[++i]); continue;
+      }
+      usage();
+      return 1;
+    }
+    int n = atoi(argv[i]);
+    if (n <= 0 || n > maxN) {
+      usage();
+      return 1;
+    }
+    threadCounts.push_back(n);
+  }
+  if (threadCounts.empty() || seconds <= 0) {
+    usage();
+    return 1;
+  }
+
+  alarmsSeen = 0;
+  cout << "Grace period latency and writer CPU per grace period in "
+       << "microseconds, reader throughput in M/s:" << endl;
+  cout << "scheme\tpolicy\tthreads\tgraces\tmean\tmedian\tp99\tcpu\treads"
+       << endl;
+  for (int N : threadCounts) {
+    runProtector<SleepWait>("sleep", N);
+    runProtector<SpinYieldSleepWait<>>("spin+yield+sleep", N);
+    runProtector<FutexWait<>>("futex", N);
+    runProtector<FutexWait<1000, 100>>("spin+yield+futex", N);
+    runGuardian<SleepWait>("sleep", N);
+    runGuardian<SpinYieldSleepWait<>>("spin+yield+sleep", N);
+    runGuardian<FutexWait<>>("futex", N);
+    runGuardian<FutexWait<1000, 100>>("spin+yield+futex", N);
+  }
+  cout << "alarms seen: " << alarmsSeen << endl;
+  return 0;
+}
@@ -0,0 +1,276 @@
+#ifndef WORKLOAD_TRACE_H
+#define WORKLOAD_TRACE_H 1
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Record and replay of read/publish workloads. An application records
+// the timing of its read sections and publications with a
+// WorkloadRecorder into a compact binary trace, the ReplayTest program
+// reproduces the timing and concurrency of such a trace against any of
+// the protection schemes. Like this, changes can be evaluated against
+// real traffic shapes offline.
+//
+// The trace format is a header followed by fixed size events, all in
+// host byte order:
+//
+//     char     magic[8]     "DPTRACE1"
+//     uint32_t nrThreads    thread ids in the events are < nrThreads
+//     uint32_t reserved
+//     uint64_t nrEvents
+//
+//     uint64_t nanos        since the start of the recording
+//     uint32_t thread
+//     uint32_t type         Enter, Exit or Publish
+
+struct WorkloadEvent {
+  enum Type : uint32_t {
+    Enter = 1,
+    Exit = 2,
+    Publish = 3
+  };
+
+  uint64_t nanos;
+  uint32_t thread;
+  uint32_t type;
+};
+
+struct WorkloadTraceHeader {
+  char magic[8];
+  uint32_t nrThreads;
+  uint32_t reserved;
+  uint64_t nrEvents;
+};
+
+struct WorkloadTrace {
+  static constexpr char const* Magic = "DPTRACE1";
+
+  uint32_t nrThreads;
+  std::vector<WorkloadEvent> events;   // sorted by time
+
+  WorkloadTrace () : nrThreads(0) {
+  }
+
+  bool write (std::string const& path) const {
+    FILE* f = fopen(path.c_str(), "wb");
+    if (f == nullptr) {
+      return false;
+    }
+    WorkloadTraceHeader h;
+    memcpy(h.magic, Magic, sizeof(h.magic));
+    h.nrThreads = nrThreads;
+    h.reserved = 0;
+    h.nrEvents = events.size();
+    bool ok = fwrite(&h, sizeof(h), 1, f) == 1 &&
+              fwrite(events.data(), sizeof(WorkloadEvent), events.size(), f)
+              == events.size();
+    return fclose(f) == 0 && ok;
+  }
+
+  // Returns false if the file is not a complete trace, or if an event
+  // has an unknown type or a thread id of nrThreads or more:
+  bool read (std::string const& path) {
+    FILE* f = fopen(path.c_str(), "rb");
+    if (f == nullptr) {
+      return false;
+    }
+    WorkloadTraceHeader h;
+    bool ok = fseek(f, 0, SEEK_END) == 0;
+    long size = ok ? ftell(f) : -1;
+    ok = ok && size >= static_cast<long>(sizeof(h)) &&
+         fseek(f, 0, SEEK_SET) == 0 &&
+         fread(&h, sizeof(h), 1, f) == 1 &&
+         memcmp(h.magic, Magic, sizeof(h.magic)) == 0 &&
+         h.nrEvents == (size - sizeof(h)) / sizeof(WorkloadEvent) &&
+         (size - sizeof(h)) % sizeof(WorkloadEvent) == 0;
+    if (ok) {
+      nrThreads = h.nrThreads;
+      events.resize(h.nrEvents);
+      ok = fread(events.data(), sizeof(WorkloadEvent), events.size(), f)
+           == events.size();
+    }
+    for (size_t i = 0; ok && i < events.size(); i++) {
+      WorkloadEvent const& e = events[i];
+      ok = e.thread < nrThreads && e.type >= WorkloadEvent::Enter &&
+           e.type <= WorkloadEvent::Publish;
+    }
+    fclose(f);
+    if (! ok) {
+      nrThreads = 0;
+      events.clear();
+    }
+    return ok;
+  }
+};
+
+// The recorder keeps one event log per thread, so recording only
+// appends to a thread-private vector and reads the clock. The logs are
+// merged when the trace is taken. Recording can be switched on and off
+// at runtime, when it is off, the hooks cost a single relaxed load.
+// The recorder must outlive all threads that record into it.
+//
+// start() does not touch the logs, which threads may still be appending
+// to. It begins a new generation instead, and every thread clears its
+// own log when it records the first event of a new generation. Logs of
+// an older generation are left out of the trace.
+//
+// A thread finds its log through a small per-thread cache of the last
+// few recorders it used, and else through a map of the recorder from
+// thread ids to logs, so a thread that alternates between recorders
+// keeps one log and one thread id in each. A thread that reuses the id
+// of a terminated one continues its log.
+
+class WorkloadRecorder {
+
+    struct ThreadLog {
+      uint32_t thread;
+      uint64_t generation;   // of the events
+      std::vector<WorkloadEvent> events;
+    };
+
+    std::atomic<bool> _recording;
+    std::atomic<uint64_t> _generation;
+    std::atomic<int64_t> _start;   // nanos of the steady clock
+    std::mutex _mutex;   // protects _logs and _byThread
+    std::vector<std::unique_ptr<ThreadLog>> _logs;
+    std::unordered_map<std::thread::id, ThreadLog*> _byThread;
+    uint64_t const _serial;   // tells a recorder from an earlier one
+                              // at the same address
+
+    struct CacheEntry {
+      WorkloadRecorder* recorder;
+      uint64_t serial;
+      ThreadLog* log;
+    };
+
+    static constexpr unsigned CacheSize = 4;
+    static thread_local CacheEntry _cache[CacheSize];
+    static thread_local unsigned _cacheNext;
+
+  public:
+
+    // A scope guard recording the enter and exit of a read section:
+    class Section {
+        WorkloadRecorder* _rec;
+
+      public:
+        explicit Section (WorkloadRecorder& rec) : _rec(&rec) {
+          _rec->record(WorkloadEvent::Enter);
+        }
+
+        ~Section () {
+          _rec->record(WorkloadEvent::Exit);
+        }
+
+        Section (Section const&) = delete;
+        Section& operator= (Section const&) = delete;
+    };
+
+    WorkloadRecorder ()
+      : _recording(false), _generation(0), _start(0), _serial(++serials()) {
+    }
+
+    // The start time is published before the generation, so a thread
+    // that sees the new generation uses the new start time:
+    void start () {
+      _start.store(now(), std::memory_order_relaxed);
+      _generation.fetch_add(1, std::memory_order_release);
+      _recording = true;
+    }
+
+    void stop () {
+      _recording = false;
+    }
+
+    void recordPublish () {
+      record(WorkloadEvent::Publish);
+    }
+
+    void record (WorkloadEvent::Type type) {
+      if (! _recording.load(std::memory_order_relaxed)) {
+        return;
+      }
+      ThreadLog* log = myLog();
+      uint64_t generation = _generation.load(std::memory_order_acquire);
+      if (log->generation != generation) {
+        log->events.clear();
+        log->generation = generation;
+      }
+      WorkloadEvent e;
+      e.nanos = now() - _start.load(std::memory_order_relaxed);
+      e.thread = log->thread;
+      e.type = type;
+      log->events.push_back(e);
+    }
+
+    // Merges the logs of all threads, only call this after stop() and
+    // when all recording threads are out of their read sections:
+    WorkloadTrace trace () {
+      std::lock_guard<std::mutex> lock(_mutex);
+      WorkloadTrace t;
+      t.nrThreads = static_cast<uint32_t>(_logs.size());
+      uint64_t generation = _generation.load();
+      for (auto& log : _logs) {
+        if (log->generation == generation) {
+          t.events.insert(t.events.end(), log->events.begin(),
+                          log->events.end());
+        }
+      }
+      std::stable_sort(t.events.begin(), t.events.end(),
+                       [] (WorkloadEvent const& a, WorkloadEvent const& b) {
+                         return a.nanos < b.nanos;
+                       });
+      return t;
+    }
+
+  private:
+
+    static int64_t now () {
+      return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    static std::atomic<uint64_t>& serials () {
+      static std::atomic<uint64_t> s(0);
+      return s;
+    }
+
+    ThreadLog* myLog () {
+      for (CacheEntry const& c : _cache) {
+        if (c.recorder == this && c.serial == _serial) {
+          return c.log;
+        }
+      }
+      ThreadLog* log;
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        ThreadLog*& mine = _byThread[std::this_thread::get_id()];
+        if (mine == nullptr) {
+          _logs.emplace_back(new ThreadLog());
+          _logs.back()->thread = static_cast<uint32_t>(_logs.size() - 1);
+          _logs.back()->generation = 0;
+          mine = _logs.back().get();
+        }
+        log = mine;
+      }
+      _cache[_cacheNext++ % CacheSize] = CacheEntry{this, _serial, log};
+      return log;
+    }
+};
+
+// Both are trivially initialized, so they can live in the header:
+inline thread_local WorkloadRecorder::CacheEntry
+  WorkloadRecorder::_cache[WorkloadRecorder::CacheSize] = {};
+inline thread_local unsigned WorkloadRecorder::_cacheNext = 0;
+
+#endif
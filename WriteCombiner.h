@@ -0,0 +1,229 @@
+#ifndef WRITE_COMBINER_H
+#define WRITE_COMBINER_H 1
+
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ProtectedPtr.h"
+
+// A front end for many small updates of an immutable object behind a
+// ProtectedPtr. Instead of copying and publishing the object for every
+// change, callers queue their mutation and a single combiner thread
+// applies all queued mutations to one copy, which it publishes:
+//
+//   WriteCombiner<Config> config(new Config(...),
+//                                std::chrono::microseconds(500), 1000);
+//
+//   uint64_t t = config.submit([] (Config& c) -> void { c.limit = 10; });
+//   config.waitVisible(t);                  // only if needed
+//
+//   {
+//     auto guard(config.read());
+//     use(guard->limit);
+//   }
+//
+// A batch is published when its oldest mutation has waited for
+// maxDelay or when it has maxBatch mutations, so a mutation is visible
+// at the latest after maxDelay plus the time to apply the batch and to
+// run one grace period. The cost of publishing and of the grace period
+// is paid once per batch, not once per mutation. The mutations are
+// applied in the order in which submit() was called. submit() returns a
+// ticket, and waitVisible() returns as soon as the mutation with that
+// ticket can be seen by new readers.
+//
+// Every mutation runs exactly once, on its own copy of the result of
+// the mutations before it, which replaces that result if the mutation
+// returns normally. A mutation that throws, or whose copy cannot be
+// made, therefore has no effect, and the batch goes on with the next
+// one. Its exception is kept and rethrown by waitVisible() for its
+// ticket, so the submitter of a mutation that can throw must wait for
+// it, or the exception is kept until the combiner is destroyed.
+
+template<typename T, typename Protector = DataProtector<64>>
+class WriteCombiner {
+
+  public:
+
+    typedef std::function<void (T&)> Mutation;
+    typedef typename ProtectedPtr<T, Protector>::Guard Guard;
+
+  private:
+
+    ProtectedPtr<T, Protector> _ptr;
+    T const* _current;   // only used by the combiner thread
+
+    std::chrono::steady_clock::duration _maxDelay;
+    size_t _maxBatch;
+
+    std::mutex _mutex;   // protects the following
+    std::condition_variable _queued;
+    std::condition_variable _published;
+    std::vector<Mutation> _queue;
+    std::chrono::steady_clock::time_point _oldest;   // of the queue
+    uint64_t _submitted;   // ticket of the last mutation queued
+    uint64_t _visible;     // ticket of the last mutation published
+    uint64_t _batches;
+    std::map<uint64_t, std::exception_ptr> _failed;   // by ticket
+    bool _stopping;
+
+    std::thread _combiner;
+
+  public:
+
+    // initial must not be nullptr, every batch starts with a copy of the
+    // current object:
+    WriteCombiner (T const* initial, std::chrono::microseconds maxDelay,
+                   size_t maxBatch)
+      : _ptr(initial), _current(initial), _maxDelay(maxDelay),
+        _maxBatch(maxBatch > 0 ? maxBatch : 1), _submitted(0),
+        _visible(0), _batches(0), _stopping(false) {
+      assert(initial != nullptr);
+      _combiner = std::thread([this] () -> void { run(); });
+    }
+
+    // Publishes the mutations still queued, no reader may be active
+    // after this:
+    ~WriteCombiner () {
+      {
+        std::lock_guard<std::mutex> locker(_mutex);
+        _stopping = true;
+      }
+      _queued.notify_one();
+      _combiner.join();
+    }
+
+    WriteCombiner (WriteCombiner const&) = delete;
+    WriteCombiner& operator= (WriteCombiner const&) = delete;
+
+    Guard read () {
+      return _ptr.read();
+    }
+
+    // Queues a mutation and returns its ticket:
+    uint64_t submit (Mutation m) {
+      std::lock_guard<std::mutex> locker(_mutex);
+      if (_queue.empty()) {
+        _oldest = std::chrono::steady_clock::now();
+      }
+      _queue.push_back(std::move(m));
+      if (_queue.size() == 1 || _queue.size() == _maxBatch) {
+        _queued.notify_one();
+      }
+      return ++_submitted;
+    }
+
+    // Waits until the mutation with this ticket is published, must not
+    // be called inside a read section. Rethrows the exception of the
+    // mutation if it failed:
+    void waitVisible (uint64_t ticket) {
+      std::unique_lock<std::mutex> locker(_mutex);
+      _published.wait(locker, [this, ticket] () -> bool {
+        return _visible >= ticket;
+      });
+      auto it = _failed.find(ticket);
+      if (it != _failed.end()) {
+        std::exception_ptr e = it->second;
+        _failed.erase(it);
+        std::rethrow_exception(e);
+      }
+    }
+
+    // Waits until everything submitted so far is published:
+    void flush () {
+      uint64_t ticket;
+      {
+        std::lock_guard<std::mutex> locker(_mutex);
+        ticket = _submitted;
+      }
+      waitVisible(ticket);
+    }
+
+    // Statistics:
+    uint64_t batches () {
+      std::lock_guard<std::mutex> locker(_mutex);
+      return _batches;
+    }
+
+    uint64_t visible () {
+      std::lock_guard<std::mutex> locker(_mutex);
+      return _visible;
+    }
+
+  private:
+
+    void run () {
+      std::vector<Mutation> batch;
+      std::unique_lock<std::mutex> locker(_mutex);
+      while (true) {
+        if (_queue.empty()) {
+          if (_stopping) {
+            return;
+          }
+          _queued.wait(locker);
+          continue;
+        }
+        // Collect until the window is over or the batch is full:
+        if (! _stopping && _queue.size() < _maxBatch) {
+          auto deadline = _oldest + _maxDelay;
+          if (std::chrono::steady_clock::now() < deadline) {
+            _queued.wait_until(locker, deadline);
+            continue;
+          }
+        }
+        batch.swap(_queue);
+        uint64_t ticket = _submitted;
+        locker.unlock();
+
+        std::map<uint64_t, std::exception_ptr> failed;
+        T* next = apply(batch, ticket + 1 - batch.size(), failed);
+        batch.clear();
+        if (next != nullptr) {
+          _current = next;
+          _ptr.publish(next);
+        }
+
+        locker.lock();
+        _failed.insert(failed.begin(), failed.end());
+        _visible = ticket;
+        _batches++;
+        _published.notify_all();
+      }
+    }
+
+    // Applies the batch, whose first mutation has the ticket first, and
+    // returns the new object, or nullptr if every mutation failed. A
+    // mutation that throws may leave its copy half changed, so the copy
+    // is thrown away and the next mutation starts from the last good
+    // result:
+    T* apply (std::vector<Mutation>& batch, uint64_t first,
+              std::map<uint64_t, std::exception_ptr>& failed) {
+      T* next = nullptr;
+      for (size_t i = 0; i < batch.size(); i++) {
+        T* scratch = nullptr;
+        try {
+          scratch = new T(next != nullptr ? *next : *_current);
+          batch[i](*scratch);
+        }
+        catch (...) {
+          failed[first + i] = std::current_exception();
+          delete scratch;
+          continue;
+        }
+        delete next;
+        next = scratch;
+      }
+      return next;
+    }
+};
+
+#endif